@@ -0,0 +1,108 @@
+#version 430 core
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+
+// GPU spectrum analysis, the same as SpectrumAnalyser::processBlock(). One work group per block: the block is
+// windowed into shared memory, FFT'd in place with a radix-2 Cooley-Tukey FFT, turned into a one sided
+// periodogram, and then binned into bars by the filterbank.
+
+// must match GpuAnalyser::MAX_BLOCK_SIZE
+#define MAX_BLOCK_SIZE 2048
+#define LOCAL_SIZE 256
+
+layout (local_size_x = LOCAL_SIZE) in;
+
+layout (std430, binding = 0) readonly buffer Samples { float samples[]; };
+layout (std430, binding = 1) readonly buffer Window { float window[]; };
+layout (std430, binding = 2) readonly buffer Twiddles { vec2 twiddles[]; };
+layout (std430, binding = 3) readonly buffer Bands { uvec4 bands[]; }; // first bin, num bins, weight offset
+layout (std430, binding = 4) readonly buffer Weights { float weights[]; };
+layout (std430, binding = 5) writeonly buffer Bars { uint bars[]; }; // 0..65535 (MAX_BAR_LEVEL)
+layout (std430, binding = 6) writeonly buffer Energies { float energies[]; };
+
+uniform uint blockSize;
+uniform uint log2BlockSize;
+uniform uint hopSize;
+uniform uint numBars;
+uniform uint numSamples; // in this dispatch
+uniform float minVol;
+uniform float maxVol;
+
+shared vec2 data[MAX_BLOCK_SIZE];
+shared float reduceMax[LOCAL_SIZE];
+shared float reduceSum[LOCAL_SIZE];
+
+void main() {
+    uint block = gl_WorkGroupID.x;
+    uint tid = gl_LocalInvocationID.x;
+    uint start = block * hopSize;
+
+    // window the block and store it in bit reversed order, zero padding past the end of the samples
+    for (uint i = tid; i < blockSize; i += LOCAL_SIZE) {
+        uint pos = start + i;
+        float windowed = pos < numSamples ? samples[pos] * window[i] : 0.0;
+        data[bitfieldReverse(i) >> (32u - log2BlockSize)] = vec2(windowed, 0.0);
+    }
+    barrier();
+
+    // butterflies, doubling the transform length each pass
+    for (uint halfLen = 1u; halfLen < blockSize; halfLen <<= 1u) {
+        uint stride = blockSize / (halfLen * 2u);
+        for (uint j = tid; j < blockSize / 2u; j += LOCAL_SIZE) {
+            uint k = j % halfLen;
+            uint even = ((j / halfLen) * halfLen * 2u) + k;
+            uint odd = even + halfLen;
+            vec2 w = twiddles[k * stride];
+            vec2 x = data[odd];
+            vec2 t = vec2(x.x * w.x - x.y * w.y, x.x * w.y + x.y * w.x);
+            data[odd] = data[even] - t;
+            data[even] += t;
+        }
+        barrier();
+    }
+
+    // one sided periodogram, written back over the real part. each thread only touches its own bins
+    uint numBins = blockSize / 2u + 1u;
+    float scale = 1.0 / float(blockSize);
+    float localMax = 0.0;
+    float localSum = 0.0;
+    for (uint k = tid; k < numBins; k += LOCAL_SIZE) {
+        float power = dot(data[k], data[k]) * scale;
+        if (k != 0u && k != numBins - 1u) {
+            power *= 2.0;
+        }
+        data[k].x = power;
+        localMax = max(localMax, power);
+        localSum += power;
+    }
+    reduceMax[tid] = localMax;
+    reduceSum[tid] = localSum;
+    barrier();
+
+    // max and sum across the work group
+    for (uint offset = LOCAL_SIZE / 2u; offset > 0u; offset >>= 1u) {
+        if (tid < offset) {
+            reduceMax[tid] = max(reduceMax[tid], reduceMax[tid + offset]);
+            reduceSum[tid] += reduceSum[tid + offset];
+        }
+        barrier();
+    }
+    float ref = max(reduceMax[0], 1.175494e-38);
+
+    // filterbank, then dB relative to the loudest bin mapped from minVol..maxVol to 0..65535
+    for (uint bar = tid; bar < numBars; bar += LOCAL_SIZE) {
+        uvec4 band = bands[bar];
+        float power = 0.0;
+        for (uint i = 0u; i < band.y; i++) {
+            power += data[band.x + i].x * weights[band.z + i];
+        }
+        float db = 10.0 * log(max(power / ref, 1e-20)) / log(10.0);
+        float value = (db - minVol) / (maxVol - minVol) * 65535.0;
+        bars[block * numBars + bar] = uint(clamp(value, 0.0, 65535.0));
+    }
+
+    // spectral energy, sum(psd)^2
+    if (tid == 0u) {
+        energies[block] = reduceSum[0] * reduceSum[0];
+    }
+}
@@ -1,4 +1,4 @@
-#version 330 core
+#version 430 core
 // Copyright 2024 Matt Young.
 // SPDX-License-Identifier: ISC
 
@@ -13,12 +13,23 @@ uniform mat3 modelInv; // inverse model transform
 uniform mat4 view; // camera view matrix
 uniform mat4 projection; // camera projection matrix
 
+// Every bar is drawn in one instanced draw call, instance i being bar i. Bar heights are read out of a
+// storage buffer, either uploaded each frame or straight from the analysis compute shader (GPU_ANALYSIS).
+uniform float barSpacing; // model space units between bars
+uniform float barMinHeight;
+uniform float barMaxHeight;
+layout (std430, binding = 5) readonly buffer Bars { uint bars[]; }; // 0..65535 (MAX_BAR_LEVEL)
+
 // Sources: 
 // https://github.com/JoeyDeVries/LearnOpenGL/blob/master/src/3.model_loading/1.model_loading/1.model_loading.vs
 // https://learnopengl.com/Lighting/Basic-Lighting
 
 void main() {
-    gl_Position = projection * view * model * vec4(aPos, 1.0);
+    vec3 pos = aPos;
+    // the normals of a box are all axis aligned, so they don't need correcting for this
+    pos.y *= mix(barMinHeight, barMaxHeight, float(bars[gl_InstanceID]) / 65535.0);
+    pos.x += barSpacing * float(gl_InstanceID);
+    gl_Position = projection * view * model * vec4(pos, 1.0);
     Normal = modelInv * aNormal;
-    FragPos = vec3(model * vec4(aPos, 1.0));
+    FragPos = vec3(model * vec4(pos, 1.0));
 }
@@ -0,0 +1,117 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#pragma once
+#include "cosc/util.hpp" // this is used, but clang-tidy cannot detect it correctly
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace cosc {
+
+/// First 8 bytes of an asset archive, see MusicVisAssetArchive
+constexpr std::string_view ASSET_ARCHIVE_MAGIC = "mvassets";
+
+/// Name of the asset archive in the data directory
+constexpr std::string_view ASSET_ARCHIVE_NAME = "assets.pak";
+
+/// Every asset in an asset archive starts on a multiple of this, so that arrays of floats and ints (i.e. mesh
+/// caches) can be read in place
+constexpr size_t ASSET_ALIGNMENT = 16;
+
+/// Contents of an asset: a view of the asset archive if it's in there, otherwise the loose file read into
+/// memory or mapped
+class Asset {
+public:
+    explicit Asset(std::span<const uint8_t> archived)
+        : archived(archived)
+        , inArchive(true) {
+    }
+
+    explicit Asset(std::vector<uint8_t> loose)
+        : loose(std::move(loose)) {
+    }
+
+    explicit Asset(std::unique_ptr<const cosc::util::MappedFile> mapped)
+        : archived(mapped->getBytes())
+        , mapped(std::move(mapped))
+        , inArchive(true) {
+    }
+
+    [[nodiscard]] std::span<const uint8_t> getBytes() const {
+        return inArchive ? archived : std::span<const uint8_t>(loose);
+    }
+
+    [[nodiscard]] std::string_view getString() const {
+        auto bytes = getBytes();
+        return { reinterpret_cast<const char *>(bytes.data()), bytes.size() };
+    }
+
+private:
+    std::span<const uint8_t> archived;
+    std::vector<uint8_t> loose;
+    std::unique_ptr<const cosc::util::MappedFile> mapped;
+    /// True if the bytes are `archived`, i.e. a view of the archive or of `mapped`
+    bool inArchive = false;
+};
+
+/// An asset in an asset archive
+struct ArchivedAsset {
+    std::span<const uint8_t> bytes;
+    /// Modification time of the loose file it was packed from, see MusicVisAsset.modified
+    int64_t modified = 0;
+};
+
+/// The asset archive of a data directory: every asset in one file, opened with a single open() and mmap(),
+/// and indexed by path.
+class AssetArchive {
+public:
+    /// Maps an asset archive. Throws if it isn't one, or its index is out of bounds.
+    explicit AssetArchive(const fs::path &path);
+
+    /// Returns an asset by its path relative to the data directory, or nothing if it isn't in the archive
+    [[nodiscard]] std::optional<ArchivedAsset> find(const std::string &path) const;
+
+    [[nodiscard]] size_t size() const {
+        return index.size();
+    }
+
+private:
+    cosc::util::MappedFile mapping;
+    std::unordered_map<std::string, ArchivedAsset> index;
+};
+
+/// A tiny virtual file system over the data directory. Once mounted, assets under the data directory are read
+/// out of its asset archive, and anything not in the archive (or everything, without one) is read from disk
+/// as usual. So is an asset whose loose file has been edited since the archive was packed.
+namespace vfs {
+
+/// Mounts dataDir/assets.pak, if it exists and ASSET_ARCHIVE is on. Call this once at startup, before any
+/// assets are read; read() is then safe to call from any thread.
+void mount(const fs::path &dataDir);
+
+/// Reads an asset by its full path (i.e. starting with the data directory, like the loose file). Throws if it
+/// isn't in the archive and the file can't be read.
+Asset read(const fs::path &path);
+
+/// Same as read(), but a loose file is mapped rather than read, for big assets that are used in place
+Asset map(const fs::path &path);
+
+} // namespace vfs
+
+namespace analysis {
+
+/**
+ * Packs every file in a data directory, except songs, into its asset archive. Like bundles, the archive is
+ * written to a temporary file and renamed into place.
+ * @param dataDir data directory, the archive is written to dataDir/assets.pak
+ */
+void writeAssetArchive(const fs::path &dataDir);
+
+} // namespace analysis
+
+} // namespace cosc
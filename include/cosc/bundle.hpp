@@ -0,0 +1,81 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#pragma once
+#include "cosc/util.hpp" // this is used, but clang-tidy cannot detect it correctly
+#include "proto/MusicVis.capnp.h"
+#include <capnp/serialize.h>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+
+namespace cosc {
+
+/// First 8 bytes of a song bundle, see MusicVisBundle
+constexpr std::string_view BUNDLE_MAGIC = "mvbundle";
+
+/// File extension of a song bundle, which lives next to the song's directory: data/songs/<name>.musicvis
+constexpr std::string_view BUNDLE_EXTENSION = ".musicvis";
+
+/// Every section of a bundle starts on a multiple of this, so that anything read in place (i.e. the spectrum
+/// header) is as aligned as if it had been mapped on its own
+constexpr size_t BUNDLE_ALIGNMENT = 4096;
+
+/// A song bundle: the song's audio, spectrum and metadata in one file, opened with a single open() and
+/// mmap(). Nothing is copied out of it, the sections are spans of the mapping.
+class SongBundle {
+public:
+    /// Maps a bundle. Throws if it isn't one, or its section table is out of bounds.
+    explicit SongBundle(const fs::path &path);
+
+    /// The FLAC file
+    [[nodiscard]] std::span<const uint8_t> getAudio() const {
+        return audio;
+    }
+
+    /// The chunked spectrum, see SpectrumPager
+    [[nodiscard]] std::span<const uint8_t> getSpectrum() const {
+        return spectrum;
+    }
+
+    /// Hash of the FLAC file, for the spectrum's cache key
+    [[nodiscard]] uint64_t getAudioHash() const {
+        return header.getAudioHash();
+    }
+
+    [[nodiscard]] std::string getName() const {
+        return header.getName().cStr();
+    }
+
+    /// The mapping the sections are in, to share with anything that outlives the bundle
+    [[nodiscard]] const std::shared_ptr<const cosc::util::MappedFile> &getMapping() const {
+        return mapping;
+    }
+
+private:
+    /// Returns a section's bytes, checking that it's in bounds
+    [[nodiscard]] std::span<const uint8_t> section(MusicVisSection::Reader reader) const;
+
+    std::shared_ptr<const cosc::util::MappedFile> mapping;
+    std::unique_ptr<::capnp::FlatArrayMessageReader> headerReader;
+    MusicVisBundle::Reader header;
+    std::span<const uint8_t> audio;
+    std::span<const uint8_t> spectrum;
+};
+
+namespace analysis {
+
+/**
+ * Packs a song directory's audio.flac and spectrum.bin into a bundle. Like the spectrum, the bundle is
+ * written to a temporary file and renamed into place, so it's either all there or not there at all.
+ * If the bundle already has the same audio, and a spectrum with the same cache key, it's left alone.
+ * @param songDir song directory, its spectrum must be chunked (i.e. from musicvis-analyze)
+ * @param bundleFile bundle to write, usually songDir + BUNDLE_EXTENSION
+ * @return true if the bundle was written, false if it was already up to date
+ */
+bool writeBundle(const fs::path &songDir, const fs::path &bundleFile);
+
+} // namespace analysis
+
+} // namespace cosc
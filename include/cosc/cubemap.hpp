@@ -3,6 +3,8 @@
 #pragma once
 #include "cosc/camera.hpp"
 #include "cosc/shader.hpp"
+#include "cosc/texture_stream.hpp"
+#include <memory>
 
 namespace cosc {
 
@@ -14,13 +16,16 @@ public:
     /// @param cubeMapDir path to the cube map PNG image directory
     explicit Cubemap(const fs::path &dataDir, const fs::path &cubeMapDir);
 
+    /// Streams in the faces as they're loaded, call once a frame (including during the intro)
+    void update();
+
     /// Draws using the internal managed shader.
     /// MUST BE CALLED AT THE END OF THE SCENE!
     void draw(const Camera &camera);
 
 private:
     Shader shader;
-    unsigned int textureId;
+    std::unique_ptr<StreamedTexture> texture;
     unsigned int vbo;
     unsigned int vao;
 };
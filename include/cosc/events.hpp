@@ -0,0 +1,81 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#pragma once
+#include "proto/MusicVis.capnp.h"
+#include <capnp/list.h>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace cosc {
+
+/// A detected onset or beat
+struct Event {
+    /// Spectrum block the event happens in
+    uint64_t block;
+    MusicVisEventType type;
+    /// Flux at the event relative to the song's max flux, 0..1
+    float strength;
+};
+
+/// Onsets and beats of a whole song, sorted by block
+struct EventTrack {
+    std::vector<Event> events;
+    /// Estimated tempo in beats per minute, 0 if the song is too short to tell
+    float tempo = 0.f;
+};
+
+namespace analysis {
+
+/**
+ * Detects onsets and the beat grid of a song from its spectral flux.
+ *
+ * Onsets are peaks in the flux that are the max of their neighbourhood and stand out above the local mean.
+ * The tempo is the strongest autocorrelation lag of the flux, biased towards 120 BPM, and the beats are then
+ * placed by dynamic programming: the best chain of flux peaks that are all roughly one beat period apart.
+ * This is the beat tracker from Ellis, "Beat Tracking by Dynamic Programming" (2007), which follows tempo
+ * drift and doesn't need a fixed grid.
+ * @param flux spectral flux of every block in the song, see BlockFeatures::flux
+ * @param blocksPerSecond sampleRate / hopSize
+ */
+EventTrack detectEvents(std::span<const float> flux, double blocksPerSecond);
+
+/// Copies an event track into a Cap'n Proto message
+void writeEvents(MusicVisEvents::Builder builder, const EventTrack &track);
+
+} // namespace analysis
+
+/// Walks through a song's events as it plays. Since playback only goes forwards, advancing to the current
+/// block is amortised O(1) per frame rather than a search. Seeking backwards falls back to a binary search.
+class EventCursor {
+public:
+    EventCursor() = default;
+    explicit EventCursor(::capnp::List<MusicVisEvent>::Reader events);
+
+    /**
+     * Returns the next event at or before `block` that hasn't been returned yet. Call this in a loop each
+     * frame until it returns false, to get every event since the last frame.
+     * @param block current spectrum block, i.e. SongData::blockPos
+     * @param event set to the event, if one is returned
+     */
+    bool next(uint64_t block, MusicVisEvent::Reader &event);
+
+    /// True if there are any events after the current position
+    [[nodiscard]] bool hasUpcoming() const {
+        return pos < events.size();
+    }
+
+    /// The first event after the current position, only valid if hasUpcoming()
+    [[nodiscard]] MusicVisEvent::Reader upcoming() const {
+        return events[pos];
+    }
+
+private:
+    ::capnp::List<MusicVisEvent>::Reader events;
+    /// Index of the first event not yet returned
+    unsigned int pos = 0;
+    /// Block of the last call to next()
+    uint64_t lastBlock = 0;
+};
+
+} // namespace cosc
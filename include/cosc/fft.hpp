@@ -0,0 +1,35 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#pragma once
+#include <complex>
+#include <cstddef>
+#include <span>
+#include <vector>
+
+namespace cosc {
+
+/// A fixed size, iterative radix-2 Fast Fourier Transform.
+/// The twiddle factors and bit reversal permutation are computed once in the constructor, so that forward()
+/// never allocates. This makes it safe to use from real-time contexts.
+/// Based on: https://en.wikipedia.org/wiki/Cooley%E2%80%93Tukey_FFT_algorithm#Data_reordering,_bit_reversal,_and_in-place_algorithms
+class FFT {
+public:
+    /// Creates an FFT of size `size`, which must be a power of two.
+    explicit FFT(size_t size);
+
+    /// Computes the forward FFT of `data` in place. `data` must have exactly getSize() elements.
+    void forward(std::span<std::complex<float>> data) const;
+
+    [[nodiscard]] size_t getSize() const {
+        return size;
+    }
+
+private:
+    size_t size;
+    /// twiddle[k] = e^(-2*pi*i*k/size) for k in 0..size/2
+    std::vector<std::complex<float>> twiddles;
+    /// Bit reversed index for each input index
+    std::vector<size_t> bitReverse;
+};
+
+} // namespace cosc
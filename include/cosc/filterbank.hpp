@@ -0,0 +1,85 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+namespace cosc {
+
+/// How bars are spaced along the frequency axis
+enum class FilterbankScale : uint8_t {
+    /// Evenly spaced in Hz, like scripts/process.py (though the edges differ, see the Filterbank constructor)
+    LINEAR = 0,
+    /// Evenly spaced in log frequency, so each bar covers the same musical interval
+    LOG = 1,
+    /// Evenly spaced on the mel scale
+    MEL = 2,
+    /// Log spaced, with a Hann shaped band whose bandwidth is proportional to its centre frequency
+    CONSTANT_Q = 3,
+};
+
+/// Everything a filterbank's weights depend on
+struct FilterbankConfig {
+    FilterbankScale scale;
+    uint32_t sampleRate;
+    uint32_t fftSize;
+    uint32_t numBars;
+    float freqMin;
+    float freqMax;
+
+    bool operator==(const FilterbankConfig &other) const = default;
+};
+
+/// Maps a power spectrum to bars with a precomputed sparse weight matrix.
+///
+/// Each bar only has non-zero weight over a contiguous run of FFT bins, so the matrix is stored as one
+/// (first bin, bin count, weight offset) band per bar, with all the weights packed into one array. Weights in
+/// each band sum to 1, so a bar is the weighted mean power of its bins.
+/// Bands narrower than an FFT bin (low bars on log scales) interpolate between the two nearest bins instead
+/// of coming out empty.
+class Filterbank {
+public:
+    explicit Filterbank(const FilterbankConfig &config);
+
+    /// Returns a shared filterbank for this config, computing it only the first time it's asked for.
+    /// Filterbanks are immutable, so the returned one can be used from any thread. Thread safe.
+    static std::shared_ptr<const Filterbank> get(const FilterbankConfig &config);
+
+    /**
+     * Applies the filterbank to a power spectrum.
+     * @param power one sided power spectrum, fftSize / 2 + 1 bins
+     * @param bars output power per bar, numBars elements
+     */
+    void apply(std::span<const float> power, std::span<float> bars) const;
+
+    /// The non-zero part of one bar's weights: numBins weights starting at weightOffset, which apply to the
+    /// FFT bins starting at firstBin
+    struct Band {
+        uint32_t firstBin;
+        uint32_t numBins;
+        uint32_t weightOffset;
+    };
+
+    [[nodiscard]] const FilterbankConfig &getConfig() const {
+        return config;
+    }
+
+    /// One band per bar
+    [[nodiscard]] std::span<const Band> getBands() const {
+        return bands;
+    }
+
+    /// Weights of every band, packed together
+    [[nodiscard]] std::span<const float> getWeights() const {
+        return weights;
+    }
+
+private:
+    FilterbankConfig config;
+    std::vector<Band> bands;
+    std::vector<float> weights;
+};
+
+} // namespace cosc
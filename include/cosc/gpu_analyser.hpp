@@ -0,0 +1,116 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#pragma once
+#include "cosc/filterbank.hpp"
+#include "cosc/shader.hpp"
+#include "cosc/spectrum_analyser.hpp"
+#include "cosc/util.hpp" // this is used, but clang-tidy cannot detect it correctly
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <span>
+
+// from glad/gl.h, so this header doesn't drag in all of GL
+typedef struct __GLsync *GLsync; // NOLINT
+
+namespace cosc {
+
+/// Shader storage buffer binding the bar buffer is bound to, in both the analysis compute shader and the bar
+/// vertex shader
+constexpr unsigned int BAR_BUFFER_BINDING = 5;
+
+/// Runs the spectrum analysis on the GPU, in a compute shader (data/analyse.comp.glsl): window, radix-2 FFT,
+/// power spectrum, filterbank and dB conversion, one work group per block. Many blocks can be analysed in one
+/// dispatch.
+///
+/// The output bars stay on the GPU in a shader storage buffer, which the bar shader can read straight from
+/// with bindBars(), so nothing has to come back to the CPU except the spectral energy, and that can come back
+/// a frame or so late without stalling, see requestEnergy(). Only the bars and the spectral energy are
+/// computed, not the rest of BlockFeatures.
+///
+/// Needs a current OpenGL 4.3+ context.
+class GpuAnalyser {
+public:
+    /**
+     * Creates the analyser, uploading the window, twiddle factors and filterbank to the GPU.
+     * @param params analysis parameters. blockSize must be at most MAX_BLOCK_SIZE.
+     * @param sampleRate sample rate in Hz
+     * @param shaderPath path to analyse.comp.glsl
+     * @param maxBlocks most blocks one dispatch() can analyse, the GPU buffers are sized for this many
+     */
+    explicit GpuAnalyser(
+        const AnalysisParams &params, uint32_t sampleRate, const fs::path &shaderPath, size_t maxBlocks = 1);
+    ~GpuAnalyser();
+
+    GpuAnalyser(const GpuAnalyser &) = delete;
+    GpuAnalyser &operator=(const GpuAnalyser &) = delete;
+
+    /// Largest block size the compute shader can do, since each work group keeps a whole block in shared
+    /// memory. Must match MAX_BLOCK_SIZE in analyse.comp.glsl.
+    static constexpr uint32_t MAX_BLOCK_SIZE = 2048;
+
+    /**
+     * Analyses `numBlocks` blocks of mono audio, block i starting at sample i * hopSize. Blocks that run off
+     * the end of `mono` are zero padded. The results are left on the GPU, see bindBars() and read().
+     * @param mono mono samples in the range -1..1
+     * @param numBlocks number of blocks, at most the constructor's maxBlocks
+     */
+    void dispatch(std::span<const float> mono, size_t numBlocks);
+
+    /**
+     * Reads the results of the last dispatch() back to the CPU. This waits for the GPU to finish.
+     * @param bars numBlocks * numBars bars, may be empty to only read the energies
+     * @param energies numBlocks spectral energies
+     */
+    void read(std::span<uint16_t> bars, std::span<float> energies);
+
+    /**
+     * Starts copying the spectral energy of the first block of the last dispatch() back to the CPU, without
+     * waiting for it. Pick it up a frame or so later with pollEnergy().
+     */
+    void requestEnergy();
+
+    /**
+     * Picks up the newest energy from requestEnergy() that the GPU has finished with. Never blocks.
+     * @param energy set to the energy, if one has arrived since the last call, otherwise left alone
+     * @return true if `energy` was updated
+     */
+    bool pollEnergy(float &energy);
+
+    /// Binds the bars of the last dispatch() to BAR_BUFFER_BINDING, one uint (0..MAX_BAR_LEVEL) per bar,
+    /// block after block
+    void bindBars() const;
+
+private:
+    AnalysisParams params;
+    Shader shader;
+    std::shared_ptr<const Filterbank> filterbank;
+
+    /// Most blocks in one dispatch
+    size_t maxBlocks;
+    /// Number of blocks in the last dispatch
+    size_t dispatched = 0;
+
+    /// Shader storage buffers
+    unsigned int sampleBuffer = 0;
+    unsigned int windowBuffer = 0;
+    unsigned int twiddleBuffer = 0;
+    unsigned int bandBuffer = 0;
+    unsigned int weightBuffer = 0;
+    unsigned int barBuffer = 0;
+    unsigned int energyBuffer = 0;
+
+    /// Number of energy readbacks that can be in flight at once
+    static constexpr size_t READBACK_SLOTS = 3;
+
+    /// Buffer the energies are copied into on the GPU, one float per slot. A slot is only read back with
+    /// glGetBufferSubData() once its fence has signalled, so that never waits on the GPU.
+    unsigned int readbackBuffer = 0;
+    /// Fence for each slot's copy, null if the slot is free
+    std::array<GLsync, READBACK_SLOTS> readbackFences {};
+    /// Slot the next requestEnergy() copies into, and the oldest slot that may still be in flight
+    size_t readbackNext = 0;
+    size_t readbackOldest = 0;
+};
+
+} // namespace cosc
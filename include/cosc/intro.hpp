@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: ISC
 #pragma once
 #include "cosc/shader.hpp"
+#include "cosc/texture_stream.hpp"
 #include <vector>
 
 namespace cosc {
@@ -10,13 +11,16 @@ class IntroManager {
 public:
     explicit IntroManager(const fs::path &dataDir);
 
+    /// Streams in the slides as they're loaded, call once a frame
+    void update();
+
     /// Draws the intro slide. Slide number is 0 indexed (0, 1, 2).
     void draw(size_t slideNumber);
 
 private:
     cosc::Shader shader;
-    /// Index in this array is the slide number (0, 1, 2) and the value is the GL texture ID.
-    std::vector<unsigned int> textureIds;
+    /// Index in this array is the slide number (0, 1, 2)
+    std::vector<StreamedTexture> slides;
     unsigned int vbo = 0;
     unsigned int vao = 0;
 };
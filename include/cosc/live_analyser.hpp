@@ -0,0 +1,66 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#pragma once
+#include "cosc/spectrum_analyser.hpp"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+namespace cosc {
+
+/// Computes bars in real-time from the audio that's currently being played, instead of reading them from a
+/// precomputed spectrum.
+///
+/// The SDL audio callback pushes samples into a lock-free single producer ring buffer of recent mono
+/// samples. The render thread then runs the FFT over the most recent block of that ring whenever it wants
+/// new bars. This keeps the audio callback down to a mono mixdown and a copy, so it never allocates, locks or
+/// does an FFT.
+class LiveAnalyser {
+public:
+    explicit LiveAnalyser(const AnalysisParams &params, uint32_t sampleRate);
+
+    /// Pushes `frames` frames of interleaved s32 PCM into the ring. Called from the audio callback.
+    /// Real-time safe: does not allocate or lock.
+    void push(const int32_t *pcm, size_t frames, unsigned int channels);
+
+    /**
+     * Analyses the most recent block of audio. Called from the render thread.
+     * @param bars output bars, must have numBars elements
+     * @return spectral energy ratio in 0..1, relative to the (slowly decaying) peak spectral energy so far,
+     * since unlike a precomputed spectrum we can't know the song's max ahead of time
+     */
+    float update(std::span<uint16_t> bars);
+
+    /// Copies the most recent block of audio out of the ring, padding the front with silence if we haven't
+    /// got a full block yet. Called from the render thread. The span is valid until the next call.
+    std::span<const float> latestBlock();
+
+    /// Converts a spectral energy to a ratio in 0..1 relative to the decaying peak, and updates the peak.
+    /// Called from the render thread.
+    float energyRatio(float energy);
+
+    [[nodiscard]] const AnalysisParams &getParams() const {
+        return analyser.getParams();
+    }
+
+private:
+    SpectrumAnalyser analyser;
+
+    /// Ring of recent mono samples. These are atomics only so that the render thread's reads can't race with
+    /// the audio thread's writes; relaxed atomic float loads/stores compile to plain moves.
+    std::unique_ptr<std::atomic<float>[]> ring;
+    /// Ring capacity in samples, a power of two several blocks long so that the audio thread can't lap the
+    /// render thread while it's copying a block out
+    size_t capacity;
+    /// Total number of samples ever pushed, the ring index is this modulo capacity
+    std::atomic<uint64_t> writePos = 0;
+
+    /// Most recent block, copied out of the ring (render thread only)
+    std::vector<float> block;
+    /// Peak spectral energy seen so far, for normalisation (render thread only)
+    float peakEnergy = 0.f;
+};
+
+} // namespace cosc
@@ -6,6 +6,7 @@
 #include "cosc/vertex.hpp"
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
+#include <span>
 #include <vector>
 
 namespace cosc {
@@ -14,6 +15,7 @@ namespace cosc {
 /// Based on: https://learnopengl.com/Model-Loading/Mesh
 class Mesh {
 public:
+    /// Vertices and indices, only kept for meshes that were imported rather than loaded from a mesh cache
     std::vector<Vertex> verts;
     std::vector<unsigned int> indices;
     std::vector<Texture> textures;
@@ -23,14 +25,24 @@ public:
         : verts(std::move(vertices))
         , indices(std::move(indices))
         , textures(std::move(textures)) {
-        setupMesh();
+        setupMesh(verts, this->indices);
+    }
+
+    /// Uploads the vertices and indices straight from wherever they are (i.e. a mapped mesh cache) without
+    /// keeping a copy
+    explicit Mesh(std::span<const Vertex> vertices, std::span<const unsigned int> indices) {
+        setupMesh(vertices, indices);
     }
 
     void draw(cosc::Shader &shader) const;
 
+    /// Draws `count` instances of the mesh in one draw call, the shader tells them apart by gl_InstanceID
+    void drawInstanced(size_t count) const;
+
 private:
     unsigned int vao, vbo, ebo;
-    void setupMesh();
+    size_t numIndices = 0;
+    void setupMesh(std::span<const Vertex> vertices, std::span<const unsigned int> indices);
 };
 
 }; // namespace cosc
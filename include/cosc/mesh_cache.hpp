@@ -0,0 +1,38 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#pragma once
+#include "cosc/mesh.hpp"
+#include "cosc/util.hpp" // this is used, but clang-tidy cannot detect it correctly
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace cosc {
+
+/// Extension of a model's mesh cache, which lives next to the model: cube.dae is cached in cube.mesh
+constexpr std::string_view MESH_CACHE_EXTENSION = ".mesh";
+
+/// Loads each model's meshes once, and shares them between every Model of it. A model's vertex data is only
+/// on the GPU once no matter how many Models use it, and they all draw from the same VAO.
+class MeshCache {
+public:
+    /**
+     * Returns the meshes of a model, loading them if this is the first time it's been asked for. They're
+     * loaded from the model's mesh cache if it's up to date, otherwise the model is imported with Assimp
+     * and the mesh cache is written for next time. Must be called with the GL context current.
+     * @param path path to the model file, i.e. data/cube.dae
+     */
+    std::shared_ptr<const std::vector<Mesh>> get(const fs::path &path);
+
+private:
+    static std::vector<Mesh> load(const fs::path &path);
+
+    std::mutex mutex;
+    /// Meshes by normalised model path
+    std::unordered_map<std::string, std::shared_ptr<const std::vector<Mesh>>> loaded;
+};
+
+} // namespace cosc
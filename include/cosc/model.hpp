@@ -2,29 +2,32 @@
 // SPDX-License-Identifier: ISC
 #pragma once
 #include "cosc/mesh.hpp"
+#include "cosc/mesh_cache.hpp"
 #include "cosc/shader.hpp"
-#include <assimp/Importer.hpp>
-#include <assimp/postprocess.h>
-#include <assimp/scene.h>
 #include <filesystem>
 #include <glm/mat4x4.hpp>
+#include <memory>
 #include <vector>
 
 namespace fs = std::filesystem;
 
 namespace cosc {
 
-/// A wrapper around a model loaded using the Assimp library.
+/// A model: its meshes, and where it is in the world. The meshes are loaded by MeshCache.
 /// Based on: https://learnopengl.com/Model-Loading/Model
 class Model {
 public:
-    explicit Model(const fs::path &path);
-    explicit Model(const std::vector<cosc::Mesh> &meshes)
-        : meshes(meshes) {};
+    /// Creates a model of the file at `path`, with its meshes from `cache` (see MeshCache::get())
+    explicit Model(MeshCache &cache, const fs::path &path);
+    explicit Model(std::shared_ptr<const std::vector<cosc::Mesh>> meshes)
+        : meshes(std::move(meshes)) {};
 
     /// Draws the model using the specified shader program.
     void draw(Shader &shader);
 
+    /// Draws `count` instances of the model using the specified shader program, all with the same transform.
+    void drawInstanced(Shader &shader, size_t count);
+
     /// Model transform matrix. By default, the identity matrix.
     glm::mat4 transform { 1.f };
 
@@ -49,9 +52,10 @@ public:
     void applyTransform();
 
 private:
-    std::vector<Mesh> meshes;
-    void processNode(aiNode *node, const aiScene *scene);
-    Mesh processMesh(aiMesh *mesh);
+    /// Shared with every other model of the same file
+    std::shared_ptr<const std::vector<Mesh>> meshes;
+    /// Pushes the transform and inverse transform to the shader
+    void setTransform(Shader &shader);
 };
 
 }; // namespace cosc
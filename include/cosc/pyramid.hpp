@@ -0,0 +1,98 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#pragma once
+#include "proto/MusicVis.capnp.h"
+#include <capnp/list.h>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace cosc {
+
+/// Most bars (rows * numBars) in the finest stored level of a time pyramid. Finer levels would only be read
+/// when zoomed in far enough that reading the blocks themselves is just as cheap, and would make the pyramid
+/// about as big as the spectrum.
+constexpr size_t MAX_PYRAMID_BARS = 1 << 20;
+
+namespace analysis {
+
+/// Builds the time pyramid of a spectrum (MusicVisBars.pyramid) as its blocks are analysed, in one pass and
+/// without keeping the blocks around. Only the finest stored level is accumulated, the coarser ones are
+/// worked out from it at the end.
+class PyramidBuilder {
+public:
+    PyramidBuilder(uint64_t numBlocks, size_t numBars);
+
+    /// Adds the bars of the next blocks, row major numBars per block, in 0..MAX_BAR_LEVEL. Blocks must be
+    /// added in order.
+    void add(std::span<const uint16_t> bars);
+
+    /// Allocates every level in `bars`, with their final sizes. This only needs the number of blocks, so it
+    /// can be done for a header that's written before any blocks are analysed and filled in later.
+    void init(MusicVisBars::Builder bars, MusicVisBarFormat format) const;
+
+    /// Fills in the levels allocated by init(), once every block has been added
+    void write(MusicVisBars::Builder bars, MusicVisBarFormat format) const;
+
+private:
+    /// Number of rows in the level with 2^shift blocks per row
+    [[nodiscard]] uint64_t rowsAt(unsigned int shift) const;
+
+    uint64_t numBlocks;
+    size_t numBars;
+    /// log2 of the blocks per row of the finest stored level
+    unsigned int baseShift = 1;
+    /// Number of levels, down to (and including) the one with a single row
+    unsigned int numLevels = 0;
+    /// Number of blocks added so far
+    uint64_t added = 0;
+    /// Max and sum of each bar over each row of the finest level
+    std::vector<uint16_t> baseMax;
+    std::vector<uint64_t> baseSum;
+};
+
+} // namespace analysis
+
+/// Reads the time pyramid of a spectrum, for views that show a long stretch of the song at once (scrub bars,
+/// waterfalls, overviews). These read one pyramid row per column of the view instead of every block. When the
+/// spectrum is paged, the pyramid is in its header, so it's read straight out of the memory mapped file.
+class SpectrumPyramid {
+public:
+    SpectrumPyramid() = default;
+    explicit SpectrumPyramid(MusicVisBars::Reader spectrum, size_t numBars);
+
+    /// True if the spectrum has no pyramid (i.e. it was generated by scripts/process.py)
+    [[nodiscard]] bool empty() const {
+        return levels.size() == 0;
+    }
+
+    /**
+     * Picks the level to draw `blocks` blocks across `columns` columns: the coarsest one that still has at
+     * least one row per column.
+     * @return level index, or nothing if even the finest level is too coarse, in which case the view should
+     * read the blocks themselves
+     */
+    [[nodiscard]] std::optional<size_t> levelFor(uint64_t blocks, size_t columns) const;
+
+    [[nodiscard]] uint64_t getBlocksPerRow(size_t level) const {
+        return levels[level].getBlocksPerRow();
+    }
+
+    [[nodiscard]] size_t getRows(size_t level) const;
+
+    /**
+     * Decodes rows first..first + count of a level.
+     * @param max max of each bar over each row, count * numBars elements in 0..MAX_BAR_LEVEL
+     * @param mean mean of each bar over each row, same layout as max
+     */
+    void read(
+        size_t level, size_t first, size_t count, std::span<uint16_t> max, std::span<uint16_t> mean) const;
+
+private:
+    ::capnp::List<MusicVisPyramidLevel>::Reader levels;
+    MusicVisBarFormat format = MusicVisBarFormat::U8;
+    size_t numBars = 0;
+};
+
+} // namespace cosc
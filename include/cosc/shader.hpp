@@ -13,6 +13,9 @@ class Shader {
 public:
     explicit Shader(const fs::path &vertexPath, const fs::path &fragmentPath);
 
+    /// Makes a compute shader program
+    explicit Shader(const fs::path &computePath);
+
     ~Shader();
 
     // TODO other constructors (copy constructor etc)
@@ -21,6 +24,7 @@ public:
 
     void setBool(const std::string &name, bool value);
     void setInt(const std::string &name, int value);
+    void setUint(const std::string &name, unsigned int value);
     void setFloat(const std::string &name, float value);
     void setMat4(const std::string &name, const glm::mat4 &value);
     void setMat3(const std::string &name, const glm::mat3 &value);
@@ -2,63 +2,173 @@
 // SPDX-License-Identifier: ISC
 #pragma once
 #include "cosc/lib/dr_flac.h"
+#include "cosc/live_analyser.hpp"
+#include "cosc/pyramid.hpp"
+#include "cosc/spectrum_analyser.hpp"
+#include "cosc/spectrum_pager.hpp"
 #include "cosc/util.hpp" // this is used, but clang-tidy cannot detect it correctly
 #include "proto/MusicVis.capnp.h"
 #include <SDL2/SDL_audio.h>
+#include <atomic>
 #include <capnp/message.h>
-#include <capnp/serialize-packed.h>
+#include <capnp/serialize.h>
 #include <cstdint>
 #include <memory>
+#include <span>
 #include <string>
+#include <vector>
 
 namespace cosc {
 /// Encapsulates decoded song data.
 class SongData {
 public:
     /**
-     * Load song data. This will both load the FLAC file and the Cap'n Proto serialised spectrum.
+     * Load song data. This will both map the FLAC file and load the Cap'n Proto serialised spectrum. The FLAC
+     * file is only decoded when something needs its samples, see setupAudio(). If there's a
+     * song bundle (data/songs/<songName>.musicvis), both come from that instead of the song directory.
+     * If the spectrum is missing, or was generated from a different FLAC file or with different analysis
+     * parameters, it's regenerated in-process and written back to spectrum.bin for next time.
+     * Chunked spectrums (anything not from process.py) are paged in as the song plays, see SpectrumPager.
+     * With LIVE_ANALYSIS, the spectrum isn't loaded at all and `live` is used instead.
      * @param dataDir path to data dir
      * @param songName song name
+     * @param params analysis parameters used if the spectrum has to be (re)generated
      */
-    explicit SongData(const fs::path &dataDir, const fs::path &songName);
+    explicit SongData(const fs::path &dataDir, const fs::path &songName, const AnalysisParams &params = {});
     ~SongData();
 
     // TODO other constructors
 
-    /// Sets up the SDL audio stream with the obtained audio config from the sound driver.
+    /**
+     * Converts the song to the obtained audio config from the sound driver, so mixAudio() only has to copy
+     * it. With PCM_CACHE, the converted song is mapped from data/songs/<songName>.pcm if it's from the same
+     * FLAC file and for the same format, otherwise the FLAC file is decoded and the cache is written for next
+     * time.
+     */
     void setupAudio(SDL_AudioFormat wanted, SDL_AudioFormat obtained);
 
     /**
      * Requests the mixing of 'len' bytes into the buffer `stream`.
-     * If the audio playback is finished, no bytes will be mixed.
+     * If the audio playback is finished, the rest of the buffer is silence.
      */
     void mixAudio(uint8_t *stream, int len);
 
+    /// Number of bars, from either the spectrum or the live analyser
+    [[nodiscard]] size_t getNumBars() const;
+
+    /// Number of spectrum blocks (not with LIVE_ANALYSIS)
+    [[nodiscard]] size_t getNumBlocks() const {
+        return numBlocks;
+    }
+
+    /// Bars of spectrum block `block`, numBars values in 0..MAX_BAR_LEVEL. Valid until getBars() or
+    /// getFeatures() is called for a block in a different chunk. Render thread only, not with LIVE_ANALYSIS.
+    [[nodiscard]] std::span<const uint16_t> getBars(size_t block) {
+        auto &blockChunk = chunkFor(block);
+        return std::span(blockChunk.bars).subspan((block - blockChunk.first) * numBars, numBars);
+    }
+
+    /// Features of spectrum block `block`. Render thread only, not with LIVE_ANALYSIS.
+    [[nodiscard]] const BlockFeatures &getFeatures(size_t block) {
+        auto &blockChunk = chunkFor(block);
+        return blockChunk.features[block - blockChunk.first];
+    }
+
+    /// Audio sample rate in Hz
+    [[nodiscard]] uint32_t getSampleRate() const {
+        return sampleRate;
+    }
+
     /// Song name
     std::string name;
 
-    /// Deserialised music vis spectrum data
+    /// Deserialised music vis spectrum data (not loaded with LIVE_ANALYSIS). If the spectrum is chunked, this
+    /// is just the header, so use getBars() and getFeatures() rather than its per block lists.
     MusicVisBars::Reader spectrum;
 
+    /// Onsets and beats (not loaded with LIVE_ANALYSIS)
+    MusicVisEvents::Reader events;
+
+    /// Time pyramid, for views of a long stretch of the song at once (not loaded with LIVE_ANALYSIS, and
+    /// empty for spectrums from process.py)
+    SpectrumPyramid pyramid;
+
+    /// Real-time analyser fed by mixAudio() (only with LIVE_ANALYSIS)
+    std::unique_ptr<LiveAnalyser> live;
+
     /// Current audio position in samples
     size_t audioPos = 0;
 
-    /// Current audio position in spectrum blocks
-    size_t blockPos = 0;
+    /// Current audio position in spectrum blocks. Written by mixAudio() on the audio thread and read by the
+    /// render thread. It's only ever a position, nothing else is published through it, so relaxed loads and
+    /// stores are enough.
+    std::atomic<size_t> blockPos = 0;
+
+    /// Samples between the start of consecutive spectrum blocks
+    size_t hopSize = 0;
 
 private:
-    /// Capnp message reader
-    std::unique_ptr<::capnp::PackedFdMessageReader> reader;
-    /// Cap'n Proto serialised spectrum bars
+    /// Tries to load a single message spectrum (i.e. from process.py) from spectrumFile into `message`.
+    /// Returns false if it's missing or stale and must be regenerated.
+    bool loadSpectrum(const fs::path &spectrumFile, uint64_t cacheKey);
+
+    /// Analyses the decoded audio and writes it to spectrumFile, then pages it in from there. If it can't be
+    /// written, or spectrumFile is empty, it's kept in `message` instead.
+    void generateSpectrum(const fs::path &spectrumFile, uint64_t cacheKey, const AnalysisParams &params);
+
+    /// Decodes the whole FLAC file into `audio` across all hardware threads, unless that's already been done
+    void decodeAudio();
+
+    /// Tries to map the PCM cache into `pcm`. Returns false if it's missing, or isn't for this FLAC file and
+    /// `format`.
+    bool loadPcmCache(SDL_AudioFormat format);
+
+    /// Writes `pcm` to the PCM cache, logging rather than throwing if that fails
+    void writePcmCache(SDL_AudioFormat format);
+
+    /// Returns the chunk containing `block`, paging it in if it isn't the current one
+    const SpectrumChunk &chunkFor(size_t block) {
+        if (block < chunk->first || block >= chunk->first + chunk->count) {
+            // only possible when paged, otherwise the one chunk has every block
+            chunk = pager->get(block);
+        }
+        return *chunk;
+    }
+
+    size_t numBars = 0;
+    size_t numBlocks = 0;
+
+    /// Pages in the spectrum, if it's chunked
+    std::unique_ptr<SpectrumPager> pager;
+
+    /// Whole spectrum, if it's from process.py or couldn't be written to disk
     ::capnp::MallocMessageBuilder message;
-    /// Capnp file FD
-    int fd = -1;
+
+    /// Chunk that the last getBars() or getFeatures() came from, which keeps it alive. If the spectrum isn't
+    /// paged, this is the whole spectrum.
+    std::shared_ptr<const SpectrumChunk> chunk;
+
+    /// The FLAC file, and the mapping it's in (the song's own file, or the song bundle)
+    std::shared_ptr<const cosc::util::MappedFile> flacMapping;
+    std::span<const uint8_t> flac;
+    /// hashBytes() of the FLAC file
+    uint64_t audioHash = 0;
+    fs::path pcmCacheFile;
 
     unsigned int channels;
     unsigned int sampleRate;
-    drflac_int32 *audio;
+    /// Decoded audio, s32 interleaved. Only decoded if needed, and freed once converted for playback unless
+    /// the live analyser needs it.
+    std::vector<drflac_int32> audio;
     /// Audio size in samples
     drflac_uint64 audioLen = 0;
-    SDL_AudioStream *audioStream;
+
+    /// Song in the audio device's format, either in the mapped PCM cache or in pcmBuffer
+    std::span<const uint8_t> pcm;
+    std::unique_ptr<cosc::util::MappedFile> pcmMapping;
+    std::vector<uint8_t> pcmBuffer;
+    /// Next byte of `pcm` to play
+    size_t pcmPos = 0;
+    size_t bytesPerFrame = 1;
 };
 } // namespace cosc
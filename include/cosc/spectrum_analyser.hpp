@@ -0,0 +1,285 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#pragma once
+#include "cosc/fft.hpp"
+#include "cosc/filterbank.hpp"
+#include "cosc/util.hpp" // this is used, but clang-tidy cannot detect it correctly
+#include "proto/MusicVis.capnp.h"
+#include <capnp/message.h>
+#include <complex>
+#include <cstdint>
+#include <functional>
+#include <kj/io.h>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace cosc {
+
+/// Bars are levels in 0..MAX_BAR_LEVEL in memory, whatever precision they're stored with (see
+/// MusicVisBarFormat)
+constexpr uint16_t MAX_BAR_LEVEL = 65535;
+
+/// Spectrum analysis parameters. Most defaults match scripts/process.py, but two don't: hopSize is 256
+/// (process.py doesn't overlap its blocks, like a hopSize of blockSize) and scale is LOG (process.py spaces
+/// its bars linearly, like LINEAR). So with the defaults, spectrums from the two differ.
+struct AnalysisParams {
+    /// Number of samples that constitutes one spectrum block. This is also the FFT size, so it must be a
+    /// power of two.
+    uint32_t blockSize = 1024;
+
+    /// Number of samples between the start of one block and the next. Making this smaller than blockSize
+    /// overlaps the blocks, giving more spectrum frames per second (1024/256 is ~172 per second at 44.1 kHz)
+    /// for the same frequency resolution.
+    uint32_t hopSize = 256;
+
+    /// Number of bars we want to draw
+    uint32_t numBars = 32;
+
+    /// Human hearing range in Hz
+    float freqMin = 20.f;
+    float freqMax = 20'000.f;
+
+    /// How bars are spaced between freqMin and freqMax
+    FilterbankScale scale = FilterbankScale::LOG;
+
+    /// Min/max volume in dBFS
+    float minVol = -80.f;
+    float maxVol = 0.f;
+
+    /// Kaiser window shape parameter. 8.6 is the default used by spectrum.py (and numpy.kaiser in its docs).
+    float kaiserBeta = 8.6f;
+
+    /// How bars are stored in spectrum.bin. u8 is plenty for a few bars, but bands visibly on slow fades
+    /// across a big LED wall.
+    MusicVisBarFormat barFormat = MusicVisBarFormat::U8;
+};
+
+/// Scalar features of one spectrum block, computed alongside its bars
+struct BlockFeatures {
+    /// Spectral energy, same as process.py: sum(psd)^2
+    float spectralEnergy = 0.f;
+    /// RMS amplitude of the (unwindowed) samples, 0..1
+    float rms = 0.f;
+    /// Spectral centroid in Hz, i.e. the PSD weighted mean frequency. Roughly, how "bright" the block sounds.
+    float centroid = 0.f;
+    /// Spectral flux: mean increase in dB of each bar since the previous block, ignoring bars that got
+    /// quieter. Spikes on note onsets and drum hits.
+    float flux = 0.f;
+    /// Sum of the PSD below 250 Hz, 250 Hz to 4 kHz, and above 4 kHz respectively
+    float lowEnergy = 0.f;
+    float midEnergy = 0.f;
+    float highEnergy = 0.f;
+};
+
+/// Computes bars from blocks of mono audio: a Kaiser windowed periodogram, binned into bars by a Filterbank
+/// and then converted to dB. This is the same pipeline as process_block() in scripts/process.py, but the bars
+/// don't come out identical: the bar edges differ (see Filterbank), and each bar is the dB of its mean power
+/// rather than the mean of its bins' dB.
+/// Everything (window, FFT tables, filterbank) is precomputed in the constructor, so processBlock() does not
+/// allocate. One instance must not be shared between threads.
+/// Spectral flux depends on the previous block, so blocks should be processed in order. The first block an
+/// analyser processes has zero flux.
+class SpectrumAnalyser {
+public:
+    explicit SpectrumAnalyser(const AnalysisParams &params, uint32_t sampleRate);
+
+    /**
+     * Processes a block of mono samples into bars in the range 0..MAX_BAR_LEVEL.
+     * @param block up to blockSize samples in the range -1..1. Short blocks (i.e. the end of the song) are
+     * zero padded.
+     * @param bars output bars, must have numBars elements
+     * @return the features of this block
+     */
+    BlockFeatures processBlock(std::span<const float> block, std::span<uint16_t> bars);
+
+    [[nodiscard]] const AnalysisParams &getParams() const {
+        return params;
+    }
+
+private:
+    AnalysisParams params;
+    FFT fft;
+    /// Kaiser window coefficients
+    std::vector<float> window;
+    /// FFT input/output
+    std::vector<std::complex<float>> fftBuf;
+    /// One sided power spectral density
+    std::vector<float> psd;
+    /// Maps the PSD to bars, shared between all analysers with the same config
+    std::shared_ptr<const Filterbank> filterbank;
+    /// Power of each bar
+    std::vector<float> barPower;
+    /// Power of each bar in the previous block in dB, for spectral flux
+    std::vector<float> prevBarDb;
+    /// True once prevBarDb holds a block
+    bool hasPrevious = false;
+    /// Width of each FFT bin in Hz
+    float binHz;
+    /// First FFT bin of the mid and high bands
+    size_t midBin;
+    size_t highBin;
+};
+
+namespace analysis {
+
+/// Version of the analysis algorithm. This is part of the cache key, so bump it whenever a change to the
+/// analysis would change its output, and every cached spectrum will be regenerated.
+constexpr uint32_t ANALYSIS_VERSION = 9;
+
+/// Number of blocks per chunk when streaming, this bounds the analysis memory use, and the unit that chunked
+/// spectrums are paged in. At the default hop size this is about 24 seconds of audio per chunk.
+constexpr uint32_t CHUNK_BLOCKS = 4096;
+
+/// Most bytes the bars of one chunk may take up in memory. Spectrums with thousands of bars get shorter
+/// chunks, so that paging them doesn't need hundreds of megabytes.
+constexpr size_t MAX_CHUNK_BAR_BYTES = 1 << 20;
+
+/// Fewest blocks per chunk, however many bars there are, so the chunk index and per chunk overhead stay small
+constexpr uint32_t MIN_CHUNK_BLOCKS = 64;
+
+/// Returns the number of blocks per chunk for these parameters: CHUNK_BLOCKS, or fewer if there are so many
+/// bars that the chunk would be bigger than MAX_CHUNK_BAR_BYTES.
+uint32_t chunkBlocks(const AnalysisParams &params);
+
+/// First 8 bytes of a chunked spectrum file, see MusicVisBars.chunkSize
+constexpr std::string_view SPECTRUM_MAGIC = "musicvis";
+
+/**
+ * Parses a command line option that sets an analysis parameter, shared by the visualiser and
+ * musicvis-analyze: `--bars N` sets numBars and `--bar-format u8|u16|f16` sets barFormat.
+ * Throws std::invalid_argument if the option's value is missing or invalid.
+ * @param argc, argv as passed to main()
+ * @param i index of the option in argv. If it's an analysis option, this is moved on to its value.
+ * @param params the parameters to set
+ * @return true if argv[i] was an analysis option
+ */
+bool parseAnalysisOption(int argc, char *argv[], int &i, AnalysisParams &params);
+
+/// Returns a Kaiser window of `size` samples, same as numpy.kaiser(size, beta)
+std::vector<float> kaiserWindow(size_t size, float beta);
+
+/// Computes the cache key of a spectrum from the hash of the raw (still encoded) FLAC file and the analysis
+/// parameters.
+uint64_t cacheKey(uint64_t flacHash, const AnalysisParams &params);
+
+/// Sets each feature in `max` to the larger of it and the same feature in `features`
+void maxFeatures(BlockFeatures &max, const BlockFeatures &features);
+
+/// Copies features into a Cap'n Proto message. Spectral energy is stored separately in spectralEnergyBlocks,
+/// for compatibility with process.py, so it isn't written.
+void writeFeatures(MusicVisFeatures::Builder builder, const BlockFeatures &features);
+
+/// Reads features back from a Cap'n Proto message, see writeFeatures()
+BlockFeatures readFeatures(MusicVisFeatures::Reader reader, float spectralEnergy);
+
+/// Reads up to `frames` frames of interleaved s32 PCM into `out`, returning the number of frames actually
+/// read (0 at the end of the song).
+using PcmSource = std::function<uint64_t(int32_t *out, uint64_t frames)>;
+
+/// Receives a finished chunk of consecutive blocks: the index of its first block, numBars bars per block,
+/// and the features of each block.
+using ChunkSink = std::function<void(
+    uint64_t firstBlock, std::span<const uint16_t> bars, std::span<const BlockFeatures> features)>;
+
+/// Returns a source that reads from `frames` frames of interleaved s32 PCM that's already in memory
+PcmSource memorySource(const int32_t *pcm, uint64_t frames, unsigned int channels);
+
+/// Mixes `frames` frames of interleaved s32 PCM down to mono floats in the range -1..1.
+void mixToMono(const int32_t *pcm, size_t frames, unsigned int channels, std::span<float> out);
+
+/**
+ * Analyses a song by streaming it through the FFT, chunkBlocks() blocks at a time. Only one chunk's worth of
+ * audio and bars is held in memory at once, no matter how long the song is. The blocks within each chunk are
+ * split across all hardware threads, unless `parallel` is false.
+ * @param source where to read PCM from
+ * @param frames total number of PCM frames in the song. Exactly ceil(frames / hopSize) blocks are produced;
+ * if the source ends early the rest of the song is treated as silence.
+ * @param channels number of channels
+ * @param sampleRate sample rate in Hz
+ * @param params analysis parameters
+ * @param sink receives each chunk in order
+ * @param parallel if false, analyse on the calling thread only. Used when songs are already being analysed
+ * in parallel, so that we don't oversubscribe the CPU.
+ */
+void analyseStream(const PcmSource &source, uint64_t frames, unsigned int channels, uint32_t sampleRate,
+    const AnalysisParams &params, const ChunkSink &sink, bool parallel = true);
+
+/**
+ * Analyses an entire song that's already in memory and fills in the spectrum message, as a single non
+ * chunked message. The cache key is left for the caller to fill in.
+ * @param pcm interleaved s32 PCM, as returned by dr_flac
+ * @param frames number of PCM frames
+ * @param channels number of channels
+ * @param sampleRate sample rate in Hz
+ * @param params analysis parameters
+ * @param bars message to fill in
+ */
+void analysePcm(const int32_t *pcm, uint64_t frames, unsigned int channels, uint32_t sampleRate,
+    const AnalysisParams &params, MusicVisBars::Builder bars);
+
+/// Number of bytes one bar takes up in a bar matrix of this format
+size_t bytesPerBar(MusicVisBarFormat format);
+
+/// Number of bars in a spectrum, from whichever of barCount and numBars it has
+size_t getNumBars(MusicVisBars::Reader spectrum);
+
+/**
+ * Encodes a row major matrix of bars, as stored in MusicVisBars.barMatrix.
+ * @param bars bars in 0..MAX_BAR_LEVEL
+ * @param numBars bars per block
+ * @param format how to store each bar
+ * @param delta if true, also delta encode along time, as stored in MusicVisChunk.barDeltas
+ * @param out bars.size() * bytesPerBar(format) bytes
+ */
+void encodeBars(std::span<const uint16_t> bars, size_t numBars, MusicVisBarFormat format, bool delta,
+    std::span<uint8_t> out);
+
+/// Inverse of encodeBars(). `bars` must have in.size() / bytesPerBar(format) elements.
+void decodeBars(std::span<const uint8_t> in, size_t numBars, MusicVisBarFormat format, bool delta,
+    std::span<uint16_t> bars);
+
+/// Sets the bar count and format fields of a spectrum header
+void setBarCount(MusicVisBars::Builder bars, const AnalysisParams &params);
+
+/**
+ * Analyses a song with analyseStream() and writes it to `spectrumFile` as a chunked spectrum, in constant
+ * memory. The file is written to a temporary file first and then renamed into place, so a crash never leaves
+ * behind a truncated spectrum.
+ * @param spectrumFile where to write the spectrum
+ * @param cacheKey cache key to write to the header
+ * @param source where to read PCM from
+ * @param frames total number of PCM frames in the song
+ * @param channels number of channels
+ * @param sampleRate sample rate in Hz
+ * @param params analysis parameters
+ * @param parallel see analyseStream()
+ */
+void writeChunkedSpectrum(const fs::path &spectrumFile, uint64_t cacheKey, const PcmSource &source,
+    uint64_t frames, unsigned int channels, uint32_t sampleRate, const AnalysisParams &params,
+    bool parallel = true);
+
+/// Writes a file using `write`, which is given a buffered stream to the file and its fd. The data goes to a
+/// temporary file first and is then renamed into place, so a crash never leaves behind a truncated file.
+/// Failing to create, write or rename the file throws a std::system_error.
+void writeAtomically(const fs::path &file,
+    const std::function<void(kj::BufferedOutputStreamWrapper &output, int fd)> &write);
+
+/// Reads the cache key from the header of an existing chunked spectrum file, without reading the rest of it.
+/// Returns 0 (i.e. unknown) if the file doesn't exist, can't be read, or isn't chunked.
+uint64_t readCacheKey(const fs::path &spectrumFile);
+
+/**
+ * Streams a FLAC file through the analyser and writes a chunked spectrum to `spectrumFile`, in constant
+ * memory. Like writeChunkedSpectrum(), the file only appears once it's complete.
+ * If `spectrumFile` already has the cache key of this FLAC file and params, nothing is done.
+ * @param parallel see analyseStream()
+ * @return true if the spectrum was generated, false if it was already up to date
+ */
+bool analyseFile(const fs::path &flacFile, const fs::path &spectrumFile, const AnalysisParams &params,
+    bool parallel = true);
+
+} // namespace analysis
+
+} // namespace cosc
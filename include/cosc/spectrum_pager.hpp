@@ -0,0 +1,112 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#pragma once
+#include "cosc/spectrum_analyser.hpp"
+#include "cosc/util.hpp" // this is used, but clang-tidy cannot detect it correctly
+#include "proto/MusicVis.capnp.h"
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+namespace cosc {
+
+/// Decoded blocks first..first + count of a spectrum
+struct SpectrumChunk {
+    uint64_t first = 0;
+    uint64_t count = 0;
+    /// Row major count * numBars matrix of bars, in 0..MAX_BAR_LEVEL
+    std::vector<uint16_t> bars;
+    /// Features of each block
+    std::vector<BlockFeatures> features;
+};
+
+/// Reads a chunked spectrum file a chunk at a time, so that only the part of the song that's playing is ever
+/// decoded and in memory, no matter how long the song is.
+///
+/// The file is memory mapped, and the chunk index in its header is used to find any chunk without reading
+/// the ones before it. A background thread keeps a small window of decoded chunks around the most recently
+/// requested one: the one before it (for small seeks backwards) and a few after it, so that playing through
+/// the song never has to wait for a decode. Anything else in the window is dropped.
+class SpectrumPager {
+public:
+    /// Opens a chunked spectrum file, as written by analysis::writeChunkedSpectrum(). Throws if it isn't one.
+    explicit SpectrumPager(const fs::path &spectrumFile);
+
+    /**
+     * Reads a chunked spectrum that's part of a bigger mapping, i.e. a song bundle.
+     * @param file mapping the spectrum is in, kept alive for as long as the pager is
+     * @param spectrum the spectrum within the mapping, word aligned, or empty for the whole mapping
+     */
+    explicit SpectrumPager(
+        std::shared_ptr<const cosc::util::MappedFile> file, std::span<const uint8_t> spectrum = {});
+    ~SpectrumPager();
+
+    SpectrumPager(const SpectrumPager &) = delete;
+    SpectrumPager &operator=(const SpectrumPager &) = delete;
+
+    /**
+     * Returns the chunk containing `block`, and moves the window to it. If the chunk isn't decoded yet (i.e.
+     * after a seek), only that chunk is decoded, on the calling thread. Thread safe.
+     * @param block block index, clamped to the last block
+     */
+    std::shared_ptr<const SpectrumChunk> get(uint64_t block);
+
+    /// Spectrum header. Its per block lists are empty, use get() for those.
+    [[nodiscard]] MusicVisBars::Reader getHeader() const {
+        return header;
+    }
+
+    [[nodiscard]] MusicVisEvents::Reader getEvents() const {
+        return events;
+    }
+
+    [[nodiscard]] uint64_t getNumBlocks() const {
+        return numBlocks;
+    }
+
+private:
+    /// Decodes chunk `index` from the mapping. Thread safe.
+    [[nodiscard]] std::shared_ptr<const SpectrumChunk> decode(size_t index) const;
+
+    /// Pager thread main loop
+    void run();
+
+    std::shared_ptr<const cosc::util::MappedFile> mapping;
+    /// The spectrum within the mapping, chunk offsets are relative to this
+    std::span<const uint8_t> bytes;
+    /// Reader for the unpacked header, which points straight into the mapping
+    std::unique_ptr<::capnp::FlatArrayMessageReader> headerReader;
+    MusicVisBars::Reader header;
+    /// Events, copied out of the file since they're packed
+    ::capnp::MallocMessageBuilder eventsMessage;
+    MusicVisEvents::Reader events;
+
+    uint64_t numBlocks = 0;
+    uint64_t chunkSize = 0;
+    size_t numChunks = 0;
+    size_t numBars = 0;
+    MusicVisBarFormat barFormat = MusicVisBarFormat::U8;
+    /// Byte offset of each chunk in the mapping, plus the end of the last one
+    std::vector<uint64_t> offsets;
+
+    /// Protects everything below
+    std::mutex mutex;
+    /// Signalled when `wanted` changes, or when the pager thread should stop
+    std::condition_variable wake;
+    /// Decoded chunks by index
+    std::map<size_t, std::shared_ptr<const SpectrumChunk>> resident;
+    /// Index of the most recently requested chunk, the window is centred on this
+    size_t wanted = 0;
+    bool stop = false;
+
+    std::thread thread;
+};
+
+} // namespace cosc
@@ -0,0 +1,60 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace cosc {
+
+/**
+ * A small dependency graph of tasks, for overlapping the independent steps of startup. Each task runs once
+ * all of its dependencies have finished: worker tasks on their own thread, and main thread tasks (anything
+ * that touches SDL video or the GL context) on the thread that calls run(), in the order they become ready.
+ *
+ * Every task's start and end is recorded, so the startup timeline can be logged afterwards.
+ */
+class TaskGraph {
+public:
+    /// Which thread a task runs on
+    enum class Thread { MAIN, WORKER };
+
+    /**
+     * Adds a task. Tasks can only depend on tasks that were added before them, so the graph can't have
+     * cycles.
+     * @param name name of the task in the timeline
+     * @param thread where the task runs
+     * @param func the task, exceptions it throws are rethrown by run()
+     * @param dependencies tasks (as returned by add()) that must finish before this one starts
+     * @return the task, for depending on it
+     */
+    size_t add(std::string name, Thread thread, std::function<void()> func,
+        const std::vector<size_t> &dependencies = {});
+
+    /// Runs every task and blocks until they're all done. If a task throws, no more tasks are started, and
+    /// the first exception is rethrown once the running ones have finished.
+    void run();
+
+    /// Logs when each task ran, relative to the start of run(), in the order they started
+    void logTimeline() const;
+
+private:
+    struct Task {
+        std::string name;
+        Thread thread;
+        std::function<void()> func;
+        std::vector<size_t> dependents;
+        /// Dependencies that haven't finished yet
+        size_t waitingOn = 0;
+        std::chrono::steady_clock::time_point begin;
+        std::chrono::steady_clock::time_point end;
+    };
+
+    std::vector<Task> tasks;
+    std::chrono::steady_clock::time_point runBegin;
+    std::chrono::steady_clock::time_point runEnd;
+};
+
+} // namespace cosc
@@ -0,0 +1,127 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#pragma once
+#include "cosc/assets.hpp"
+#include "cosc/util.hpp" // this is used, but clang-tidy cannot detect it correctly
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace cosc {
+
+/// Extension of an image's texture cache, which lives next to the image: skybox/front.png is cached in
+/// skybox/front.tex
+constexpr std::string_view TEXTURE_CACHE_EXTENSION = ".tex";
+
+/// One mip level of a TextureImage
+struct TextureLevel {
+    uint32_t width;
+    uint32_t height;
+    std::span<const uint8_t> data;
+};
+
+/**
+ * An image with its full mip chain, ready to upload. With TEXTURE_CACHE, it comes from the image's texture
+ * cache if that's up to date, which holds the levels as the driver compressed them (i.e. BCn) the first time
+ * the image was uploaded, or as RGBA8 if it couldn't. Otherwise the image is decoded, and its mip chain
+ * generated, as RGBA8.
+ *
+ * Loading only touches the CPU, so it can be done on any thread. Uploading needs the GL context.
+ */
+class TextureImage {
+public:
+    /**
+     * Loads an image.
+     * @param path path to the image, i.e. a PNG file
+     * @param flipVertically flip the image so its first row is the bottom, like OpenGL expects
+     */
+    TextureImage(const fs::path &path, bool flipVertically);
+
+    /**
+     * Checks that the driver supports the compressed format of cached levels, and if it doesn't, decodes the
+     * image instead, like it would have been if there was no cache. This changes the levels, so it must be
+     * called before copyTo() or getSize() when uploading through a pixel buffer object. Needs the GL context.
+     */
+    void ensureSupported();
+
+    /**
+     * Uploads every mip level to `target` of the bound texture, i.e. GL_TEXTURE_2D or one face of a cube
+     * map. If the image was decoded rather than cached, the driver compresses it on the way, and needsCache()
+     * is true: see prepareCache() for writing the texture cache for next time.
+     * @param bufferOffset if set, the levels are read from the bound GL_PIXEL_UNPACK_BUFFER at this offset,
+     * where copyTo() put them, rather than from memory. ensureSupported() must have been called first.
+     * Otherwise, upload() calls it itself.
+     */
+    void upload(unsigned int target, std::optional<size_t> bufferOffset = std::nullopt);
+
+    /// True if the texture cache is missing or stale, so it should be written once the image is uploaded
+    [[nodiscard]] bool needsCache() const {
+        return TEXTURE_CACHE == 1 && !cached;
+    }
+
+    /**
+     * Asks the driver how it stored `target` of the bound texture, which upload() filled. Only call this once
+     * the upload has finished (i.e. its fence has signalled), or it waits for it.
+     * @return bytes readBack() needs for the compressed levels, or 0 if the driver didn't compress them, in
+     * which case there's nothing to read back and writeCache() writes the decoded levels
+     */
+    size_t prepareCache(unsigned int target);
+
+    /**
+     * Starts reading the compressed levels of `target` of the bound texture back into the bound
+     * GL_PIXEL_PACK_BUFFER, one after the other from `bufferOffset`. Returns without waiting for them.
+     */
+    void readBack(unsigned int target, size_t bufferOffset) const;
+
+    /**
+     * Writes the texture cache. Failing to is only logged, since the image can always be decoded again.
+     * @param compressedLevels what readBack() read, once the GPU has finished. prepareCache()'s size, so
+     * empty if the driver didn't compress the levels.
+     */
+    void writeCache(std::span<const uint8_t> compressedLevels) const;
+
+    /// Copies every level, one after the other, into `dest`, which must be getSize() bytes. This is how
+    /// upload() expects them to be laid out in a pixel buffer object.
+    void copyTo(std::span<uint8_t> dest) const;
+
+    /// Total bytes of every level
+    [[nodiscard]] size_t getSize() const;
+
+    [[nodiscard]] size_t getNumLevels() const {
+        return levels.size();
+    }
+
+    /// True if the levels are compressed (only ever from the texture cache), false if they're RGBA8
+    [[nodiscard]] bool isCompressed() const {
+        return compressed;
+    }
+
+private:
+    /// Tries to load the levels from the texture cache. Returns false if it's missing or stale.
+    bool loadCache();
+
+    /// Decodes the image file's contents, and generates its mip chain, into `levels`
+    void decode(std::span<const uint8_t> png);
+
+    fs::path path;
+    bool flipVertically;
+    fs::path cacheFile;
+    uint64_t sourceHash = 0;
+    std::vector<TextureLevel> levels;
+    /// Compressed internal format of the levels, if `compressed`
+    uint32_t format = 0;
+    bool compressed = false;
+    /// True if the levels came from the texture cache, so it doesn't need writing
+    bool cached = false;
+    /// Format the driver stored the uploaded levels in, and their sizes if it compressed them, from
+    /// prepareCache()
+    uint32_t cacheFormat = 0;
+    std::vector<size_t> cacheSizes;
+    /// Where the levels are: the mapped texture cache, or the decoded image and its mips
+    std::optional<Asset> cache;
+    std::vector<std::vector<uint8_t>> decoded;
+};
+
+} // namespace cosc
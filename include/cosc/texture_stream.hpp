@@ -0,0 +1,86 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#pragma once
+#include "cosc/texture_cache.hpp"
+#include "cosc/util.hpp" // this is used, but clang-tidy cannot detect it correctly
+#include <future>
+#include <vector>
+
+// from glad/gl.h, so this header doesn't drag in all of GL
+typedef struct __GLsync *GLsync; // NOLINT
+
+namespace cosc {
+
+/**
+ * A texture that's loaded in the background. Its images are loaded (see TextureImage) on worker threads, then
+ * copied into a pixel buffer object and uploaded from there, so the driver can DMA them to the GPU without
+ * stalling the frame. Until the upload's fence has signalled, getTextureId() returns a 1x1 black placeholder,
+ * so it can be drawn straight away.
+ *
+ * Images that weren't in the texture cache are cached once they're resident: what the driver compressed them
+ * to is read back through another pixel buffer object, and written out once its fence has signalled.
+ *
+ * Everything except the image loading happens on the GL thread, in the constructor and update().
+ */
+class StreamedTexture {
+public:
+    /**
+     * Creates the placeholder and starts loading the images. Must be called with the GL context current.
+     * @param paths one image for a GL_TEXTURE_2D, or six for a GL_TEXTURE_CUBE_MAP (in the order of its
+     * faces, +X, -X, +Y, -Y, +Z, -Z)
+     * @param flipVertically see TextureImage
+     */
+    StreamedTexture(const std::vector<fs::path> &paths, bool flipVertically);
+
+    StreamedTexture(const StreamedTexture &) = delete;
+    StreamedTexture &operator=(const StreamedTexture &) = delete;
+    StreamedTexture(StreamedTexture &&) = default;
+    StreamedTexture &operator=(StreamedTexture &&) = default;
+
+    /// Moves the upload along: starts it once every image is loaded, swaps in the texture once the GPU has
+    /// it, then writes the texture cache once that's read back. Never waits on the GPU, call it once a
+    /// frame. Throws if an image failed to load.
+    void update();
+
+    /// The texture to bind: the real one once it's resident, otherwise the placeholder
+    [[nodiscard]] unsigned int getTextureId() const {
+        return isResident() ? textureId : placeholderId;
+    }
+
+    [[nodiscard]] bool isResident() const {
+        return state == State::RESIDENT;
+    }
+
+private:
+    enum class State { LOADING, UPLOADING, RESIDENT };
+
+    /// Uploads the loaded images through a pixel buffer object, and fences the upload
+    void startUpload(std::vector<TextureImage> loaded);
+
+    /// Once the upload is done, starts reading back the images that need caching, and fences the read
+    void startReadBack();
+
+    /// Once the read back is done, writes the texture caches
+    void finishReadBack();
+
+    /// Target of image i, i.e. its face of a cube map
+    [[nodiscard]] unsigned int getImageTarget(size_t i) const;
+
+    /// GL_TEXTURE_2D or GL_TEXTURE_CUBE_MAP
+    unsigned int target;
+    std::vector<std::future<TextureImage>> pending;
+    State state = State::LOADING;
+    unsigned int placeholderId = 0;
+    unsigned int textureId = 0;
+    unsigned int pixelBuffer = 0;
+    GLsync fence = nullptr;
+
+    /// Images waiting to be cached, and the pixel buffer object their compressed levels are read back into,
+    /// one image after the other
+    std::vector<TextureImage> images;
+    std::vector<size_t> readBackSizes;
+    unsigned int readBackBuffer = 0;
+    GLsync readBackFence = nullptr;
+};
+
+} // namespace cosc
@@ -1,8 +1,14 @@
 // Copyright 2024 Matt Young.
 // SPDX-License-Identifier: ISC
 #pragma once
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
+#include <functional>
+#include <span>
 #include <string>
+#include <type_traits>
+#include <vector>
 
 namespace fs = std::filesystem;
 
@@ -20,9 +26,39 @@ namespace fs = std::filesystem;
 /// If true, skip intro
 #define SKIP_INTRO 0
 
+/// If true, compute the bars in real-time from the audio being played, instead of using spectrum.bin
+#define LIVE_ANALYSIS 0
+
+/// If true (with LIVE_ANALYSIS), run the live analysis in a compute shader, and have the bar shader read the
+/// bars straight from the GPU
+#define GPU_ANALYSIS 0
+
+/// If true, cache the song's decoded PCM, already in the audio device's format, next to the song
+/// (data/songs/<name>.pcm). Later runs then map it instead of decoding the FLAC file.
+#define PCM_CACHE 1
+
+/// If true, load assets from data/assets.pak if there is one (see musicvis-analyze --assets), instead of from
+/// the loose files in the data directory. Turn this off when editing assets, or re-pack them afterwards.
+#define ASSET_ARCHIVE 1
+
+/// If true, cache textures next to their image (<name>.tex) with their full mip chain, compressed by the
+/// driver if it can. Later runs then upload the cache instead of decoding the image.
+#define TEXTURE_CACHE 1
+
+/// If true, cut to the next camera animation on beats from the spectrum's event track (every BEATS_PER_CUT
+/// beats), instead of when each animation finishes. No effect with LIVE_ANALYSIS.
+#define CUT_ON_BEAT 0
+
+/// Number of beats between camera cuts with CUT_ON_BEAT, 16 is four bars of 4/4
+constexpr size_t BEATS_PER_CUT = 16;
+
 /// Units between bars
 constexpr float BAR_SPACING = 2.5;
 
+/// Most bars that are laid out at BAR_SPACING and full width. Past this, bars get narrower and closer
+/// together so that the row stays the same width, and the camera animations still frame it.
+constexpr size_t BAR_LAYOUT_BARS = 32;
+
 /// Scaling factor for the bars
 constexpr float BAR_SCALING = 0.1;
 
@@ -70,9 +106,67 @@ constexpr bool isInIntro(AppStatus status) {
 
 namespace cosc::util {
 
-/// Reads the contents of path to a string.
+/// Reads the contents of path to a string. Goes through the asset archive, if one is mounted (see
+/// vfs::read()).
 std::string readPathToString(const fs::path &path);
 
+/// Reads the contents of path to a byte vector.
+std::vector<uint8_t> readPathToBytes(const fs::path &path);
+
+/// Default seed for hashBytes()
+constexpr uint64_t HASH_SEED = 0;
+
+/// Hashes a buffer with XXH64, which is fast enough to hash entire FLAC files on startup and has a proper
+/// avalanche, so every input bit affects every output bit. It's the key for every cache, so a collision would
+/// silently serve stale data. It's only used for change detection, not security. Chain calls by passing the
+/// previous hash as the seed.
+uint64_t hashBytes(std::span<const uint8_t> bytes, uint64_t seed = HASH_SEED);
+
+/// Hashes the contents of a file, same as hashBytes() over the whole file. The file is mmap()ed rather than
+/// read, so hashing a huge file doesn't need a huge buffer.
+uint64_t hashFile(const fs::path &path);
+
+/// A read-only memory mapped file, unmapped when this is destroyed. The mapping is shared, so any other
+/// process that maps the same file shares its pages in the page cache.
+class MappedFile {
+public:
+    explicit MappedFile(const fs::path &path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    /// Contents of the file. Empty files have no mapping, and give an empty span.
+    [[nodiscard]] std::span<const uint8_t> getBytes() const {
+        return { static_cast<const uint8_t *>(data), size };
+    }
+
+    /// Tells the kernel how the mapping is going to be accessed, e.g. MADV_SEQUENTIAL. Purely a hint.
+    void advise(int advice) const;
+
+private:
+    void *data = nullptr;
+    size_t size = 0;
+};
+
+/// Hashes a trivially copyable value, for mixing parameters into a hash.
+template <typename T>
+uint64_t hashValue(const T &value, uint64_t seed = HASH_SEED) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    return hashBytes(std::span(reinterpret_cast<const uint8_t *>(&value), sizeof(T)), seed);
+}
+
+/// Converts a float to the bits of an IEEE half precision float, rounding to nearest even. Out of range
+/// values become infinity.
+uint16_t floatToHalf(float value);
+
+/// Converts the bits of an IEEE half precision float to a float, exactly
+float halfToFloat(uint16_t half);
+
+/// Splits the range 0..count into contiguous chunks and runs `func(begin, end)` on each chunk, using one
+/// thread per hardware thread. Blocks until all chunks are done.
+void parallelFor(size_t count, const std::function<void(size_t begin, size_t end)> &func);
+
 // Source: https://github.com/libgdx/libgdx/blob/master/gdx/src/com/badlogic/gdx/math/MathUtils.java#L385
 // Apache 2.0
 constexpr double mapRange(
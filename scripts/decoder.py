@@ -2,12 +2,48 @@
 # Copyright 2024 Matt Young.
 # SPDX-License-Identifier: ISC
 
+import struct
 import sys
 from pathlib import Path
 import capnp
 import matplotlib.pyplot as plt
 
 
+def bar_codes(matrix, bar_format):
+    """Splits a bar matrix into the code stored for each bar, see MusicVisBarFormat"""
+    if bar_format == "u8":
+        return list(matrix)
+    # 16 bit formats are little endian
+    return list(struct.unpack(f"<{len(matrix) // 2}H", bytes(matrix)))
+
+
+def bar_levels(codes, bar_format):
+    """Converts bar codes to levels in 0..1"""
+    if bar_format == "u8":
+        return [code / 255 for code in codes]
+    if bar_format == "u16":
+        return [code / 65535 for code in codes]
+    halves = struct.unpack(f"<{len(codes)}e", struct.pack(f"<{len(codes)}H", *codes))
+    return [min(max(value, 0.0), 1.0) for value in halves]
+
+
+def matrix_rows(matrix, num_bars, bar_format):
+    """Splits a row major bar matrix into one list of bar levels (0..1) per block"""
+    levels = bar_levels(bar_codes(matrix, bar_format), bar_format)
+    return [levels[i:i + num_bars] for i in range(0, len(levels), num_bars)]
+
+
+def undelta_rows(deltas, num_bars, bar_format):
+    """Undoes the delta encoding of MusicVisChunk.barDeltas, returning one list of bar levels (0..1) per
+    block"""
+    codes = bar_codes(deltas, bar_format)
+    modulus = 256 if bar_format == "u8" else 65536
+    for i in range(num_bars, len(codes)):
+        codes[i] = (codes[i] + codes[i - num_bars]) % modulus
+    levels = bar_levels(codes, bar_format)
+    return [levels[i:i + num_bars] for i in range(0, len(levels), num_bars)]
+
+
 def main():
     if len(sys.argv) < 2:
         print(f"Usage: {sys.argv[0]} song_name")
@@ -25,15 +61,44 @@ def main():
     assert data_path.exists()
 
     with open(data_path, "rb") as f:
-        music_vis = musicvis_capnp.MusicVisBars.read_packed(f)
+        # chunked spectrums (from musicvis-analyze) start with a magic, then an unpacked header with the
+        # offset of each MusicVisChunk message, and then the events
+        chunked = f.read(8) == b"musicvis"
+        if chunked:
+            music_vis = musicvis_capnp.MusicVisBars.read(f)
+        else:
+            f.seek(0)
+            music_vis = musicvis_capnp.MusicVisBars.read_packed(f)
+        # numBars is 0 if there are too many bars for it, in which case barCount has the real number
+        num_bars = music_vis.barCount or music_vis.numBars
+        bar_format = str(music_vis.barFormat)
+        if music_vis.barMatrix:
+            blocks = matrix_rows(music_vis.barMatrix, num_bars, bar_format)
+        else:
+            blocks = [[bar / 255 for bar in block] for block in music_vis.blocks]
+        energies = list(music_vis.spectralEnergyBlocks)
+        max_energy = music_vis.maxSpectralEnergy
+        events = music_vis.events
+
+        if chunked:
+            offsets = list(music_vis.chunkOffsets)
+            for offset in offsets[:-1]:
+                f.seek(offset)
+                chunk = musicvis_capnp.MusicVisChunk.read_packed(f)
+                blocks.extend(undelta_rows(chunk.barDeltas, num_bars, bar_format))
+                energies.extend(chunk.spectralEnergyBlocks)
+            f.seek(offsets[-1])
+            events = musicvis_capnp.MusicVisEvents.read_packed(f)
 
-        for i, block in enumerate(music_vis.blocks):
+        for i, block in enumerate(blocks):
             print(f"Block {i}: {block}")
 
-        print(f"Num bars: {music_vis.numBars}\nSample rate: {music_vis.sampleRate} Hz\nBlock size: "
-              f"{music_vis.blockSize} samples\nMax spectral energy: {music_vis.maxSpectralEnergy}")
+        print(f"Num bars: {num_bars} ({bar_format})\nSample rate: {music_vis.sampleRate} Hz\nBlock size: "
+              f"{music_vis.blockSize} samples\nHop size: {music_vis.hopSize or music_vis.blockSize} samples\n"
+              f"Max spectral energy: {max_energy}\nEvents: {len(events.events)}\nTempo: {events.tempo:.1f} BPM\n"
+              f"Pyramid levels: {[level.blocksPerRow for level in music_vis.pyramid]}")
 
-        plt.plot(music_vis.spectralEnergyBlocks)
+        plt.plot(energies)
         plt.show()
 
 
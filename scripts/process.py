@@ -19,12 +19,11 @@ import sys
 from pathlib import Path
 import audiofile
 import numpy as np
+from numpy.lib.stride_tricks import sliding_window_view
 import matplotlib.pyplot as plt
 from matplotlib.animation import FuncAnimation
-from spectrum import Periodogram
-from spectrum import tools as stools
 import capnp
-from typing import List, Tuple
+from typing import List, Optional, Tuple
 from tqdm import tqdm
 
 # Number of samples that constitutes one spectrum block
@@ -41,33 +40,29 @@ FREQ_MAX = 20_000
 MIN_VOL = -80
 MAX_VOL = 0
 
+# Kaiser window shape parameter, the default used by spectrum.py's Periodogram
+KAISER_BETA = 8.6
+
+# Number of blocks to FFT at once. This bounds memory use, a 5 minute song is only ~13k blocks anyway.
+BATCH_BLOCKS = 4096
+
 # TODO make these command line args, this is stupid
 PLOT = False
 PLOT_FFT = True
 PLOT_BAR = False
 
 
-def filter_freqs(freqs: List[Tuple[float, float]], min: float, max: float) -> List[float]:
+def bar_ranges(freqs: np.ndarray) -> List[Optional[Tuple[int, int]]]:
     """
-    Filters a list of (frequency, amplitude) tuple pairs to make sure the frequency is
-    between min and max inclusive.
-    """
-    return [x[1] for x in freqs if x[0] >= min and x[0] <= max]
-
+    Works out which FFT bins go in each bar, as [start, end) index ranges into freqs, or None if the bar is
+    empty. This only depends on the block size and sample rate, so it's done once per song rather than for
+    every block.
 
-def process_block(block: np.ndarray, sampling_rate: int, ax=None) -> Tuple[float, List[int]]:
+    This reproduces the original per-block list filtering exactly, including its quirks: bar edges are
+    linearly spaced, both edges are inclusive, an empty bar's range is merged into the next bar, and the last
+    bar covers only the final edge to FREQ_MAX.
     """
-    Processes a block of audio samples into a bar spectrogram.
-    The output bars are in the range 0..255 and can be fed into the visualiser directly.
-
-    Returns: Tuple(float: Spectral energy, List[int]: Bars)
-    """
-    # compute periodogram using kaiser windowing function
-    # TODO go back to scipy (see obsidian) so we can do DC removal??
-    p = Periodogram(block, sampling=sampling_rate, window="kaiser")
-    p.run()
-
-    # we want to sample along yf logarithmically, just like it's graphed
+    # we want to sample along the frequencies logarithmically, just like they're graphed
     # This used to be logarithmic sampling using np.geomspace, but the problem is that it seems like the
     # results from both scipy.signal.periodogram and spectrum.py's Periodogram, the frequencies, are _already_
     # logarithmically distributed. so the linear sampling actually ends up looking OK? I'm not sure if this is
@@ -75,60 +70,93 @@ def process_block(block: np.ndarray, sampling_rate: int, ax=None) -> Tuple[float
     # TODO verify this is what we want
     samples = np.linspace(FREQ_MIN, FREQ_MAX, NUM_BARS)
 
-    # convert power spectrum to dB
-    # source: https://github.com/cokelaer/spectrum/blob/master/src/spectrum/psd.py#L691 (given norm=True)
-    # and we use stools.log10 not np.log10 since it has a little bit of code to handle NaNs correctly
-    db = 10 * stools.log10(p.psd / max(p.psd))
-
-    # Now we pair frequencies with their samples
-    pairs = [x for x in zip(p.frequencies(), db)]
+    def between(lo: float, hi: float) -> Tuple[int, int]:
+        # freqs is sorted, so the bins in lo..hi inclusive are a contiguous range
+        return int(np.searchsorted(freqs, lo, side="left")), int(np.searchsorted(freqs, hi, side="right"))
 
-    # Finalised output bars
-    bars = []
-
-    # Sample bars using our samples array
+    ranges = []
     prev = samples[0]
     for cur in samples[1:]:
-        # Take the mean amplitude in this block
-        filtered = filter_freqs(pairs, prev, cur)
-        # Sometimes the bin is empty, this just happens, we just return 0.
-        if len(filtered) == 0:
-            bars.append(0)
+        start, end = between(prev, cur)
+        # Sometimes the bin is empty, this just happens, the bar will be 0. prev stays put, so the next bar
+        # picks up this one's range as well.
+        if start >= end:
+            ranges.append(None)
             continue
+        ranges.append((start, end))
+        prev = cur
 
-        mean = np.mean(filtered)
+    # the final bar (cur..FREQ_MAX)
+    start, end = between(prev, cur)
+    if start >= end:
+        ranges.append(None)
+    else:
+        start, end = between(cur, FREQ_MAX)
+        ranges.append((start, end) if start < end else None)
+    return ranges
 
-        # Map range MIN_VOL..MAX_VOL dB to 0..255 (where 0=MIN_DB dB; 255=MAX_DB dB)
-        val = np.interp(mean, [MIN_VOL, MAX_VOL], [0, 255])
-        bars.append(val)
 
-        # Move along to the next sample
-        # print(f"Sampling bar from {prev}..{cur} filtered: {filtered} dB: {mean} val: {val}")
-        prev = cur
+def process_blocks(blocks: np.ndarray, sampling_rate: int) -> Tuple[np.ndarray, np.ndarray]:
+    """
+    Processes a 2D array of equally sized blocks (one per row) into bar spectrograms, all at once.
+    The output bars are in the range 0..255 and can be fed into the visualiser directly.
+
+    Returns: Tuple(np.ndarray: Spectral energy per block, np.ndarray: Bars, one row per block)
+    """
+    block_size = blocks.shape[1]
+
+    # compute periodogram using kaiser windowing function, same as spectrum.py's Periodogram: |X|^2 / N, one
+    # sided, so every bin except DC and Nyquist is doubled
+    psd = np.abs(np.fft.rfft(blocks * np.kaiser(block_size, KAISER_BETA), axis=1)) ** 2 / block_size
+    psd[:, 1:(block_size + 1) // 2] *= 2
+    freqs = np.fft.rfftfreq(block_size, 1 / sampling_rate)
+
+    # convert power spectrum to dB, relative to the loudest bin in each block
+    # source: https://github.com/cokelaer/spectrum/blob/master/src/spectrum/psd.py#L691 (given norm=True)
+    # clamp to avoid log10(0), like spectrum.py's tools.log10 does
+    ref = np.max(psd, axis=1, keepdims=True)
+    db = 10 * np.log10(np.maximum(psd / np.maximum(ref, np.finfo(float).tiny), 1e-20))
+
+    # Take the mean dB of each bar. np.add.reduceat sums between consecutive indices, so give it each bar's
+    # (start, end) pair and keep every other result. db gets an extra column so that end can be one past
+    # the last bin.
+    ranges = bar_ranges(freqs)
+    present = [i for i, r in enumerate(ranges) if r is not None]
+    bars = np.zeros((blocks.shape[0], NUM_BARS), dtype=np.uint8)
+    spectral_energy = np.sum(psd, axis=1) ** 2
+    if len(present) == 0:
+        return spectral_energy, bars
+    indices = np.array([x for i in present for x in ranges[i]])
+    lengths = np.array([ranges[i][1] - ranges[i][0] for i in present])
+    padded = np.pad(db, ((0, 0), (0, 1)))
+    means = np.add.reduceat(padded, indices, axis=1)[:, ::2] / lengths
+
+    # Map range MIN_VOL..MAX_VOL dB to 0..255 (where 0=MIN_DB dB; 255=MAX_DB dB). interp clamps.
+    bars[:, present] = np.interp(means, [MIN_VOL, MAX_VOL], [0, 255]).astype(np.uint8)
+    return spectral_energy, bars
 
-    # Idiotic method to handle the final case (cur..FREQ_MAX) (FIXME this is stupid)
-    filtered = filter_freqs(pairs, prev, cur)
-    if len(filtered) == 0:
-        bars.append(0)
-    else:
-        mean = np.mean(filter_freqs(pairs, cur, FREQ_MAX))
-        val = np.interp(mean, [MIN_VOL, MAX_VOL], [0, 255])
-        bars.append(val)
 
-    # Compute spectral energy
-    spectral_energy = np.sum(p.psd) ** 2
+def process_block(block: np.ndarray, sampling_rate: int, ax=None) -> Tuple[float, List[int]]:
+    """
+    Processes a single block of audio samples into a bar spectrogram, and optionally plots it.
+
+    Returns: Tuple(float: Spectral energy, List[int]: Bars)
+    """
+    energies, bars = process_blocks(block[np.newaxis, :], sampling_rate)
 
     # plot spectrum
     if PLOT and PLOT_FFT:
-        plt.semilogx(p.frequencies(), db)
+        psd = np.abs(np.fft.rfft(block * np.kaiser(len(block), KAISER_BETA))) ** 2
+        db = 10 * np.log10(np.maximum(psd / max(np.max(psd), np.finfo(float).tiny), 1e-20))
+        plt.semilogx(np.fft.rfftfreq(len(block), 1 / sampling_rate), db)
         ax.set_ylim([-80, 10]) # basically 0 to -80 dB
 
         # draw marks where we would sample
-        for sample in samples:
+        for sample in np.linspace(FREQ_MIN, FREQ_MAX, NUM_BARS):
             plt.axvline(x=sample, color="grey")
 
     # Convert back to Python datatypes
-    return float(spectral_energy), [int(x) for x in bars]
+    return float(energies[0]), [int(x) for x in bars[0]]
 
 
 def main():
@@ -159,8 +187,11 @@ def main():
     print(f"num samples: {len(mono)}")
     # audiofile.write("/tmp/block.flac", mono[0:BLOCK_SIZE], sampling_rate)
 
-    # split signal into chunks of BLOCK_SIZE
-    blocks = np.split(mono, range(BLOCK_SIZE, len(mono), BLOCK_SIZE))
+    # split signal into chunks of BLOCK_SIZE. The full blocks are a strided view (no copy) so they can be
+    # processed as one 2D array; the last block is usually shorter, and is processed on its own.
+    full = sliding_window_view(mono, BLOCK_SIZE)[::BLOCK_SIZE]
+    tail = mono[len(full) * BLOCK_SIZE:]
+    blocks = list(full) + ([tail] if len(tail) > 0 else [])
     print(f"num blocks: {len(blocks)} block shape: {blocks[0].shape}")
 
     # construct capnp message
@@ -186,19 +217,23 @@ def main():
         plt.show()
         exit(0)
 
-    # process blocks
+    # process blocks, a batch at a time
     all_bars = []
     energies = []
-    for i, block in tqdm(enumerate(blocks), total=len(blocks)):
-        # calculate the bars
-        spectral_energy, bars = process_block(block, sampling_rate)
-        all_bars.append(bars)
-        energies.append(spectral_energy)
-        # print(f"Block {i} bars: {bars}")
-        # put the bars into the capnp message
-
-    music_vis.blocks = all_bars
-    music_vis.spectralEnergyBlocks = energies
+    for start in tqdm(range(0, len(full), BATCH_BLOCKS)):
+        batch_energies, batch_bars = process_blocks(full[start:start + BATCH_BLOCKS], sampling_rate)
+        all_bars.append(batch_bars)
+        energies.append(batch_energies)
+    if len(tail) > 0:
+        tail_energies, tail_bars = process_blocks(tail[np.newaxis, :], sampling_rate)
+        all_bars.append(tail_bars)
+        energies.append(tail_energies)
+    all_bars = np.concatenate(all_bars)
+    energies = np.concatenate(energies)
+
+    # put the bars into the capnp message
+    music_vis.blocks = all_bars.tolist()
+    music_vis.spectralEnergyBlocks = energies.tolist()
     music_vis.maxSpectralEnergy = float(np.max(energies))
 
     # write capnp message
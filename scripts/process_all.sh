@@ -1,6 +1,6 @@
 #!/bin/bash
+# Processes every song in data/songs. This is now done natively, in parallel, by musicvis-analyze, which
+# also skips songs whose spectrum.bin is already up to date. Set MUSICVIS_ANALYZE if your build directory
+# isn't "build".
 
-for dir in data/songs/*; do
-    echo "Process: $(basename ${dir})"
-    ./scripts/process.py $(basename ${dir})
-done
+exec "${MUSICVIS_ANALYZE:-build/musicvis-analyze}" data
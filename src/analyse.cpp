@@ -0,0 +1,157 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+// Native replacement for scripts/process.py: decodes a song's FLAC file, computes the bar spectrum and
+// writes it to spectrum.bin. Without a song name, processes every song in the library in parallel. With
+// --bundle, each song is then also packed into a song bundle (see cosc/bundle.hpp). With --assets, the data
+// directory's assets are packed into its asset archive instead (see cosc/assets.hpp).
+#include "cosc/assets.hpp"
+#include "cosc/bundle.hpp"
+#include "cosc/spectrum_analyser.hpp"
+#include "cosc/util.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+/// Analyses one song directory, and bundles it if `bundle` is true. Returns true if the spectrum had to be
+/// (re)generated.
+static bool processSong(
+    const fs::path &songDir, const cosc::AnalysisParams &params, bool bundle, bool parallel) {
+    auto analysed
+        = cosc::analysis::analyseFile(songDir / "audio.flac", songDir / "spectrum.bin", params, parallel);
+    if (bundle) {
+        auto bundleFile = songDir;
+        bundleFile += cosc::BUNDLE_EXTENSION;
+        cosc::analysis::writeBundle(songDir, bundleFile);
+    }
+    return analysed;
+}
+
+/// Processes every song directory in `songsDir`. Songs are handed out one at a time to one worker per
+/// hardware thread, each of which analyses its song single threaded; songs vary a lot in length, so this
+/// balances better than splitting the library up front. Songs whose spectrum is already up to date are
+/// skipped after hashing. Returns the number of songs that failed.
+static size_t processLibrary(const fs::path &songsDir, const cosc::AnalysisParams &params, bool bundle) {
+    if (!fs::is_directory(songsDir)) {
+        SPDLOG_ERROR("Songs directory does not exist! Tried: {}", songsDir.string());
+        return 1;
+    }
+
+    std::vector<fs::path> songs;
+    for (const auto &entry : fs::directory_iterator(songsDir)) {
+        if (entry.is_directory()) {
+            songs.push_back(entry.path());
+        }
+    }
+    std::sort(songs.begin(), songs.end());
+
+    auto numThreads
+        = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, std::max<size_t>(songs.size(), 1));
+    SPDLOG_INFO("Processing {} songs on {} threads", songs.size(), numThreads);
+
+    std::atomic<size_t> next = 0;
+    std::atomic<size_t> done = 0;
+    std::atomic<size_t> analysed = 0;
+    std::atomic<size_t> failed = 0;
+    auto worker = [&]() {
+        for (auto i = next++; i < songs.size(); i = next++) {
+            const auto &songDir = songs[i];
+            auto songName = songDir.filename().string();
+            try {
+                if (processSong(songDir, params, bundle, false)) {
+                    analysed++;
+                }
+            } catch (const std::exception &e) {
+                SPDLOG_ERROR("Failed to process {}: {}", songName, e.what());
+                failed++;
+            }
+            SPDLOG_INFO("[{}/{}] {}", ++done, songs.size(), songName);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < numThreads; i++) {
+        threads.emplace_back(worker);
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    SPDLOG_INFO("Analysed {} songs, {} already up to date, {} failed", analysed.load(),
+        songs.size() - analysed - failed, failed.load());
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    spdlog::set_level(spdlog::level::info);
+
+    // options can go anywhere, everything else is positional
+    std::vector<std::string_view> args;
+    bool bundle = false;
+    bool assets = false;
+    cosc::AnalysisParams params;
+    for (int i = 1; i < argc; i++) {
+        try {
+            if (std::string_view(argv[i]) == "--bundle") {
+                bundle = true;
+            } else if (std::string_view(argv[i]) == "--assets") {
+                assets = true;
+            } else if (!cosc::analysis::parseAnalysisOption(argc, argv, i, params)) {
+                args.emplace_back(argv[i]);
+            }
+        } catch (const std::invalid_argument &e) {
+            SPDLOG_ERROR("{}", e.what());
+            return 1;
+        }
+    }
+
+    if (args.empty()) {
+        SPDLOG_ERROR("Usage: {} [--bundle | --assets] [--bars N] [--bar-format u8|u16|f16] [data_dir_path] "
+                     "[song_name]",
+            argv[0]);
+        SPDLOG_ERROR("Omit song_name to process every song in data_dir_path/songs");
+        SPDLOG_ERROR("With --bundle, also pack each song into data_dir_path/songs/<song_name>.musicvis");
+        SPDLOG_ERROR("With --assets, pack everything but the songs into data_dir_path/assets.pak instead");
+        SPDLOG_ERROR("--bars and --bar-format set the number of bars (default 32) and how they're stored "
+                     "(default u8), pass the same ones to musicvis");
+        return 1;
+    }
+
+    fs::path dataDir = args[0];
+    auto begin = std::chrono::steady_clock::now();
+
+    if (assets) {
+        try {
+            cosc::analysis::writeAssetArchive(dataDir);
+        } catch (const std::exception &e) {
+            SPDLOG_ERROR("Failed to pack assets: {}", e.what());
+            return 1;
+        }
+    } else if (args.size() < 2) {
+        if (processLibrary(dataDir / "songs", params, bundle) != 0) {
+            return 1;
+        }
+    } else {
+        std::string songName(args[1]);
+        auto songDir = dataDir / "songs" / songName;
+        SPDLOG_INFO("Processing: {} ({})", songName, songDir.string());
+
+        try {
+            processSong(songDir, params, bundle, true);
+        } catch (const std::exception &e) {
+            SPDLOG_ERROR("Failed to process {}: {}", songName, e.what());
+            return 1;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    SPDLOG_INFO("Done! Took {:.2f} ms",
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count() / NANO_TO_SEC * MS_TO_SEC);
+    return 0;
+}
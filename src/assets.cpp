@@ -0,0 +1,155 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#include "cosc/assets.hpp"
+#include "cosc/spectrum_analyser.hpp"
+#include "proto/MusicVis.capnp.h"
+#include <algorithm>
+#include <array>
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <memory>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <system_error>
+
+/// The mounted archive and the data directory it's for, only written by mount()
+static std::unique_ptr<const cosc::AssetArchive> mounted;
+static fs::path mountedDir;
+
+cosc::AssetArchive::AssetArchive(const fs::path &path)
+    : mapping(path) {
+    auto bytes = mapping.getBytes();
+    if (bytes.size() < ASSET_ARCHIVE_MAGIC.size()
+        || std::string_view(reinterpret_cast<const char *>(bytes.data()), ASSET_ARCHIVE_MAGIC.size())
+            != ASSET_ARCHIVE_MAGIC) {
+        throw std::runtime_error("Not an asset archive");
+    }
+
+    // same as bundles, the header is read in place. it's only needed to build the index.
+    auto rest = bytes.subspan(ASSET_ARCHIVE_MAGIC.size());
+    kj::ArrayPtr<const ::capnp::word> words(
+        reinterpret_cast<const ::capnp::word *>(rest.data()), rest.size() / sizeof(::capnp::word));
+    ::capnp::FlatArrayMessageReader reader(words);
+    for (auto asset : reader.getRoot<MusicVisAssetArchive>().getAssets()) {
+        auto offset = asset.getData().getOffset();
+        auto size = asset.getData().getSize();
+        if (offset > bytes.size() || size > bytes.size() - offset) {
+            throw std::runtime_error("Asset archive index is corrupt");
+        }
+        index.emplace(asset.getPath().cStr(),
+            ArchivedAsset { .bytes = bytes.subspan(offset, size), .modified = asset.getModified() });
+    }
+}
+
+std::optional<cosc::ArchivedAsset> cosc::AssetArchive::find(const std::string &path) const {
+    auto it = index.find(path);
+    if (it == index.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+void cosc::vfs::mount(const fs::path &dataDir) {
+#if ASSET_ARCHIVE == 1
+    auto archiveFile = dataDir / ASSET_ARCHIVE_NAME;
+    if (fs::exists(archiveFile)) {
+        mounted = std::make_unique<const AssetArchive>(archiveFile);
+        mountedDir = dataDir.lexically_normal();
+        SPDLOG_INFO("Mounted asset archive {} ({} assets)", archiveFile.string(), mounted->size());
+        return;
+    }
+#endif
+    SPDLOG_DEBUG("Not using an asset archive, assets will be read from {}", dataDir.string());
+}
+
+/// Returns an asset's bytes from the mounted archive, if there is one and the asset is in it
+static std::optional<std::span<const uint8_t>> findMounted(const fs::path &path) {
+    if (!mounted) {
+        return std::nullopt;
+    }
+    // paths outside the data directory come out as "../..."
+    auto relative = path.lexically_normal().lexically_relative(mountedDir);
+    if (!relative.empty() && *relative.begin() != "..") {
+        if (auto asset = mounted->find(relative.generic_string())) {
+            // the archive is a snapshot, so a loose file that's been edited since it was packed wins. if
+            // there's no loose file at all (i.e. only the archive was deployed), there's nothing to compare.
+            std::error_code error;
+            auto size = fs::file_size(path, error);
+            auto modified = error ? 0 : fs::last_write_time(path, error).time_since_epoch().count();
+            if (!error && (size != asset->bytes.size() || modified != asset->modified)) {
+                SPDLOG_WARN("{} has changed since the asset archive was packed, reading it from disk",
+                    path.string());
+                return std::nullopt;
+            }
+            SPDLOG_DEBUG("Read {} from the asset archive", path.string());
+            return asset->bytes;
+        }
+    }
+    SPDLOG_DEBUG("{} is not in the asset archive, reading it from disk", path.string());
+    return std::nullopt;
+}
+
+cosc::Asset cosc::vfs::read(const fs::path &path) {
+    if (auto bytes = findMounted(path)) {
+        return Asset(*bytes);
+    }
+    return Asset(cosc::util::readPathToBytes(path));
+}
+
+cosc::Asset cosc::vfs::map(const fs::path &path) {
+    if (auto bytes = findMounted(path)) {
+        return Asset(*bytes);
+    }
+    return Asset(std::make_unique<const cosc::util::MappedFile>(path));
+}
+
+void cosc::analysis::writeAssetArchive(const fs::path &dataDir) {
+    auto archiveFile = dataDir / ASSET_ARCHIVE_NAME;
+    std::vector<fs::path> files;
+    for (auto it = fs::recursive_directory_iterator(dataDir); it != fs::recursive_directory_iterator();
+         it++) {
+        const auto &path = it->path();
+        if (it->is_directory() && path == dataDir / "songs") {
+            // songs are loaded one at a time and are far bigger than everything else, see bundles instead
+            it.disable_recursion_pending();
+        } else if (it->is_regular_file() && path.filename() != ASSET_ARCHIVE_NAME
+            && path.extension() != ".tmp") {
+            files.push_back(path);
+        }
+    }
+    std::sort(files.begin(), files.end());
+
+    ::capnp::MallocMessageBuilder message;
+    auto assets = message.initRoot<MusicVisAssetArchive>().initAssets(files.size());
+    for (size_t i = 0; i < files.size(); i++) {
+        assets[i].setPath(files[i].lexically_relative(dataDir).generic_string());
+        assets[i].initData();
+        assets[i].setModified(fs::last_write_time(files[i]).time_since_epoch().count());
+    }
+    // the header is unpacked, so its size doesn't depend on the offsets and we can lay out the file first
+    auto headerEnd = ASSET_ARCHIVE_MAGIC.size()
+        + (::capnp::computeSerializedSizeInWords(message) * sizeof(::capnp::word));
+    uint64_t offset = headerEnd;
+    for (size_t i = 0; i < files.size(); i++) {
+        auto size = fs::file_size(files[i]);
+        offset = (offset + ASSET_ALIGNMENT - 1) / ASSET_ALIGNMENT * ASSET_ALIGNMENT;
+        assets[i].getData().setOffset(offset);
+        assets[i].getData().setSize(size);
+        offset += size;
+    }
+
+    writeAtomically(archiveFile, [&](kj::BufferedOutputStreamWrapper &output, int /* fd */) {
+        std::array<uint8_t, ASSET_ALIGNMENT> padding {};
+        output.write(ASSET_ARCHIVE_MAGIC.data(), ASSET_ARCHIVE_MAGIC.size());
+        ::capnp::writeMessage(output, message);
+        uint64_t written = headerEnd;
+        for (size_t i = 0; i < files.size(); i++) {
+            cosc::util::MappedFile asset(files[i]);
+            auto bytes = asset.getBytes();
+            output.write(padding.data(), assets[i].getData().getOffset() - written);
+            output.write(bytes.data(), bytes.size());
+            written = assets[i].getData().getOffset() + bytes.size();
+        }
+    });
+    SPDLOG_INFO("Packed {} assets ({} bytes)", files.size(), offset);
+}
@@ -0,0 +1,116 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#include "cosc/bundle.hpp"
+#include "cosc/spectrum_analyser.hpp"
+#include <algorithm>
+#include <array>
+#include <capnp/message.h>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+
+cosc::SongBundle::SongBundle(const fs::path &path)
+    : mapping(std::make_shared<const cosc::util::MappedFile>(path)) {
+    auto bytes = mapping->getBytes();
+    if (bytes.size() < BUNDLE_MAGIC.size()
+        || std::string_view(reinterpret_cast<const char *>(bytes.data()), BUNDLE_MAGIC.size())
+            != BUNDLE_MAGIC) {
+        throw std::runtime_error("Not a song bundle");
+    }
+
+    // same as the spectrum header, the bundle header is read in place (see SpectrumPager)
+    auto rest = bytes.subspan(BUNDLE_MAGIC.size());
+    kj::ArrayPtr<const ::capnp::word> words(
+        reinterpret_cast<const ::capnp::word *>(rest.data()), rest.size() / sizeof(::capnp::word));
+    headerReader = std::make_unique<::capnp::FlatArrayMessageReader>(words);
+    header = headerReader->getRoot<MusicVisBundle>();
+    audio = section(header.getAudio());
+    spectrum = section(header.getSpectrum());
+    SPDLOG_INFO("Song bundle '{}': {} bytes of audio, {} bytes of spectrum", header.getName().cStr(),
+        audio.size(), spectrum.size());
+}
+
+std::span<const uint8_t> cosc::SongBundle::section(MusicVisSection::Reader reader) const {
+    auto bytes = mapping->getBytes();
+    auto offset = reader.getOffset();
+    auto size = reader.getSize();
+    if (offset > bytes.size() || size > bytes.size() - offset || offset % BUNDLE_ALIGNMENT != 0) {
+        throw std::runtime_error("Song bundle section table is corrupt");
+    }
+    return bytes.subspan(offset, size);
+}
+
+/// Rounds `offset` up to the next BUNDLE_ALIGNMENT
+static uint64_t alignSection(uint64_t offset) {
+    return (offset + cosc::BUNDLE_ALIGNMENT - 1) / cosc::BUNDLE_ALIGNMENT * cosc::BUNDLE_ALIGNMENT;
+}
+
+/// Reads the cache key from the header of a chunked spectrum in place, or returns 0 if it isn't chunked
+static uint64_t spectrumCacheKey(std::span<const uint8_t> spectrum) {
+    auto magicSize = cosc::analysis::SPECTRUM_MAGIC.size();
+    if (spectrum.size() < magicSize
+        || std::string_view(reinterpret_cast<const char *>(spectrum.data()), magicSize)
+            != cosc::analysis::SPECTRUM_MAGIC) {
+        return 0;
+    }
+    auto rest = spectrum.subspan(magicSize);
+    kj::ArrayPtr<const ::capnp::word> words(
+        reinterpret_cast<const ::capnp::word *>(rest.data()), rest.size() / sizeof(::capnp::word));
+    ::capnp::FlatArrayMessageReader reader(words);
+    return reader.getRoot<MusicVisBars>().getCacheKey();
+}
+
+bool cosc::analysis::writeBundle(const fs::path &songDir, const fs::path &bundleFile) {
+    auto flacFile = songDir / "audio.flac";
+    auto spectrumFile = songDir / "spectrum.bin";
+    cosc::util::MappedFile audio(flacFile);
+    cosc::util::MappedFile spectrum(spectrumFile);
+    auto audioBytes = audio.getBytes();
+    auto spectrumBytes = spectrum.getBytes();
+    auto cacheKey = spectrumCacheKey(spectrumBytes);
+    if (cacheKey == 0) {
+        throw std::runtime_error("Only chunked spectrums can be bundled, run musicvis-analyze first");
+    }
+    auto audioHash = cosc::util::hashBytes(audioBytes);
+
+    // if the bundle already has this audio and spectrum, there's nothing to do. a bundle that can't be read
+    // is just rewritten.
+    if (fs::exists(bundleFile)) {
+        try {
+            SongBundle existing(bundleFile);
+            if (existing.getAudioHash() == audioHash
+                && spectrumCacheKey(existing.getSpectrum()) == cacheKey) {
+                SPDLOG_INFO("Bundle {} is up to date", bundleFile.string());
+                return false;
+            }
+        } catch (const std::exception &e) {
+            SPDLOG_WARN("Existing bundle {} is unreadable, rewriting it: {}", bundleFile.string(), e.what());
+        }
+    }
+
+    ::capnp::MallocMessageBuilder message;
+    auto header = message.initRoot<MusicVisBundle>();
+    header.setName(songDir.filename().string());
+    header.setAudioHash(audioHash);
+    auto audioSection = header.initAudio();
+    auto spectrumSection = header.initSpectrum();
+    // the header is unpacked, so its size doesn't depend on the offsets and we can lay out the file first
+    auto headerEnd
+        = BUNDLE_MAGIC.size() + (::capnp::computeSerializedSizeInWords(message) * sizeof(::capnp::word));
+    auto audioOffset = alignSection(headerEnd);
+    auto spectrumOffset = alignSection(audioOffset + audioBytes.size());
+    audioSection.setOffset(audioOffset);
+    audioSection.setSize(audioBytes.size());
+    spectrumSection.setOffset(spectrumOffset);
+    spectrumSection.setSize(spectrumBytes.size());
+
+    writeAtomically(bundleFile, [&](kj::BufferedOutputStreamWrapper &output, int /* fd */) {
+        std::array<uint8_t, BUNDLE_ALIGNMENT> padding {};
+        output.write(BUNDLE_MAGIC.data(), BUNDLE_MAGIC.size());
+        ::capnp::writeMessage(output, message);
+        output.write(padding.data(), audioOffset - headerEnd);
+        output.write(audioBytes.data(), audioBytes.size());
+        output.write(padding.data(), spectrumOffset - (audioOffset + audioBytes.size()));
+        output.write(spectrumBytes.data(), spectrumBytes.size());
+    });
+    return true;
+}
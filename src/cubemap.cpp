@@ -1,12 +1,10 @@
 // Copyright 2024 Matt Young.
 // SPDX-License-Identifier: ISC
 #include "cosc/cubemap.hpp"
-#include "cosc/lib/stb_image.h"
 #include "cosc/shader.hpp"
 #include "glad/gl.h"
 #include <glm/mat3x3.hpp>
 #include <spdlog/spdlog.h>
-#include <stdexcept>
 
 // clang-format off
 constexpr float skyboxVertices[] = {
@@ -69,39 +67,13 @@ cosc::Cubemap::Cubemap(const fs::path &dataDir, const fs::path &cubeMapDir)
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), nullptr);
 
-    // generate and load OpenGL textures
+    // the faces are loaded in the background, the skybox is black until they're on the GPU
     SPDLOG_INFO("Loading cubemap textures");
-    glGenTextures(1, &textureId);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, textureId);
-
-    std::vector<std::string> faces = { "right", "left", "top", "bottom", "front", "back" };
-    int width, height, channels;
-    unsigned char *data = nullptr;
-    int i = 0;
-    for (const auto &face : faces) {
-        auto facePath = dataDir / cubeMapDir / (face + ".png");
-
-        // load data from FS
-        SPDLOG_DEBUG("Loading face: {} from path: {}", face, facePath.string());
-        data = stbi_load(facePath.c_str(), &width, &height, &channels, 0);
-        if (data == nullptr) {
-            throw std::runtime_error("Failed to decode cubemap face!");
-        }
-        SPDLOG_DEBUG("Retrieved a {}x{} image with {} channels", width, height, channels);
-
-        // submit to OpenGL
-        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + (i++), 0, GL_RGB, width, height, 0, GL_RGBA,
-            GL_UNSIGNED_BYTE, data);
-        // has been copied to the GPU presumably, so we can free it here
-        stbi_image_free(data);
-
-        // apply filtering
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    std::vector<fs::path> facePaths;
+    for (const auto &face : { "right", "left", "top", "bottom", "front", "back" }) {
+        facePaths.push_back(dataDir / cubeMapDir / (std::string(face) + ".png"));
     }
+    texture = std::make_unique<cosc::StreamedTexture>(facePaths, false);
 
     // configure the shader
     // TODO what is going on here?
@@ -109,6 +81,10 @@ cosc::Cubemap::Cubemap(const fs::path &dataDir, const fs::path &cubeMapDir)
     // shader.setInt("skybox", 0);
 }
 
+void cosc::Cubemap::update() {
+    texture->update();
+}
+
 void cosc::Cubemap::draw(const Camera &camera) {
     // when drawing last, we change the depth test so that it passes when values are <= buffer content
     // TODO what does this really do
@@ -123,7 +99,7 @@ void cosc::Cubemap::draw(const Camera &camera) {
     // draw skybox cube
     glBindVertexArray(vao);
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, textureId);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, texture->getTextureId());
     glDrawArrays(GL_TRIANGLES, 0, 36);
     glBindVertexArray(0);
 
@@ -0,0 +1,241 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#include "cosc/events.hpp"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <spdlog/spdlog.h>
+
+// Onset peak picking windows in seconds, from Böck et al., "Evaluating the Online Capabilities of Onset
+// Detection Methods" (2012)
+constexpr double ONSET_MAX_BEFORE = 0.03;
+constexpr double ONSET_MAX_AFTER = 0.03;
+constexpr double ONSET_MEAN_BEFORE = 0.1;
+constexpr double ONSET_MEAN_AFTER = 0.07;
+/// Minimum time between onsets in seconds
+constexpr double ONSET_MIN_GAP = 0.05;
+/// How far above the local mean an onset has to be, in standard deviations of the song's flux
+constexpr double ONSET_THRESHOLD = 0.5;
+
+/// Tempo search range in BPM
+constexpr double MIN_BPM = 60.0;
+constexpr double MAX_BPM = 200.0;
+/// Tempo prior: a log-normal centred on this BPM with this standard deviation in octaves, so that the
+/// tracker prefers 120 BPM over 60 or 240 BPM when they all fit equally well
+constexpr double PRIOR_BPM = 120.0;
+constexpr double PRIOR_OCTAVES = 1.0;
+
+/// How strongly the beat tracker penalises beats that aren't exactly one period apart
+constexpr double TIGHTNESS = 100.0;
+
+/// Converts a time in seconds to a number of blocks, at least 1
+static size_t toBlocks(double seconds, double blocksPerSecond) {
+    return std::max<size_t>(1, static_cast<size_t>(std::lround(seconds * blocksPerSecond)));
+}
+
+/// Picks onsets out of the flux, as block indices
+static std::vector<size_t> pickOnsets(std::span<const float> flux, double blocksPerSecond, double stdDev) {
+    auto maxBefore = toBlocks(ONSET_MAX_BEFORE, blocksPerSecond);
+    auto maxAfter = toBlocks(ONSET_MAX_AFTER, blocksPerSecond);
+    auto meanBefore = toBlocks(ONSET_MEAN_BEFORE, blocksPerSecond);
+    auto meanAfter = toBlocks(ONSET_MEAN_AFTER, blocksPerSecond);
+    auto minGap = toBlocks(ONSET_MIN_GAP, blocksPerSecond);
+    auto size = flux.size();
+
+    // prefix sums, so the local mean is O(1)
+    std::vector<double> prefix(size + 1, 0.0);
+    for (size_t i = 0; i < size; i++) {
+        prefix[i + 1] = prefix[i] + flux[i];
+    }
+
+    std::vector<size_t> onsets;
+    for (size_t i = 0; i < size; i++) {
+        auto value = flux[i];
+        if (value <= 0.f) {
+            continue;
+        }
+
+        auto begin = i - std::min(i, maxBefore);
+        auto end = std::min(size, i + maxAfter + 1);
+        if (*std::max_element(flux.begin() + static_cast<ptrdiff_t>(begin),
+                flux.begin() + static_cast<ptrdiff_t>(end))
+            > value) {
+            continue;
+        }
+
+        begin = i - std::min(i, meanBefore);
+        end = std::min(size, i + meanAfter + 1);
+        auto mean = (prefix[end] - prefix[begin]) / static_cast<double>(end - begin);
+        if (value < mean + (ONSET_THRESHOLD * stdDev)) {
+            continue;
+        }
+
+        if (!onsets.empty() && i - onsets.back() < minGap) {
+            continue;
+        }
+        onsets.push_back(i);
+    }
+    return onsets;
+}
+
+/// Estimates the beat period in blocks from the autocorrelation of the (mean removed) flux. Returns 0 if
+/// the song is too short.
+static double estimatePeriod(std::span<const double> envelope, double blocksPerSecond) {
+    auto minLag = static_cast<size_t>(std::floor(60.0 / MAX_BPM * blocksPerSecond));
+    auto maxLag = static_cast<size_t>(std::ceil(60.0 / MIN_BPM * blocksPerSecond));
+    if (minLag < 1 || envelope.size() <= maxLag + 1) {
+        return 0.0;
+    }
+
+    std::vector<double> score(maxLag + 2, 0.0);
+    for (auto lag = minLag - 1; lag <= maxLag + 1; lag++) {
+        double sum = 0.0;
+        for (size_t i = lag; i < envelope.size(); i++) {
+            sum += envelope[i] * envelope[i - lag];
+        }
+        auto bpm = 60.0 * blocksPerSecond / static_cast<double>(std::max<size_t>(lag, 1));
+        auto octaves = std::log2(bpm / PRIOR_BPM) / PRIOR_OCTAVES;
+        score[lag] = sum * std::exp(-0.5 * octaves * octaves);
+    }
+
+    auto best = minLag;
+    for (auto lag = minLag; lag <= maxLag; lag++) {
+        if (score[lag] > score[best]) {
+            best = lag;
+        }
+    }
+
+    // refine to a fractional lag by fitting a parabola through the peak and its neighbours
+    auto left = score[best - 1];
+    auto centre = score[best];
+    auto right = score[best + 1];
+    auto denom = left - (2.0 * centre) + right;
+    auto offset = denom < 0.0 ? 0.5 * (left - right) / denom : 0.0;
+    return static_cast<double>(best) + std::clamp(offset, -0.5, 0.5);
+}
+
+/// Places beats with dynamic programming, returning their block indices in order.
+/// Source: Ellis, "Beat Tracking by Dynamic Programming" (2007), section 3.
+static std::vector<size_t> trackBeats(std::span<const double> envelope, double period) {
+    auto size = envelope.size();
+    std::vector<double> score(size);
+    std::vector<ptrdiff_t> backlink(size, -1);
+
+    // a previous beat is searched for between half and two periods back
+    auto searchMin = std::max<size_t>(1, static_cast<size_t>(std::lround(period / 2.0)));
+    auto searchMax = static_cast<size_t>(std::lround(period * 2.0));
+    for (size_t t = 0; t < size; t++) {
+        auto best = 0.0;
+        for (auto gap = searchMin; gap <= searchMax && gap <= t; gap++) {
+            auto mismatch = std::log(static_cast<double>(gap) / period);
+            auto candidate = score[t - gap] - (TIGHTNESS * mismatch * mismatch);
+            if (backlink[t] == -1 || candidate > best) {
+                best = candidate;
+                backlink[t] = static_cast<ptrdiff_t>(t - gap);
+            }
+        }
+        // starting a new chain is always allowed, so a bad stretch of song can't drag down later beats
+        if (best < 0.0) {
+            best = 0.0;
+            backlink[t] = -1;
+        }
+        score[t] = envelope[t] + best;
+    }
+
+    // the last beat is the best scoring block within the final period, then follow the links back
+    auto lastBegin = size - std::min(size, static_cast<size_t>(std::lround(period)));
+    auto last = static_cast<ptrdiff_t>(std::distance(
+        score.begin(), std::max_element(score.begin() + static_cast<ptrdiff_t>(lastBegin), score.end())));
+    std::vector<size_t> beats;
+    for (auto t = last; t != -1; t = backlink[t]) {
+        beats.push_back(static_cast<size_t>(t));
+    }
+    std::reverse(beats.begin(), beats.end());
+    return beats;
+}
+
+cosc::EventTrack cosc::analysis::detectEvents(std::span<const float> flux, double blocksPerSecond) {
+    EventTrack track;
+    if (flux.empty()) {
+        return track;
+    }
+
+    auto size = static_cast<double>(flux.size());
+    auto mean = std::accumulate(flux.begin(), flux.end(), 0.0) / size;
+    double variance = 0.0;
+    for (auto value : flux) {
+        variance += (value - mean) * (value - mean);
+    }
+    auto stdDev = std::sqrt(variance / size);
+    auto maxFlux = *std::max_element(flux.begin(), flux.end());
+    if (stdDev <= 0.0 || maxFlux <= 0.f) {
+        // silence, or at least nothing ever changes
+        return track;
+    }
+    auto strength = [&](size_t block) { return flux[block] / maxFlux; };
+
+    for (auto block : pickOnsets(flux, blocksPerSecond, stdDev)) {
+        track.events.push_back(
+            { .block = block, .type = MusicVisEventType::ONSET, .strength = strength(block) });
+    }
+
+    // the beat tracker works on the flux normalised to zero mean and unit variance, which is what its
+    // TIGHTNESS is tuned for
+    std::vector<double> envelope(flux.size());
+    for (size_t i = 0; i < flux.size(); i++) {
+        envelope[i] = (flux[i] - mean) / stdDev;
+    }
+    auto period = estimatePeriod(envelope, blocksPerSecond);
+    if (period > 0.0) {
+        track.tempo = static_cast<float>(60.0 * blocksPerSecond / period);
+        for (auto block : trackBeats(envelope, period)) {
+            track.events.push_back(
+                { .block = block, .type = MusicVisEventType::BEAT, .strength = strength(block) });
+        }
+    }
+
+    std::sort(track.events.begin(), track.events.end(), [](const Event &a, const Event &b) {
+        return a.block != b.block ? a.block < b.block : a.type < b.type;
+    });
+    SPDLOG_INFO("Detected {} events, tempo {:.1f} BPM", track.events.size(), track.tempo);
+    return track;
+}
+
+void cosc::analysis::writeEvents(MusicVisEvents::Builder builder, const EventTrack &track) {
+    builder.setTempo(track.tempo);
+    auto events = builder.initEvents(track.events.size());
+    for (size_t i = 0; i < track.events.size(); i++) {
+        const auto &event = track.events[i];
+        events[i].setBlock(event.block);
+        events[i].setType(event.type);
+        events[i].setStrength(event.strength);
+    }
+}
+
+cosc::EventCursor::EventCursor(::capnp::List<MusicVisEvent>::Reader events)
+    : events(events) {
+}
+
+bool cosc::EventCursor::next(uint64_t block, MusicVisEvent::Reader &event) {
+    if (block < lastBlock) {
+        // seeked backwards: binary search for the first event after the new position
+        unsigned int low = 0;
+        unsigned int high = events.size();
+        while (low < high) {
+            auto mid = low + ((high - low) / 2);
+            if (events[mid].getBlock() <= block) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        pos = low;
+    }
+    lastBlock = block;
+
+    if (pos < events.size() && events[pos].getBlock() <= block) {
+        event = events[pos++];
+        return true;
+    }
+    return false;
+}
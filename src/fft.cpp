@@ -0,0 +1,66 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#include "cosc/fft.hpp"
+#include <bit>
+#include <cmath>
+#include <numbers>
+#include <stdexcept>
+#include <utility>
+
+cosc::FFT::FFT(size_t size)
+    : size(size) {
+    if (size < 2 || !std::has_single_bit(size)) {
+        throw std::invalid_argument("FFT size must be a power of two");
+    }
+
+    // precompute twiddle factors in double precision, so that we don't accumulate error for large sizes
+    twiddles.resize(size / 2);
+    for (size_t k = 0; k < size / 2; k++) {
+        double angle = -2.0 * std::numbers::pi * static_cast<double>(k) / static_cast<double>(size);
+        twiddles[k] = { static_cast<float>(std::cos(angle)), static_cast<float>(std::sin(angle)) };
+    }
+
+    // precompute bit reversal permutation
+    auto bits = std::countr_zero(size);
+    bitReverse.resize(size);
+    for (size_t i = 0; i < size; i++) {
+        size_t reversed = 0;
+        for (int b = 0; b < bits; b++) {
+            reversed |= ((i >> b) & 1U) << (bits - 1 - b);
+        }
+        bitReverse[i] = reversed;
+    }
+}
+
+void cosc::FFT::forward(std::span<std::complex<float>> data) const {
+    if (data.size() != size) {
+        throw std::invalid_argument("FFT input does not match FFT size");
+    }
+
+    // reorder the input into bit reversed order, so we can do the butterflies in place
+    for (size_t i = 0; i < size; i++) {
+        auto j = bitReverse[i];
+        if (i < j) {
+            std::swap(data[i], data[j]);
+        }
+    }
+
+    // Cooley-Tukey butterflies, doubling the transform length each pass
+    for (size_t len = 2; len <= size; len <<= 1) {
+        auto half = len / 2;
+        auto stride = size / len;
+        for (size_t start = 0; start < size; start += len) {
+            for (size_t k = 0; k < half; k++) {
+                auto even = data[start + k];
+                // multiply out by hand: std::complex operator* goes through __mulsc3 for its NaN/inf
+                // handling, which is several times slower and would otherwise dominate the whole FFT
+                const auto &x = data[start + k + half];
+                const auto &w = twiddles[k * stride];
+                std::complex<float> odd { x.real() * w.real() - x.imag() * w.imag(),
+                    x.real() * w.imag() + x.imag() * w.real() };
+                data[start + k] = even + odd;
+                data[start + k + half] = even - odd;
+            }
+        }
+    }
+}
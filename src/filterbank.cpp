@@ -0,0 +1,188 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#include "cosc/filterbank.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <mutex>
+#include <numbers>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+
+/// Number of independent accumulators in the dot product kernel. With 8, the inner loop maps onto one AVX
+/// register (or two SSE registers), and the compiler is free to vectorise it since the lanes don't depend on
+/// each other.
+constexpr size_t DOT_LANES = 8;
+
+// Mel scale conversions, source: https://en.wikipedia.org/wiki/Mel_scale
+static double hzToMel(double hz) {
+    return 2595.0 * std::log10(1.0 + (hz / 700.0));
+}
+
+static double melToHz(double mel) {
+    return 700.0 * (std::pow(10.0, mel / 2595.0) - 1.0);
+}
+
+/// Dot product of two float arrays, written so that it auto-vectorises
+static float dot(const float *a, const float *b, size_t len) {
+    std::array<float, DOT_LANES> acc {};
+    size_t i = 0;
+    for (; i + DOT_LANES <= len; i += DOT_LANES) {
+        for (size_t lane = 0; lane < DOT_LANES; lane++) {
+            acc[lane] += a[i + lane] * b[i + lane];
+        }
+    }
+    float sum = 0.f;
+    for (auto lane : acc) {
+        sum += lane;
+    }
+    for (; i < len; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+/// Returns `count` frequencies evenly spaced in the given scale between min and max inclusive
+static std::vector<double> scalePoints(cosc::FilterbankScale scale, double min, double max, size_t count) {
+    std::vector<double> points(count);
+    for (size_t i = 0; i < count; i++) {
+        auto t = static_cast<double>(i) / static_cast<double>(count - 1);
+        switch (scale) {
+            case cosc::FilterbankScale::LINEAR:
+                points[i] = min + (t * (max - min));
+                break;
+            case cosc::FilterbankScale::LOG:
+            case cosc::FilterbankScale::CONSTANT_Q:
+                points[i] = min * std::pow(max / min, t);
+                break;
+            case cosc::FilterbankScale::MEL:
+                points[i] = melToHz(hzToMel(min) + (t * (hzToMel(max) - hzToMel(min))));
+                break;
+        }
+    }
+    return points;
+}
+
+cosc::Filterbank::Filterbank(const FilterbankConfig &config)
+    : config(config) {
+    if (config.numBars == 0 || config.freqMin <= 0.f || config.freqMax <= config.freqMin) {
+        throw std::invalid_argument("Invalid filterbank config");
+    }
+
+    auto numBins = (config.fftSize / 2) + 1;
+    auto binWidth = static_cast<double>(config.sampleRate) / static_cast<double>(config.fftSize);
+    auto numBars = config.numBars;
+
+    // For LINEAR, bar i is a rectangle between points i and i+1, i.e. a plain mean of its bins. This is
+    // deliberately not process.py's binning, which puts numBars edges (not numBars + 1) between freqMin and
+    // freqMax, merges empty bars into the next one, and leaves its last bar with only the bins at exactly
+    // freqMax, so it's almost always zero. Here every bar is an equal slice, and none of them are dead.
+    // Everything else is a smooth window from points i to i+2, centred on point i+1, so neighbouring bars
+    // overlap by half and there's no gaps between them.
+    auto isLinear = config.scale == FilterbankScale::LINEAR;
+    auto points = scalePoints(config.scale, config.freqMin, config.freqMax, numBars + (isLinear ? 1 : 2));
+
+    // constant-Q: bars per octave determines Q, and therefore each band's bandwidth
+    // source: https://en.wikipedia.org/wiki/Constant-Q_transform
+    auto barsPerOctave = numBars / std::log2(static_cast<double>(config.freqMax / config.freqMin));
+    auto q = 1.0 / (std::pow(2.0, 1.0 / barsPerOctave) - 1.0);
+
+    bands.resize(numBars);
+    std::vector<float> bandWeights;
+    for (size_t i = 0; i < numBars; i++) {
+        auto lo = points[i];
+        auto centre = isLinear ? (points[i] + points[i + 1]) / 2.0 : points[i + 1];
+        auto hi = isLinear ? points[i + 1] : points[i + 2];
+        if (config.scale == FilterbankScale::CONSTANT_Q) {
+            auto bandwidth = centre / q;
+            lo = centre - bandwidth;
+            hi = centre + bandwidth;
+        }
+
+        // weight of every bin inside the band. very wide constant-Q bands start below 0 Hz, which would wrap
+        // around when converted to a bin.
+        auto firstFreq = std::max(lo, 0.0);
+        auto first = std::min<size_t>(static_cast<size_t>(std::ceil(firstFreq / binWidth)), numBins - 1);
+        auto last = std::min<size_t>(static_cast<size_t>(std::floor(hi / binWidth)), numBins - 1);
+        bandWeights.clear();
+        for (auto bin = first; bin <= last && lo <= hi; bin++) {
+            auto freq = static_cast<double>(bin) * binWidth;
+            double weight = 0.0;
+            switch (config.scale) {
+                case FilterbankScale::LINEAR:
+                    weight = freq >= lo && freq <= hi ? 1.0 : 0.0;
+                    break;
+                case FilterbankScale::LOG:
+                case FilterbankScale::MEL:
+                    // triangle
+                    weight = freq <= centre ? (freq - lo) / (centre - lo) : (hi - freq) / (hi - centre);
+                    break;
+                case FilterbankScale::CONSTANT_Q:
+                    // Hann window, the bandwidth is the distance from its centre to its first zero
+                    weight = 0.5 * (1.0 + std::cos(std::numbers::pi * (freq - centre) / (hi - centre)));
+                    break;
+            }
+            bandWeights.push_back(static_cast<float>(std::max(weight, 0.0)));
+        }
+
+        // trim zero weights off both ends, so apply() doesn't multiply by them
+        while (!bandWeights.empty() && bandWeights.back() <= 0.f) {
+            bandWeights.pop_back();
+        }
+        size_t skip = 0;
+        while (skip < bandWeights.size() && bandWeights[skip] <= 0.f) {
+            skip++;
+        }
+        bandWeights.erase(bandWeights.begin(), bandWeights.begin() + static_cast<ptrdiff_t>(skip));
+        first += skip;
+
+        if (bandWeights.empty()) {
+            // band is narrower than an FFT bin, so linearly interpolate its centre between the nearest two
+            auto pos = std::min(centre / binWidth, static_cast<double>(numBins - 1));
+            first = std::min<size_t>(static_cast<size_t>(pos), numBins - 2);
+            auto frac = static_cast<float>(pos - static_cast<double>(first));
+            bandWeights = { 1.f - frac, frac };
+        }
+
+        // normalise so the weights sum to 1, making each bar a weighted mean
+        float sum = 0.f;
+        for (auto weight : bandWeights) {
+            sum += weight;
+        }
+        for (auto &weight : bandWeights) {
+            weight /= sum;
+        }
+
+        bands[i] = { .firstBin = static_cast<uint32_t>(first),
+            .numBins = static_cast<uint32_t>(bandWeights.size()),
+            .weightOffset = static_cast<uint32_t>(weights.size()) };
+        weights.insert(weights.end(), bandWeights.begin(), bandWeights.end());
+        SPDLOG_TRACE("Band {}: {:.1f}..{:.1f}..{:.1f} Hz, bins {}+{}", i, lo, centre, hi, first,
+            bandWeights.size());
+    }
+
+    SPDLOG_DEBUG("Filterbank with {} bars has {} non-zero weights over {} bins", numBars, weights.size(),
+        numBins);
+}
+
+std::shared_ptr<const cosc::Filterbank> cosc::Filterbank::get(const FilterbankConfig &config) {
+    static std::mutex mutex;
+    static std::vector<std::shared_ptr<const Filterbank>> cache;
+
+    std::scoped_lock lock(mutex);
+    for (const auto &filterbank : cache) {
+        if (filterbank->getConfig() == config) {
+            return filterbank;
+        }
+    }
+    auto filterbank = std::make_shared<const Filterbank>(config);
+    cache.push_back(filterbank);
+    return filterbank;
+}
+
+void cosc::Filterbank::apply(std::span<const float> power, std::span<float> bars) const {
+    for (size_t i = 0; i < bands.size(); i++) {
+        const auto &band = bands[i];
+        bars[i] = dot(power.data() + band.firstBin, weights.data() + band.weightOffset, band.numBins);
+    }
+}
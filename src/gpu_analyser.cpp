@@ -0,0 +1,210 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#include "cosc/gpu_analyser.hpp"
+#include "glad/gl.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <numbers>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <vector>
+
+/// Shader storage buffer bindings, must match analyse.comp.glsl
+constexpr unsigned int SAMPLE_BINDING = 0;
+constexpr unsigned int WINDOW_BINDING = 1;
+constexpr unsigned int TWIDDLE_BINDING = 2;
+constexpr unsigned int BAND_BINDING = 3;
+constexpr unsigned int WEIGHT_BINDING = 4;
+constexpr unsigned int ENERGY_BINDING = 6;
+
+/// Creates a shader storage buffer with the given contents (or uninitialised, if data is null)
+static unsigned int createBuffer(size_t size, const void *data, GLenum usage) {
+    unsigned int buffer = 0;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, static_cast<GLsizeiptr>(size), data, usage);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    return buffer;
+}
+
+cosc::GpuAnalyser::GpuAnalyser(
+    const AnalysisParams &params, uint32_t sampleRate, const fs::path &shaderPath, size_t maxBlocks)
+    : params(params)
+    , shader(shaderPath)
+    , maxBlocks(maxBlocks) {
+    auto size = params.blockSize;
+    if (size < 2 || size > MAX_BLOCK_SIZE || !std::has_single_bit(size)) {
+        throw std::invalid_argument("GPU analysis block size must be a power of two up to 2048");
+    }
+    if (params.hopSize == 0) {
+        throw std::invalid_argument("Hop size must be non-zero");
+    }
+    if (maxBlocks == 0) {
+        throw std::invalid_argument("GPU analysis must be able to dispatch at least one block");
+    }
+
+    filterbank = Filterbank::get({ .scale = params.scale,
+        .sampleRate = sampleRate,
+        .fftSize = size,
+        .numBars = params.numBars,
+        .freqMin = params.freqMin,
+        .freqMax = params.freqMax });
+
+    // these never change, so upload them once
+    auto window = cosc::analysis::kaiserWindow(size, params.kaiserBeta);
+    windowBuffer = createBuffer(window.size() * sizeof(float), window.data(), GL_STATIC_DRAW);
+
+    // twiddles in double precision, like FFT
+    std::vector<std::array<float, 2>> twiddles(size / 2);
+    for (size_t k = 0; k < size / 2; k++) {
+        double angle = -2.0 * std::numbers::pi * static_cast<double>(k) / static_cast<double>(size);
+        twiddles[k] = { static_cast<float>(std::cos(angle)), static_cast<float>(std::sin(angle)) };
+    }
+    twiddleBuffer = createBuffer(twiddles.size() * sizeof(twiddles[0]), twiddles.data(), GL_STATIC_DRAW);
+
+    // bands are uvec4 in std430, so pad them out
+    std::vector<std::array<uint32_t, 4>> bands;
+    for (const auto &band : filterbank->getBands()) {
+        bands.push_back({ band.firstBin, band.numBins, band.weightOffset, 0 });
+    }
+    bandBuffer = createBuffer(bands.size() * sizeof(bands[0]), bands.data(), GL_STATIC_DRAW);
+    auto weights = filterbank->getWeights();
+    weightBuffer = createBuffer(weights.size_bytes(), weights.data(), GL_STATIC_DRAW);
+
+    // outputs, sized for the largest dispatch
+    barBuffer = createBuffer(maxBlocks * params.numBars * sizeof(uint32_t), nullptr, GL_DYNAMIC_COPY);
+    energyBuffer = createBuffer(maxBlocks * sizeof(float), nullptr, GL_DYNAMIC_READ);
+
+    // samples get re-uploaded every dispatch
+    glGenBuffers(1, &sampleBuffer);
+
+    // energies get copied into this on the GPU, and read back once the copy's fence says it's done.
+    // persistent mapping would save the glGetBufferSubData(), but needs GL 4.4.
+    readbackBuffer = createBuffer(READBACK_SLOTS * sizeof(float), nullptr, GL_STREAM_READ);
+
+    shader.use();
+    shader.setUint("blockSize", size);
+    shader.setUint("log2BlockSize", static_cast<unsigned int>(std::countr_zero(size)));
+    shader.setUint("hopSize", params.hopSize);
+    shader.setUint("numBars", params.numBars);
+    shader.setFloat("minVol", params.minVol);
+    shader.setFloat("maxVol", params.maxVol);
+
+    SPDLOG_INFO(
+        "GPU analysis ready: block size {}, hop size {}, {} bars", size, params.hopSize, params.numBars);
+}
+
+cosc::GpuAnalyser::~GpuAnalyser() {
+    for (auto *fence : readbackFences) {
+        if (fence != nullptr) {
+            glDeleteSync(fence);
+        }
+    }
+
+    std::array buffers { sampleBuffer, windowBuffer, twiddleBuffer, bandBuffer, weightBuffer, barBuffer,
+        energyBuffer, readbackBuffer };
+    glDeleteBuffers(static_cast<GLsizei>(buffers.size()), buffers.data());
+}
+
+void cosc::GpuAnalyser::dispatch(std::span<const float> mono, size_t numBlocks) {
+    if (numBlocks > maxBlocks) {
+        throw std::invalid_argument("Too many blocks for one dispatch");
+    }
+    dispatched = numBlocks;
+    if (numBlocks == 0) {
+        return;
+    }
+
+    // only upload the samples these blocks actually cover. orphan the old buffer so that we don't have to
+    // wait for the last dispatch to finish reading it
+    auto numSamples = std::min<size_t>(mono.size(), ((numBlocks - 1) * params.hopSize) + params.blockSize);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, sampleBuffer);
+    auto bufferSize = std::max<size_t>(numSamples, 1) * sizeof(float);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, static_cast<GLsizeiptr>(bufferSize), nullptr, GL_STREAM_DRAW);
+    glBufferSubData(
+        GL_SHADER_STORAGE_BUFFER, 0, static_cast<GLsizeiptr>(numSamples * sizeof(float)), mono.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, SAMPLE_BINDING, sampleBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, WINDOW_BINDING, windowBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, TWIDDLE_BINDING, twiddleBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BAND_BINDING, bandBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, WEIGHT_BINDING, weightBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BAR_BUFFER_BINDING, barBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, ENERGY_BINDING, energyBuffer);
+
+    shader.use();
+    shader.setUint("numSamples", static_cast<unsigned int>(numSamples));
+    glDispatchCompute(static_cast<GLuint>(numBlocks), 1, 1);
+
+    // make the results visible to both the bar shader and read()
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+void cosc::GpuAnalyser::read(std::span<uint16_t> bars, std::span<float> energies) {
+    auto numBars = params.numBars;
+    if (!bars.empty()) {
+        std::vector<uint32_t> wide(dispatched * numBars);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, barBuffer);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+            static_cast<GLsizeiptr>(wide.size() * sizeof(uint32_t)), wide.data());
+        std::transform(
+            wide.begin(), wide.end(), bars.begin(), [](uint32_t bar) { return static_cast<uint16_t>(bar); });
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, energyBuffer);
+    glGetBufferSubData(
+        GL_SHADER_STORAGE_BUFFER, 0, static_cast<GLsizeiptr>(dispatched * sizeof(float)), energies.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void cosc::GpuAnalyser::requestEnergy() {
+    if (dispatched == 0) {
+        return;
+    }
+    // if the GPU is so far behind that every slot is still in flight, give up on the oldest one rather than
+    // wait for it
+    auto slot = readbackNext;
+    if (readbackFences[slot] != nullptr) {
+        glDeleteSync(readbackFences[slot]);
+        readbackFences[slot] = nullptr;
+        readbackOldest = (slot + 1) % READBACK_SLOTS;
+    }
+
+    // the barrier in dispatch() covers this copy
+    glBindBuffer(GL_COPY_READ_BUFFER, energyBuffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, readbackBuffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0,
+        static_cast<GLintptr>(slot * sizeof(float)), sizeof(float));
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    readbackFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readbackNext = (slot + 1) % READBACK_SLOTS;
+}
+
+bool cosc::GpuAnalyser::pollEnergy(float &energy) {
+    // copies finish in order, so stop at the first one that hasn't
+    bool updated = false;
+    while (readbackFences[readbackOldest] != nullptr) {
+        auto *fence = readbackFences[readbackOldest];
+        auto status = glClientWaitSync(fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+            break;
+        }
+        glDeleteSync(fence);
+        readbackFences[readbackOldest] = nullptr;
+        // the copy is done, so this doesn't have to wait for the GPU
+        glBindBuffer(GL_COPY_READ_BUFFER, readbackBuffer);
+        glGetBufferSubData(GL_COPY_READ_BUFFER, static_cast<GLintptr>(readbackOldest * sizeof(float)),
+            sizeof(float), &energy);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        updated = true;
+        readbackOldest = (readbackOldest + 1) % READBACK_SLOTS;
+    }
+    return updated;
+}
+
+void cosc::GpuAnalyser::bindBars() const {
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BAR_BUFFER_BINDING, barBuffer);
+}
@@ -0,0 +1,63 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#include "cosc/live_analyser.hpp"
+#include <algorithm>
+#include <bit>
+#include <spdlog/spdlog.h>
+
+/// Ring capacity, in multiples of the block size
+constexpr size_t RING_BLOCKS = 8;
+
+/// Multiplied into the peak spectral energy every update, so that the energy ratio recovers after a loud
+/// section instead of staying pinned near zero for the rest of the song
+constexpr float PEAK_DECAY = 0.999f;
+
+/// Divide to convert s32 PCM to a float in -1..1
+constexpr float S32_TO_FLOAT = 2147483648.f;
+
+cosc::LiveAnalyser::LiveAnalyser(const AnalysisParams &params, uint32_t sampleRate)
+    : analyser(params, sampleRate)
+    , capacity(std::bit_ceil(params.blockSize * RING_BLOCKS))
+    , block(params.blockSize) {
+    SPDLOG_INFO("Live analysis with a {} sample ring", capacity);
+    ring = std::make_unique<std::atomic<float>[]>(capacity);
+}
+
+void cosc::LiveAnalyser::push(const int32_t *pcm, size_t frames, unsigned int channels) {
+    // we are the only writer, so nobody else can change writePos under us
+    auto pos = writePos.load(std::memory_order_relaxed);
+    auto scale = 1.f / (S32_TO_FLOAT * static_cast<float>(channels));
+    for (size_t i = 0; i < frames; i++) {
+        int64_t sum = 0;
+        for (unsigned int c = 0; c < channels; c++) {
+            sum += pcm[(i * channels) + c];
+        }
+        ring[(pos + i) & (capacity - 1)].store(static_cast<float>(sum) * scale, std::memory_order_relaxed);
+    }
+    // publish the new samples to the render thread
+    writePos.store(pos + frames, std::memory_order_release);
+}
+
+float cosc::LiveAnalyser::update(std::span<uint16_t> bars) {
+    return energyRatio(analyser.processBlock(latestBlock(), bars).spectralEnergy);
+}
+
+std::span<const float> cosc::LiveAnalyser::latestBlock() {
+    auto pos = writePos.load(std::memory_order_acquire);
+    auto blockSize = block.size();
+
+    // copy out the most recent block, oldest to newest. if we haven't got a full block yet (i.e. the very
+    // start of the song), pad the front with silence.
+    auto available = std::min<uint64_t>(pos, blockSize);
+    auto padding = blockSize - available;
+    std::fill(block.begin(), block.begin() + static_cast<ptrdiff_t>(padding), 0.f);
+    for (size_t i = 0; i < available; i++) {
+        block[padding + i] = ring[(pos - available + i) & (capacity - 1)].load(std::memory_order_relaxed);
+    }
+    return block;
+}
+
+float cosc::LiveAnalyser::energyRatio(float energy) {
+    peakEnergy = std::max(energy, peakEnergy * PEAK_DECAY);
+    return peakEnergy > 0.f ? energy / peakEnergy : 0.f;
+}
@@ -1,13 +1,19 @@
 // Copyright 2024 Matt Young.
 // SPDX-License-Identifier: ISC
 #include "cosc/animation.hpp"
+#include "cosc/assets.hpp"
 #include "cosc/camera.hpp"
 #include "cosc/cubemap.hpp"
+#include "cosc/events.hpp"
 #include "cosc/framebuffer.hpp"
+#include "cosc/gpu_analyser.hpp"
 #include "cosc/intro.hpp"
+#include "cosc/mesh_cache.hpp"
 #include "cosc/model.hpp"
 #include "cosc/shader.hpp"
 #include "cosc/song_data.hpp"
+#include "cosc/spectrum_analyser.hpp"
+#include "cosc/task_graph.hpp"
 #include "cosc/util.hpp"
 #include "glad/gl.h"
 #include <SDL2/SDL.h>
@@ -16,10 +22,17 @@
 #include <SDL2/SDL_mouse.h>
 #include <SDL2/SDL_video.h>
 #include <SDL_audio.h>
+#include <algorithm>
 #include <chrono>
 #include <glm/ext/matrix_clip_space.hpp>
 #include <glm/gtc/quaternion.hpp>
+#include <memory>
+#include <optional>
 #include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #if FULLSCREEN == 0
 constexpr int WIDTH = 1600;
@@ -32,8 +45,10 @@ constexpr int AUDIO_SAMPLES = 128;
 cosc::CameraPersp camera;
 cosc::CameraAnimationManager animationManager(camera);
 
-/// List of bar models
-std::vector<cosc::Model> barModels;
+/// Meshes of every model, so each model file is only loaded once
+cosc::MeshCache meshCache;
+/// Bar model, every bar is an instance of it
+std::unique_ptr<cosc::Model> barModel;
 /// Capture cursor
 bool isCursorCapture = true;
 /// Freecam: Allows free movement for debugging
@@ -74,22 +89,24 @@ void GLAPIENTRY glMessageCallback(GLenum source, GLenum type, GLuint id, GLenum
 }
 // NOLINTEND
 
-/// Load and construct bar models. The bar model is based on a unit cube exported from Blender.
+/// Load and construct the bar model. The bar model is based on a unit cube exported from Blender. It's only
+/// loaded once, and every bar is drawn as an instance of it, which bar.vert.glsl spaces out along x.
 void constructBars(const cosc::SongData &songData, const std::string &dataDir) {
-    for (size_t i = 0; i < songData.spectrum.getNumBars(); i++) {
-        SPDLOG_DEBUG("Adding bar {}/{}", i, songData.spectrum.getNumBars() - 1);
-        auto model = cosc::Model(dataDir + "/cube.dae");
-        // apply initial transform
-        model.pos.x = BAR_SPACING * static_cast<float>(i);
-        // initial uniform scaling
-        model.scale = glm::vec3(BAR_SCALING, BAR_SCALING, BAR_SCALING);
-        // make the bars a bit wider
-        model.scale.z *= BAR_WIDTH_MULT;
-        model.scale.x *= BAR_WIDTH_MULT;
-        // y is of course scaled by the visualiser itself
-
-        barModels.push_back(model);
+    auto numBars = songData.getNumBars();
+    SPDLOG_DEBUG("Adding {} bars", numBars);
+    barModel = std::make_unique<cosc::Model>(meshCache, dataDir + "/cube.dae");
+    // initial uniform scaling
+    barModel->scale = glm::vec3(BAR_SCALING, BAR_SCALING, BAR_SCALING);
+    // make the bars a bit wider
+    barModel->scale.z *= BAR_WIDTH_MULT;
+    barModel->scale.x *= BAR_WIDTH_MULT;
+    // past BAR_LAYOUT_BARS, squeeze the bars together so the row stays the same width. the scale is applied
+    // after the translation, so this narrows the spacing as well as the bars.
+    if (numBars > BAR_LAYOUT_BARS) {
+        barModel->scale.x *= static_cast<float>(BAR_LAYOUT_BARS) / static_cast<float>(numBars);
     }
+    // y is of course scaled by the visualiser itself
+    barModel->applyTransform();
 }
 
 /// Adds animations to the visualiser
@@ -243,119 +260,194 @@ void pollInputs() {
 }
 
 int main(int argc, char *argv[]) {
+    // for the time to first frame
+    auto startupBegin = std::chrono::steady_clock::now();
     spdlog::set_level(spdlog::level::debug);
     SPDLOG_INFO("COSC3000 Major Project (Computer Graphics) - Matt Young, 2024");
 
-    if (argc < 3) {
-        SPDLOG_ERROR("Usage: {} [data_dir_path] [song_name]", argv[0]);
+    // analysis options can go anywhere, everything else is positional. they only matter when the spectrum
+    // is generated, or for live analysis, and should match what musicvis-analyze was given.
+    std::vector<std::string_view> args;
+    cosc::AnalysisParams params;
+    for (int i = 1; i < argc; i++) {
+        try {
+            if (!cosc::analysis::parseAnalysisOption(argc, argv, i, params)) {
+                args.emplace_back(argv[i]);
+            }
+        } catch (const std::invalid_argument &e) {
+            SPDLOG_ERROR("{}", e.what());
+            return 1;
+        }
+    }
+
+    if (args.size() < 2) {
+        SPDLOG_ERROR("Usage: {} [--bars N] [--bar-format u8|u16|f16] [data_dir_path] [song_name]", argv[0]);
         return 1;
     }
 
-    fs::path dataDir = argv[1];
-    std::string songName = argv[2];
+    fs::path dataDir = args[0];
+    std::string songName(args[1]);
     SPDLOG_INFO("Data dir: {}", dataDir.string());
     SPDLOG_INFO("Song name: {}", songName);
 
-    // load song data
-    cosc::SongData songData(dataDir, songName);
+    // everything else in the data dir is read through the asset archive, if there is one
+    cosc::vfs::mount(dataDir);
+
+    // startup is a graph of tasks, so that the CPU bound ones (loading the song, converting its audio)
+    // overlap with the ones that have to be on the main thread (SDL, GL context, shaders). objects that tasks
+    // create live out here, and are filled in by the task.
+    std::optional<cosc::SongData> songDataHolder;
+    SDL_AudioSpec audioSpec {};
+    SDL_AudioSpec obtained {};
+    int audioDevice = -1;
+    SDL_Window *window = nullptr;
+    SDL_GLContext context = nullptr;
+    int scrWidth = 0;
+    int scrHeight = 0;
+    std::optional<cosc::Cubemap> skyboxHolder;
+    std::optional<cosc::Shader> barShaderHolder;
+    std::optional<cosc::IntroManager> introHolder;
+    std::optional<cosc::FrameBuffer> frameBufferHolder;
 
-    // init SDL2
-    SPDLOG_DEBUG("Initialising SDL2");
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) == -1) {
-        SPDLOG_ERROR("Failed to init SDL: {}", SDL_GetError());
-        return 1;
-    }
+    using Thread = cosc::TaskGraph::Thread;
+    cosc::TaskGraph startup;
+
+    // load song data
+    auto loadSong
+        = startup.add("song", Thread::WORKER, [&]() { songDataHolder.emplace(dataDir, songName, params); });
+
+    auto initSdl = startup.add("sdl", Thread::MAIN, [&]() {
+        SPDLOG_DEBUG("Initialising SDL2");
+        if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) == -1) {
+            SPDLOG_ERROR("Failed to init SDL: {}", SDL_GetError());
+            throw std::runtime_error("Failed to init SDL");
+        }
+    });
 
     // open audio, reference: https://www.libsdl.org/release/SDL-1.2.15/docs/html/guideaudioexamples.html
-    SDL_AudioSpec audioSpec = {
-        .freq = static_cast<int>(songData.spectrum.getSampleRate()),
-        .format = AUDIO_S32,
-        .channels = 2,
-        // This needs to be set to a small value, otherwise the number of samples that mixAudio() copies into
-        // its output buffer is too many, and we can't figure out which block we're in! (i.e. we skip blocks
-        // because we're diving by a larger number).
-        // Just don't make this too small otherwise you'll eventually run into choppy audio.
-        .samples = AUDIO_SAMPLES,
-        .callback = audio_callback,
-        .userdata = static_cast<void *>(&songData),
-    };
-    SDL_AudioSpec obtained;
-
-    int audioDevice = SDL_OpenAudioDevice(nullptr, 0, &audioSpec, &obtained, SDL_AUDIO_ALLOW_ANY_CHANGE);
-    if (audioDevice < 0) {
-        SPDLOG_ERROR("Failed to initialise SDL audio: {}", SDL_GetError());
-        return 1;
-    }
-    SPDLOG_DEBUG("Obtained audio config with freq {} Hz, format {}, channels {}, samples {}", obtained.freq,
-        obtained.format, obtained.channels, obtained.samples);
-
-    // request OpenGL 4.5, double buffering, and a depth buffer
-    // source: https://news.ycombinator.com/item?id=6204597
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4); // OpenGL 4.5
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 5);
-    SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
-    SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
-    SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 1); // enable MSAA
-    SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 8); // 8x MSAA
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE); // use Core profile
-    SPDLOG_DEBUG("Loading OpenGL");
-    // source: https://bcmpinc.wordpress.com/2015/08/18/creating-an-opengl-4-5-context-using-sdl2-and-glad/
-    if (SDL_GL_LoadLibrary(nullptr) < 0) {
-        SPDLOG_ERROR("Failed to load OpenGL: {}", SDL_GetError());
-        return 1;
-    }
+    auto openAudio = startup.add(
+        "audio device", Thread::MAIN,
+        [&]() {
+            audioSpec = {
+                .freq = static_cast<int>(songDataHolder->getSampleRate()),
+                .format = AUDIO_S32,
+                .channels = 2,
+                // This needs to be set to a small value, otherwise the number of samples that mixAudio()
+                // copies into its output buffer is too many, and we can't figure out which block we're in!
+                // (i.e. we skip blocks because we're diving by a larger number).
+                // Just don't make this too small otherwise you'll eventually run into choppy audio.
+                .samples = AUDIO_SAMPLES,
+                .callback = audio_callback,
+                .userdata = static_cast<void *>(&*songDataHolder),
+            };
+            audioDevice = SDL_OpenAudioDevice(nullptr, 0, &audioSpec, &obtained, SDL_AUDIO_ALLOW_ANY_CHANGE);
+            if (audioDevice < 0) {
+                SPDLOG_ERROR("Failed to initialise SDL audio: {}", SDL_GetError());
+                throw std::runtime_error("Failed to initialise SDL audio");
+            }
+            SPDLOG_DEBUG("Obtained audio config with freq {} Hz, format {}, channels {}, samples {}",
+                obtained.freq, obtained.format, obtained.channels, obtained.samples);
+        },
+        { loadSong, initSdl });
+
+    // setup song data audio stream - after this, audio should be good to go. the device stays paused until
+    // startup is done, so this can convert the audio while the main thread sets up GL.
+    startup.add(
+        "audio convert", Thread::WORKER,
+        [&]() { songDataHolder->setupAudio(audioSpec.format, obtained.format); }, { openAudio });
+
+    auto createContext = startup.add(
+        "gl context", Thread::MAIN,
+        [&]() {
+            // request OpenGL 4.5, double buffering, and a depth buffer
+            // source: https://news.ycombinator.com/item?id=6204597
+            SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4); // OpenGL 4.5
+            SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 5);
+            SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+            SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
+            SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 1); // enable MSAA
+            SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 8); // 8x MSAA
+            SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE); // use Core profile
+            SPDLOG_DEBUG("Loading OpenGL");
+            // source:
+            // https://bcmpinc.wordpress.com/2015/08/18/creating-an-opengl-4-5-context-using-sdl2-and-glad/
+            if (SDL_GL_LoadLibrary(nullptr) < 0) {
+                SPDLOG_ERROR("Failed to load OpenGL: {}", SDL_GetError());
+                throw std::runtime_error("Failed to load OpenGL");
+            }
 
 #if FULLSCREEN == 0
-    SDL_Window *window = SDL_CreateWindow("COSC3000 Major Project (Computer Graphics)",
-        SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT,
-        SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI);
+            window = SDL_CreateWindow("COSC3000 Major Project (Computer Graphics)", SDL_WINDOWPOS_CENTERED,
+                SDL_WINDOWPOS_CENTERED, WIDTH, HEIGHT,
+                SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI);
 #else
-    SDL_Window *window = SDL_CreateWindow("COSC3000 Major Project (Computer Graphics)", 0, 0, 0, 0,
-        SDL_WINDOW_OPENGL | SDL_WINDOW_FULLSCREEN_DESKTOP);
+            window = SDL_CreateWindow("COSC3000 Major Project (Computer Graphics)", 0, 0, 0, 0,
+                SDL_WINDOW_OPENGL | SDL_WINDOW_FULLSCREEN_DESKTOP);
 #endif
-    if (window == nullptr) {
-        SPDLOG_ERROR("Failed to create window: {}", SDL_GetError());
-        return 1;
-    }
-    SPDLOG_INFO("Using video driver: {}", SDL_GetCurrentVideoDriver());
-
-    SDL_GLContext context = SDL_GL_CreateContext(window);
-    if (context == nullptr) {
-        SPDLOG_ERROR("Failed to create SDL GL context: {}", SDL_GetError());
-    }
+            if (window == nullptr) {
+                SPDLOG_ERROR("Failed to create window: {}", SDL_GetError());
+                throw std::runtime_error("Failed to create window");
+            }
+            SPDLOG_INFO("Using video driver: {}", SDL_GetCurrentVideoDriver());
 
-    gladLoadGL((GLADloadfunc) SDL_GL_GetProcAddress);
-    SPDLOG_INFO("GL vendor: {}", (const char *) glGetString(GL_VENDOR));
-    SPDLOG_INFO("GL renderer: {}", (const char *) glGetString(GL_RENDERER));
-    SPDLOG_INFO("GL version: {}", (const char *) glGetString(GL_VERSION));
+            context = SDL_GL_CreateContext(window);
+            if (context == nullptr) {
+                SPDLOG_ERROR("Failed to create SDL GL context: {}", SDL_GetError());
+            }
 
-    // setup baseline GL stuff
-    int scrWidth = 0;
-    int scrHeight = 0;
-    SDL_GL_GetDrawableSize(window, &scrWidth, &scrHeight);
-    glEnable(GL_DEBUG_OUTPUT);
-    glDebugMessageCallback(glMessageCallback, nullptr);
-    glViewport(0, 0, scrWidth, scrHeight);
-    glEnable(GL_DEPTH_TEST);
+            gladLoadGL((GLADloadfunc) SDL_GL_GetProcAddress);
+            SPDLOG_INFO("GL vendor: {}", (const char *) glGetString(GL_VENDOR));
+            SPDLOG_INFO("GL renderer: {}", (const char *) glGetString(GL_RENDERER));
+            SPDLOG_INFO("GL version: {}", (const char *) glGetString(GL_VERSION));
+
+            // setup baseline GL stuff
+            SDL_GL_GetDrawableSize(window, &scrWidth, &scrHeight);
+            glEnable(GL_DEBUG_OUTPUT);
+            glDebugMessageCallback(glMessageCallback, nullptr);
+            glViewport(0, 0, scrWidth, scrHeight);
+            glEnable(GL_DEPTH_TEST);
 #if WIREFRAME == 1
-    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+            glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 #endif
+        },
+        { initSdl });
 
     // setup our custom GL objects
-    constructBars(songData, dataDir);
+    startup.add(
+        "bars", Thread::MAIN, [&]() { constructBars(*songDataHolder, dataDir); },
+        { loadSong, createContext });
+    startup.add(
+        "skybox", Thread::MAIN, [&]() { skyboxHolder.emplace(dataDir, "skybox"); }, { createContext });
+    startup.add(
+        "bar shader", Thread::MAIN,
+        [&]() { barShaderHolder.emplace(dataDir / "bar.vert.glsl", dataDir / "bar.frag.glsl"); },
+        { createContext });
+    startup.add("intro", Thread::MAIN, [&]() { introHolder.emplace(dataDir); }, { createContext });
+    startup.add(
+        "framebuffer", Thread::MAIN,
+        [&]() { frameBufferHolder.emplace(dataDir, "post.frag.glsl", scrWidth, scrHeight); },
+        { createContext });
+
+    try {
+        startup.run();
+    } catch (const std::exception &e) {
+        SPDLOG_ERROR("Startup failed: {}", e.what());
+        return 1;
+    }
+    startup.logTimeline();
     addAnimations();
-    cosc::Cubemap skybox(dataDir, "skybox");
-    cosc::Shader barShader(dataDir / "bar.vert.glsl", dataDir / "bar.frag.glsl");
-    cosc::IntroManager intro(dataDir);
-    cosc::FrameBuffer frameBuffer(dataDir, "post.frag.glsl", scrWidth, scrHeight);
+
+    auto &songData = *songDataHolder;
+    auto &skybox = *skyboxHolder;
+    auto &barShader = *barShaderHolder;
+    auto &intro = *introHolder;
+    auto &frameBuffer = *frameBufferHolder;
 
     // basically capture mouse, for FPS controls
     // note this is different from SDL_CaptureMouse though, but we are emulating the behaviour of what, for
     // example, libGDX would call "capture mouse"
     SDL_SetRelativeMouseMode(isCursorCapture ? SDL_TRUE : SDL_FALSE);
 
-    // setup song data audio stream - after this, audio should be good to go
-    songData.setupAudio(audioSpec.format, obtained.format);
     SDL_PauseAudioDevice(audioDevice, 0);
 
     // manually calculated :skull:
@@ -366,24 +458,78 @@ int main(int argc, char *argv[]) {
     camera.setNearClip(0.1f);
     camera.setFarClip(200.0f);
 
+#if LIVE_ANALYSIS == 1 && GPU_ANALYSIS == 1
+    cosc::GpuAnalyser gpuAnalyser(
+        songData.live->getParams(), songData.getSampleRate(), dataDir / "analyse.comp.glsl");
+    float gpuEnergy = 0.f;
+#elif LIVE_ANALYSIS == 1
+    std::vector<uint16_t> liveBars(songData.getNumBars());
+#else
     auto maxSpectralEnergy = songData.spectrum.getMaxSpectralEnergy();
+    cosc::EventCursor eventCursor(songData.events.getEvents());
+    size_t beatCount = 0;
+#endif
+#if LIVE_ANALYSIS == 0 || GPU_ANALYSIS == 0
+    // bar heights for the bar shader, uploaded every frame, one uint per bar like the GPU analyser's output
+    std::vector<uint32_t> barLevels(songData.getNumBars());
+    unsigned int barBuffer = 0;
+    glGenBuffers(1, &barBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, barBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, static_cast<GLsizeiptr>(barLevels.size() * sizeof(uint32_t)),
+        nullptr, GL_STREAM_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+#endif
 
+    bool isFirstFrame = true;
     while (cosc::isAppRunning(appStatus)) {
         auto begin = std::chrono::steady_clock::now();
 
         // process SDL input
         pollInputs();
 
+#if LIVE_ANALYSIS == 1 && GPU_ANALYSIS == 1
+        // the bars stay on the GPU for the bar shader, only the spectral energy has to come back, and it
+        // arrives a frame or so late so that we never wait on the GPU
+        gpuAnalyser.dispatch(songData.live->latestBlock(), 1);
+        gpuAnalyser.requestEnergy();
+        gpuAnalyser.pollEnergy(gpuEnergy);
+        auto spectralEnergyRatio = songData.live->energyRatio(gpuEnergy);
+#elif LIVE_ANALYSIS == 1
+        // analyse whatever audio mixAudio() most recently sent to the driver
+        auto spectralEnergyRatio = songData.live->update(liveBars);
+        const auto &block = liveBars;
+#else
         // current spectrum block
-        // note that songData.blockPos gets updated by mixAudio() (FIXME possible race condition?)
-        auto block = songData.spectrum.getBlocks()[songData.blockPos];
-        auto spectralEnergy = songData.spectrum.getSpectralEnergyBlocks()[songData.blockPos];
+        // note that songData.blockPos gets updated by mixAudio(), so read it once, otherwise the bars and
+        // energy could come from different chunks
+        size_t blockPos = songData.blockPos.load(std::memory_order_relaxed);
+        auto block = songData.getBars(blockPos);
+        auto spectralEnergyRatio = songData.getFeatures(blockPos).spectralEnergy / maxSpectralEnergy;
+
+        // catch up on any onsets/beats since the last frame
+        MusicVisEvent::Reader event;
+        while (eventCursor.next(blockPos, event)) {
+            if (event.getType() != MusicVisEventType::BEAT) {
+                continue;
+            }
+            beatCount++;
+#if CUT_ON_BEAT == 1
+            if (beatCount % BEATS_PER_CUT == 0 && cosc::isNotInIntro(appStatus) && !isFreeCam) {
+                animationManager.forceAdvanceAnimation();
+            }
+#endif
+        }
+#endif
 
         // bind FBO - only if we're out of the intro
         if (cosc::isNotInIntro(appStatus)) {
             frameBuffer.bind();
         }
 
+        // stream in any textures that have finished loading, the skybox too so it's ready after the intro
+        intro.update();
+        skybox.update();
+
         // clear screen - always in intro or out of intro
         glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -410,7 +556,7 @@ int main(int argc, char *argv[]) {
         } else {
             // update camera animations
             if (!isFreeCam) {
-                animationManager.update(delta, spectralEnergy / maxSpectralEnergy);
+                animationManager.update(delta, spectralEnergyRatio);
             }
 
             // enable our shader program (before we push uniforms)
@@ -421,30 +567,43 @@ int main(int argc, char *argv[]) {
             barShader.setMat4("view", camera.getViewMatrix());
             barShader.setVec3("viewPos", camera.getEyePoint());
 
-            // current bar we're editing
-            size_t barIdx = 0;
-            for (auto &bar : barModels) {
-                // first, get bar height from 0-255 directly from the Cap'n Proto
-                auto barHeight = block[barIdx];
-                // map that 0 to 255 to BAR_MIN_HEIGHT to BAR_MAX_HEIGHT
-                auto scale = cosc::util::mapRange(0., 255., BAR_MIN_HEIGHT, BAR_MAX_HEIGHT, barHeight);
-                // apply scale, also applying our baseline BAR_SCALING factor!
-                bar.scale.y = static_cast<float>(scale * BAR_SCALING);
-                barIdx++;
-
-                // now update transforms, and off to the GPU we go!
-                bar.applyTransform();
-                bar.draw(barShader);
-            }
+#if LIVE_ANALYSIS == 1 && GPU_ANALYSIS == 1
+            // bar heights come straight from the analysis compute shader
+            gpuAnalyser.bindBars();
+#else
+            // bar heights (0..MAX_BAR_LEVEL) from the spectrum or live analyser, widened to what the shader
+            // reads
+            std::copy(block.begin(), block.end(), barLevels.begin());
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, barBuffer);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+                static_cast<GLsizeiptr>(barLevels.size() * sizeof(uint32_t)), barLevels.data());
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, cosc::BAR_BUFFER_BINDING, barBuffer);
+#endif
+            // the shader maps each height to BAR_MIN_HEIGHT..BAR_MAX_HEIGHT, on top of the BAR_SCALING baked
+            // into the model transform
+            barShader.setFloat("barSpacing", BAR_SPACING);
+            barShader.setFloat("barMinHeight", BAR_MIN_HEIGHT);
+            barShader.setFloat("barMaxHeight", BAR_MAX_HEIGHT);
+
+            // and off to the GPU we go, every bar in one draw call
+            barModel->drawInstanced(barShader, songData.getNumBars());
 
             // draw skybox!
             skybox.draw(camera);
 
             // we would have bound the FBO above, so now draw using it
-            frameBuffer.draw(spectralEnergy / maxSpectralEnergy);
+            frameBuffer.draw(spectralEnergyRatio);
         }
 
         SDL_GL_SwapWindow(window);
+        if (isFirstFrame) {
+            auto firstFrame = std::chrono::steady_clock::now();
+            SPDLOG_INFO("Time to first frame: {:.1f} ms",
+                std::chrono::duration_cast<std::chrono::nanoseconds>(firstFrame - startupBegin).count()
+                    / NANO_TO_SEC * MS_TO_SEC);
+            isFirstFrame = false;
+        }
 
         // calculate delta time
         auto end = std::chrono::steady_clock::now();
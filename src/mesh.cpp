@@ -5,7 +5,8 @@
 #include <spdlog/spdlog.h>
 #include <string>
 
-void cosc::Mesh::setupMesh() {
+void cosc::Mesh::setupMesh(std::span<const Vertex> vertices, std::span<const unsigned int> indices) {
+    numIndices = indices.size();
     glGenVertexArrays(1, &vao);
     glGenBuffers(1, &vbo);
     glGenBuffers(1, &ebo);
@@ -13,10 +14,10 @@ void cosc::Mesh::setupMesh() {
     glBindVertexArray(vao);
     glBindBuffer(GL_ARRAY_BUFFER, vbo);
 
-    glBufferData(GL_ARRAY_BUFFER, verts.size() * sizeof(Vertex), &verts[0], GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size_bytes(), vertices.data(), GL_STATIC_DRAW);
 
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size_bytes(), indices.data(), GL_STATIC_DRAW);
 
     // vertex positions
     glEnableVertexAttribArray(0);
@@ -65,6 +66,13 @@ void cosc::Mesh::draw(cosc::Shader &shader) const {
 
     // draw mesh
     glBindVertexArray(vao);
-    glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
+    glDrawElements(GL_TRIANGLES, numIndices, GL_UNSIGNED_INT, 0);
+    glBindVertexArray(0);
+}
+
+void cosc::Mesh::drawInstanced(size_t count) const {
+    glBindVertexArray(vao);
+    glDrawElementsInstanced(
+        GL_TRIANGLES, static_cast<GLsizei>(numIndices), GL_UNSIGNED_INT, 0, static_cast<GLsizei>(count));
     glBindVertexArray(0);
 }
@@ -0,0 +1,204 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#include "cosc/mesh_cache.hpp"
+#include "cosc/assets.hpp"
+#include "cosc/spectrum_analyser.hpp"
+#include <array>
+#include <assimp/Importer.hpp>
+#include <assimp/postprocess.h>
+#include <assimp/scene.h>
+#include <cstring>
+#include <optional>
+#include <spdlog/spdlog.h>
+#include <string_view>
+
+/// Header of a mesh cache file. Each mesh follows as a MeshCacheEntry, its vertices, then its indices. Like
+/// the PCM cache, this is only read back on the machine that wrote it (or one like it), so it's native byte
+/// order, and every array is 4 byte aligned so it can be uploaded straight out of the mapping.
+struct MeshCacheHeader {
+    std::array<char, 8> magic;
+    /// hashBytes() of the model file the meshes were imported from
+    uint64_t sourceHash;
+    uint32_t numMeshes;
+    /// sizeof(Vertex), in case its layout ever changes
+    uint32_t vertexSize;
+};
+
+struct MeshCacheEntry {
+    uint32_t numVertices;
+    uint32_t numIndices;
+};
+
+/// First 8 bytes of a mesh cache file
+constexpr std::string_view MESH_CACHE_MAGIC = "musicmsh";
+
+/// Tries to load meshes from a mesh cache. Returns false if it's missing, or isn't for this model file.
+static bool loadMeshCache(
+    const fs::path &cacheFile, uint64_t sourceHash, std::vector<cosc::Mesh> &meshes) {
+    std::optional<cosc::Asset> cache;
+    try {
+        cache = cosc::vfs::map(cacheFile);
+    } catch (const std::exception &e) {
+        SPDLOG_DEBUG("No mesh cache {}: {}", cacheFile.string(), e.what());
+        return false;
+    }
+    auto bytes = cache->getBytes();
+
+    MeshCacheHeader header {};
+    if (bytes.size() < sizeof(header)) {
+        SPDLOG_WARN("Mesh cache {} is truncated, will regenerate it", cacheFile.string());
+        return false;
+    }
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    if (std::string_view(header.magic.data(), header.magic.size()) != MESH_CACHE_MAGIC
+        || header.sourceHash != sourceHash || header.vertexSize != sizeof(cosc::Vertex)
+        || reinterpret_cast<uintptr_t>(bytes.data()) % alignof(cosc::Vertex) != 0) {
+        SPDLOG_INFO("Mesh cache {} is stale, will regenerate it", cacheFile.string());
+        return false;
+    }
+
+    // check every mesh is in bounds before uploading any of them
+    std::vector<std::pair<std::span<const cosc::Vertex>, std::span<const unsigned int>>> cached;
+    size_t offset = sizeof(header);
+    for (uint32_t i = 0; i < header.numMeshes; i++) {
+        MeshCacheEntry entry {};
+        if (bytes.size() - offset < sizeof(entry)) {
+            SPDLOG_WARN("Mesh cache {} is truncated, will regenerate it", cacheFile.string());
+            return false;
+        }
+        std::memcpy(&entry, bytes.data() + offset, sizeof(entry));
+        offset += sizeof(entry);
+        auto vertexBytes = static_cast<size_t>(entry.numVertices) * sizeof(cosc::Vertex);
+        auto indexBytes = static_cast<size_t>(entry.numIndices) * sizeof(unsigned int);
+        if (bytes.size() - offset < vertexBytes + indexBytes) {
+            SPDLOG_WARN("Mesh cache {} is truncated, will regenerate it", cacheFile.string());
+            return false;
+        }
+        cached.emplace_back(
+            std::span(reinterpret_cast<const cosc::Vertex *>(bytes.data() + offset), entry.numVertices),
+            std::span(reinterpret_cast<const unsigned int *>(bytes.data() + offset + vertexBytes),
+                entry.numIndices));
+        offset += vertexBytes + indexBytes;
+    }
+
+    for (const auto &[vertices, indices] : cached) {
+        meshes.emplace_back(vertices, indices);
+    }
+    SPDLOG_DEBUG("Loaded {} meshes from mesh cache {}", meshes.size(), cacheFile.string());
+    return true;
+}
+
+/// Writes meshes to a mesh cache, logging rather than throwing if that fails
+static void writeMeshCache(
+    const fs::path &cacheFile, uint64_t sourceHash, const std::vector<cosc::Mesh> &meshes) {
+    MeshCacheHeader header {};
+    std::copy(MESH_CACHE_MAGIC.begin(), MESH_CACHE_MAGIC.end(), header.magic.begin());
+    header.sourceHash = sourceHash;
+    header.numMeshes = static_cast<uint32_t>(meshes.size());
+    header.vertexSize = sizeof(cosc::Vertex);
+    try {
+        cosc::analysis::writeAtomically(
+            cacheFile, [&](kj::BufferedOutputStreamWrapper &output, int /* fd */) {
+                output.write(&header, sizeof(header));
+                for (const auto &mesh : meshes) {
+                    MeshCacheEntry entry { .numVertices = static_cast<uint32_t>(mesh.verts.size()),
+                        .numIndices = static_cast<uint32_t>(mesh.indices.size()) };
+                    output.write(&entry, sizeof(entry));
+                    output.write(mesh.verts.data(), mesh.verts.size() * sizeof(cosc::Vertex));
+                    output.write(mesh.indices.data(), mesh.indices.size() * sizeof(unsigned int));
+                }
+            });
+    } catch (const std::exception &e) {
+        // e.g. read-only data dir, we'll just have to import it again next time
+        SPDLOG_WARN("Failed to write mesh cache {}: {}", cacheFile.string(), e.what());
+    }
+}
+
+static cosc::Mesh processMesh(aiMesh *mesh) {
+    std::vector<cosc::Vertex> vertices;
+    std::vector<unsigned int> indices;
+    std::vector<cosc::Texture> textures;
+
+    for (unsigned int i = 0; i < mesh->mNumVertices; i++) {
+        cosc::Vertex vertex;
+        vertex.pos = { mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z };
+        vertex.norm = { mesh->mNormals[i].x, mesh->mNormals[i].y, mesh->mNormals[i].z };
+        vertices.push_back(vertex);
+    }
+
+    // process indices
+    for (unsigned int i = 0; i < mesh->mNumFaces; i++) {
+        aiFace face = mesh->mFaces[i];
+        for (unsigned int j = 0; j < face.mNumIndices; j++) {
+            indices.push_back(face.mIndices[j]);
+        }
+    }
+
+    // process material
+    if (mesh->mMaterialIndex >= 0) {
+        // TODO
+    }
+
+    return cosc::Mesh(vertices, indices, textures);
+}
+
+static void processNode(aiNode *node, const aiScene *scene, std::vector<cosc::Mesh> &meshes) {
+    SPDLOG_DEBUG("Process node {}", node->mName.C_Str());
+
+    // process all the node's meshes (if any)
+    for (unsigned int i = 0; i < node->mNumMeshes; i++) {
+        aiMesh *mesh = scene->mMeshes[node->mMeshes[i]];
+        meshes.push_back(processMesh(mesh));
+    }
+
+    // then do the same for each of its children
+    for (unsigned int i = 0; i < node->mNumChildren; i++) {
+        processNode(node->mChildren[i], scene, meshes);
+    }
+}
+
+std::shared_ptr<const std::vector<cosc::Mesh>> cosc::MeshCache::get(const fs::path &path) {
+    auto key = path.lexically_normal().string();
+    std::scoped_lock lock(mutex);
+    auto it = loaded.find(key);
+    if (it != loaded.end()) {
+        return it->second;
+    }
+    // loaded while holding the lock, so two threads asking for the same model don't both load it
+    auto meshes = std::make_shared<const std::vector<Mesh>>(load(path));
+    loaded.emplace(key, meshes);
+    return meshes;
+}
+
+std::vector<cosc::Mesh> cosc::MeshCache::load(const fs::path &path) {
+    SPDLOG_DEBUG("Loading model {}", path.string());
+    std::vector<Mesh> meshes;
+
+    // the model file is only hashed here, it's only imported if the mesh cache is missing or stale
+    auto source = cosc::vfs::read(path);
+    auto sourceHash = cosc::util::hashBytes(source.getBytes());
+    auto cacheFile = path;
+    cacheFile.replace_extension(MESH_CACHE_EXTENSION);
+    if (loadMeshCache(cacheFile, sourceHash, meshes)) {
+        return meshes;
+    }
+
+    // Assimp is given the model from memory, so it can come from the asset archive. It can't tell the format
+    // without the file name, so the extension is passed as a hint.
+    auto bytes = source.getBytes();
+    auto hint = path.extension().string();
+    hint.erase(0, 1);
+    Assimp::Importer importer {};
+    const aiScene *scene = importer.ReadFileFromMemory(bytes.data(), bytes.size(),
+        aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_GenNormals, hint.c_str());
+
+    if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) {
+        SPDLOG_ERROR(
+            "Failed to import model '{}' using Assimp: {}", path.string(), importer.GetErrorString());
+        return meshes;
+    }
+
+    processNode(scene->mRootNode, scene, meshes);
+    writeMeshCache(cacheFile, sourceHash, meshes);
+    return meshes;
+}
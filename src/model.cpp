@@ -1,76 +1,32 @@
 // Copyright 2024 Matt Young.
 // SPDX-License-Identifier: ISC
 #include "cosc/model.hpp"
-#include <assimp/Importer.hpp>
-#include <assimp/postprocess.h>
 #include <spdlog/spdlog.h>
-#include "cosc/texture.hpp"
 #include "glad/gl.h"
 #include <glm/gtc/type_ptr.hpp>
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/string_cast.hpp>
 
-cosc::Model::Model(const fs::path &path) {
-    SPDLOG_DEBUG("Loading model {}", path.string());
-    name = path.string();
-
-    Assimp::Importer importer {};
-    const aiScene *scene
-        = importer.ReadFile(path.c_str(), aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_GenNormals);
-
-    if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) {
-        SPDLOG_ERROR(
-            "Failed to import model '{}' using Assimp: {}", path.string(), importer.GetErrorString());
-        return;
-    }
-
-    processNode(scene->mRootNode, scene);
+cosc::Model::Model(MeshCache &cache, const fs::path &path)
+    : name(path.string())
+    , meshes(cache.get(path)) {
 }
 
-void cosc::Model::processNode(aiNode *node, const aiScene *scene) {
-    SPDLOG_DEBUG("Process node {}", node->mName.C_Str());
-
-    // process all the node's meshes (if any)
-    for (unsigned int i = 0; i < node->mNumMeshes; i++) {
-        aiMesh *mesh = scene->mMeshes[node->mMeshes[i]];
-        meshes.push_back(processMesh(mesh));
-    }
-
-    // then do the same for each of its children
-    for (unsigned int i = 0; i < node->mNumChildren; i++) {
-        processNode(node->mChildren[i], scene);
+void cosc::Model::draw(Shader &shader) {
+    setTransform(shader);
+    for (const auto &mesh : *meshes) {
+        mesh.draw(shader);
     }
 }
 
-cosc::Mesh cosc::Model::processMesh(aiMesh *mesh) {
-    std::vector<Vertex> vertices;
-    std::vector<unsigned int> indices;
-    std::vector<Texture> textures;
-
-    for (unsigned int i = 0; i < mesh->mNumVertices; i++) {
-        Vertex vertex;
-        vertex.pos = { mesh->mVertices[i].x, mesh->mVertices[i].y, mesh->mVertices[i].z };
-        vertex.norm = { mesh->mNormals[i].x, mesh->mNormals[i].y, mesh->mNormals[i].z };
-        vertices.push_back(vertex);
+void cosc::Model::drawInstanced(Shader &shader, size_t count) {
+    setTransform(shader);
+    for (const auto &mesh : *meshes) {
+        mesh.drawInstanced(count);
     }
-
-    // process indices
-    for (unsigned int i = 0; i < mesh->mNumFaces; i++) {
-        aiFace face = mesh->mFaces[i];
-        for (unsigned int j = 0; j < face.mNumIndices; j++) {
-            indices.push_back(face.mIndices[j]);
-        }
-    }
-
-    // process material
-    if (mesh->mMaterialIndex >= 0) {
-        // TODO
-    }
-
-    return Mesh(vertices, indices, textures);
 }
 
-void cosc::Model::draw(Shader &shader) {
+void cosc::Model::setTransform(Shader &shader) {
     // send transform matrix to vertex shader
     // source: https://learnopengl.com/Getting-started/Coordinate-Systems (section "Going 3D")
     shader.setMat4("model", transform);
@@ -80,10 +36,6 @@ void cosc::Model::draw(Shader &shader) {
     // per-vertex computation by computing the transform here.
     transformInv = glm::mat3(glm::transpose(glm::inverse(transform)));
     shader.setMat3("modelInv", transformInv);
-
-    for (const auto &mesh : meshes) {
-        mesh.draw(shader);
-    }
 }
 
 void cosc::Model::applyTransform() {
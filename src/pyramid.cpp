@@ -0,0 +1,133 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#include "cosc/pyramid.hpp"
+#include "cosc/spectrum_analyser.hpp"
+#include <algorithm>
+#include <stdexcept>
+
+cosc::analysis::PyramidBuilder::PyramidBuilder(uint64_t numBlocks, size_t numBars)
+    : numBlocks(numBlocks)
+    , numBars(numBars) {
+    if (numBlocks == 0 || numBars == 0) {
+        return;
+    }
+    // level 0 would be the blocks themselves, so the pyramid starts at 2 blocks per row at the finest
+    while (rowsAt(baseShift) > 1 && rowsAt(baseShift) * numBars > MAX_PYRAMID_BARS) {
+        baseShift++;
+    }
+    for (auto shift = baseShift;; shift++) {
+        numLevels++;
+        if (rowsAt(shift) <= 1) {
+            break;
+        }
+    }
+    baseMax.resize(rowsAt(baseShift) * numBars);
+    baseSum.resize(rowsAt(baseShift) * numBars);
+}
+
+uint64_t cosc::analysis::PyramidBuilder::rowsAt(unsigned int shift) const {
+    return (numBlocks + (uint64_t { 1 } << shift) - 1) >> shift;
+}
+
+void cosc::analysis::PyramidBuilder::add(std::span<const uint16_t> bars) {
+    auto count = bars.size() / numBars;
+    for (size_t i = 0; i < count && added < numBlocks; i++, added++) {
+        auto row = (added >> baseShift) * numBars;
+        for (size_t j = 0; j < numBars; j++) {
+            auto bar = bars[(i * numBars) + j];
+            baseMax[row + j] = std::max(baseMax[row + j], bar);
+            baseSum[row + j] += bar;
+        }
+    }
+}
+
+void cosc::analysis::PyramidBuilder::init(MusicVisBars::Builder bars, MusicVisBarFormat format) const {
+    auto levels = bars.initPyramid(numLevels);
+    auto barBytes = bytesPerBar(format);
+    for (unsigned int i = 0; i < numLevels; i++) {
+        auto shift = baseShift + i;
+        auto size = rowsAt(shift) * numBars * barBytes;
+        levels[i].setBlocksPerRow(uint64_t { 1 } << shift);
+        levels[i].initMaxBars(size);
+        levels[i].initMeanBars(size);
+    }
+}
+
+void cosc::analysis::PyramidBuilder::write(MusicVisBars::Builder bars, MusicVisBarFormat format) const {
+    if (added != numBlocks) {
+        throw std::logic_error("Pyramid written before every block was added");
+    }
+    auto levels = bars.getPyramid();
+    auto max = baseMax;
+    auto sum = baseSum;
+    std::vector<uint16_t> mean;
+    for (unsigned int i = 0; i < numLevels; i++) {
+        auto shift = baseShift + i;
+        auto rows = rowsAt(shift);
+        if (i > 0) {
+            // each row of this level is the previous level's rows 2r and 2r + 1 (if it has one)
+            auto prevRows = rowsAt(shift - 1);
+            for (uint64_t r = 0; r < rows; r++) {
+                for (size_t j = 0; j < numBars; j++) {
+                    auto first = (2 * r * numBars) + j;
+                    auto second = 2 * r + 1 < prevRows ? first + numBars : first;
+                    max[(r * numBars) + j] = std::max(max[first], max[second]);
+                    sum[(r * numBars) + j] = sum[first] + (second != first ? sum[second] : 0);
+                }
+            }
+            max.resize(rows * numBars);
+            sum.resize(rows * numBars);
+        }
+
+        // the last row can be short, so it's divided by how many blocks it actually has
+        mean.resize(rows * numBars);
+        for (uint64_t r = 0; r < rows; r++) {
+            auto count = std::min(uint64_t { 1 } << shift, numBlocks - (r << shift));
+            for (size_t j = 0; j < numBars; j++) {
+                auto index = (r * numBars) + j;
+                mean[index] = static_cast<uint16_t>((sum[index] + (count / 2)) / count);
+            }
+        }
+
+        auto level = levels[i];
+        auto maxBars = level.getMaxBars();
+        auto meanBars = level.getMeanBars();
+        encodeBars(max, numBars, format, false, std::span(maxBars.begin(), maxBars.size()));
+        encodeBars(mean, numBars, format, false, std::span(meanBars.begin(), meanBars.size()));
+    }
+}
+
+cosc::SpectrumPyramid::SpectrumPyramid(MusicVisBars::Reader spectrum, size_t numBars)
+    : levels(spectrum.getPyramid())
+    , format(spectrum.getBarFormat())
+    , numBars(numBars) {
+}
+
+std::optional<size_t> cosc::SpectrumPyramid::levelFor(uint64_t blocks, size_t columns) const {
+    if (columns == 0) {
+        return std::nullopt;
+    }
+    auto blocksPerColumn = blocks / columns;
+    // levels go from finest to coarsest
+    std::optional<size_t> best;
+    for (size_t i = 0; i < levels.size() && levels[i].getBlocksPerRow() <= blocksPerColumn; i++) {
+        best = i;
+    }
+    return best;
+}
+
+size_t cosc::SpectrumPyramid::getRows(size_t level) const {
+    return levels[level].getMaxBars().size() / (numBars * cosc::analysis::bytesPerBar(format));
+}
+
+void cosc::SpectrumPyramid::read(
+    size_t level, size_t first, size_t count, std::span<uint16_t> max, std::span<uint16_t> mean) const {
+    auto rowBytes = numBars * cosc::analysis::bytesPerBar(format);
+    count = std::min(count, getRows(level) - std::min(first, getRows(level)));
+    auto maxBars = levels[level].getMaxBars();
+    auto meanBars = levels[level].getMeanBars();
+    cosc::analysis::decodeBars(
+        std::span(maxBars.begin() + (first * rowBytes), count * rowBytes), numBars, format, false, max);
+    cosc::analysis::decodeBars(
+        std::span(meanBars.begin() + (first * rowBytes), count * rowBytes), numBars, format, false, mean);
+}
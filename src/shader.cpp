@@ -64,6 +64,37 @@ cosc::Shader::Shader(const fs::path &vertexPath, const fs::path &fragmentPath) {
     glDeleteShader(fragmentShader);
 }
 
+cosc::Shader::Shader(const fs::path &computePath) {
+    SPDLOG_INFO("Loading compute shader: {}", computePath.string());
+
+    auto computeSource = cosc::util::readPathToString(computePath);
+    const char *computeShaderStr = computeSource.c_str();
+    int success;
+    char infoLog[512] = { 0 };
+
+    unsigned int computeShader = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(computeShader, 1, &computeShaderStr, nullptr);
+    glCompileShader(computeShader);
+    glGetShaderiv(computeShader, GL_COMPILE_STATUS, &success);
+    if (!success) {
+        glGetShaderInfoLog(computeShader, 512, nullptr, infoLog);
+        SPDLOG_ERROR("Failed to compile compute shader!\n{}", infoLog);
+        throw std::exception();
+    }
+
+    shaderProgram = glCreateProgram();
+    glAttachShader(shaderProgram, computeShader);
+    glLinkProgram(shaderProgram);
+    glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
+    if (!success) {
+        glGetProgramInfoLog(shaderProgram, 512, nullptr, infoLog);
+        SPDLOG_ERROR("Failed to link compute shader!\n{}", infoLog);
+        throw std::exception();
+    }
+
+    glDeleteShader(computeShader);
+}
+
 void cosc::Shader::use() {
     glUseProgram(shaderProgram);
 }
@@ -76,6 +107,10 @@ void cosc::Shader::setInt(const std::string &name, int value) {
     glUniform1i(glGetUniformLocation(shaderProgram, name.c_str()), value);
 }
 
+void cosc::Shader::setUint(const std::string &name, unsigned int value) {
+    glUniform1ui(glGetUniformLocation(shaderProgram, name.c_str()), value);
+}
+
 void cosc::Shader::setFloat(const std::string &name, float value) {
     glUniform1f(glGetUniformLocation(shaderProgram, name.c_str()), value);
 }
@@ -1,125 +1,511 @@
 // Copyright 2024 Matt Young.
 // SPDX-License-Identifier: ISC
 #include "cosc/song_data.hpp"
+#include "cosc/bundle.hpp"
 #include "cosc/lib/dr_flac.h"
+#include "cosc/spectrum_analyser.hpp"
 #include "cosc/util.hpp"
 #include "proto/MusicVis.capnp.h"
 #include <SDL2/SDL_audio.h>
+#include <SDL2/SDL_error.h>
 #include <algorithm>
+#include <array>
 #include <capnp/message.h>
 #include <capnp/serialize-packed.h>
+#include <capnp/serialize.h>
+#include <chrono>
 #include <cstring>
 #include <fcntl.h>
 #include <filesystem>
+#include <kj/io.h>
+#include <limits>
 #include <spdlog/spdlog.h>
+#include <string_view>
+#include <system_error>
+#include <thread>
+
+/// Fewest PCM frames worth decoding on a thread of their own (about 6 seconds at 44.1 kHz). Every thread has
+/// to seek to the start of its range first, which isn't free without a seek table.
+constexpr uint64_t MIN_DECODE_FRAMES = 1 << 18;
+
+/// PCM frames converted per SDL_AudioStreamPut(). SDL takes lengths as an int, and a whole song can be well
+/// over 2 GiB, so it's fed through in slices of at most 32 MiB (8 channels of s32).
+constexpr size_t CONVERT_FRAMES = 1 << 20;
+
+using FlacPtr = std::unique_ptr<drflac, decltype([](drflac *flac) { drflac_close(flac); })>;
+using AudioStreamPtr = std::unique_ptr<SDL_AudioStream, decltype([](SDL_AudioStream *stream) {
+    SDL_FreeAudioStream(stream);
+})>;
 
 namespace fs = std::filesystem;
 
-cosc::SongData::SongData(const fs::path &dataDir, const fs::path &songName) {
-    auto flacFile = dataDir / "songs" / songName / "audio.flac";
-    auto spectrumFile = dataDir / "songs" / songName / "spectrum.bin";
+/// Decodes every block of a spectrum that's a single message (i.e. not chunked) into one chunk
+static std::shared_ptr<const cosc::SpectrumChunk> decodeWholeSpectrum(MusicVisBars::Reader spectrum) {
+    auto numBars = cosc::analysis::getNumBars(spectrum);
+    auto energies = spectrum.getSpectralEnergyBlocks();
+    auto features = spectrum.getFeatures();
+    if (energies.size() == 0 || numBars == 0) {
+        throw std::runtime_error("Spectrum has no blocks");
+    }
 
-    if (!fs::exists(flacFile)) {
-        SPDLOG_ERROR("FLAC file does not exist! Tried: {}", flacFile.string());
-        throw std::exception();
+    auto decoded = std::make_shared<cosc::SpectrumChunk>();
+    decoded->count = energies.size();
+    decoded->bars.resize(decoded->count * numBars);
+    if (spectrum.hasBarMatrix()) {
+        auto matrix = spectrum.getBarMatrix();
+        auto format = spectrum.getBarFormat();
+        auto barBytes = cosc::analysis::bytesPerBar(format);
+        auto size = std::min<size_t>(matrix.size(), decoded->bars.size() * barBytes);
+        cosc::analysis::decodeBars(std::span(matrix.begin(), size), numBars, format, false, decoded->bars);
+    } else {
+        // process.py writes a list of lists, of 0..255 bars
+        auto blocks = spectrum.getBlocks();
+        for (unsigned int i = 0; i < blocks.size() && i < decoded->count; i++) {
+            auto block = blocks[i];
+            for (unsigned int j = 0; j < numBars && j < block.size(); j++) {
+                decoded->bars[(i * numBars) + j] = block[j] * 257;
+            }
+        }
     }
-    if (!fs::exists(spectrumFile)) {
-        SPDLOG_ERROR("Spectrum data does not exist! Tried: {}", spectrumFile.string());
-        throw std::exception();
+
+    // process.py doesn't compute features either, so those only have the spectral energy
+    decoded->features.resize(decoded->count);
+    for (unsigned int i = 0; i < decoded->count; i++) {
+        decoded->features[i] = i < features.size() ? cosc::analysis::readFeatures(features[i], energies[i])
+                                                   : cosc::BlockFeatures { .spectralEnergy = energies[i] };
     }
+    return decoded;
+}
+
+cosc::SongData::SongData(const fs::path &dataDir, const fs::path &songName, const AnalysisParams &params) {
+    auto songDir = dataDir / "songs" / songName;
+    auto bundleFile = songDir;
+    bundleFile += BUNDLE_EXTENSION;
+    auto flacFile = songDir / "audio.flac";
+    auto spectrumFile = songDir / "spectrum.bin";
 
-    SPDLOG_INFO("FLAC file: {}", flacFile.string());
-    SPDLOG_INFO("Spectrum file: {}", spectrumFile.string());
+    pcmCacheFile = songDir;
+    pcmCacheFile += ".pcm";
 
-    // load FLAC file with dr_flac
-    SPDLOG_INFO("Decoding FLAC file");
-    audio = drflac_open_file_and_read_pcm_frames_s32(
-        flacFile.c_str(), &channels, &sampleRate, &audioLen, nullptr);
-    if (audio == nullptr) {
-        // Failed to open and decode FLAC file.
-        throw std::runtime_error("Failed to decode FLAC file");
+    // a bundle has everything in one file, so if there is one, that's all we open
+    std::unique_ptr<SongBundle> bundle;
+    if (fs::exists(bundleFile)) {
+        SPDLOG_INFO("Song bundle: {}", bundleFile.string());
+        bundle = std::make_unique<SongBundle>(bundleFile);
+        // the bundle already has the audio's hash, and the FLAC is read straight out of its mapping
+        flacMapping = bundle->getMapping();
+        flac = bundle->getAudio();
+        audioHash = bundle->getAudioHash();
+    } else {
+        if (!fs::exists(flacFile)) {
+            SPDLOG_ERROR("FLAC file does not exist! Tried: {}", flacFile.string());
+            throw std::exception();
+        }
+
+        SPDLOG_INFO("FLAC file: {}", flacFile.string());
+        SPDLOG_INFO("Spectrum file: {}", spectrumFile.string());
+
+        // we need to hash the FLAC file's contents to validate the spectrum and the PCM cache anyway, so map
+        // it and have dr_flac read it from memory
+        flacMapping = std::make_shared<const cosc::util::MappedFile>(flacFile);
+        flac = flacMapping->getBytes();
+        audioHash = cosc::util::hashBytes(flac);
+    }
+    auto cacheKey = cosc::analysis::cacheKey(audioHash, params);
+
+    // Only read the FLAC header for now. Decoding takes seconds for a long song, and isn't needed at all if
+    // the spectrum and PCM cache are both up to date (see decodeAudio()).
+    {
+        FlacPtr header(drflac_open_memory(flac.data(), flac.size(), nullptr));
+        if (header == nullptr) {
+            throw std::runtime_error("Failed to open FLAC file");
+        }
+        channels = header->channels;
+        sampleRate = header->sampleRate;
+        audioLen = header->totalPCMFrameCount;
+    }
+    if (audioLen == 0) {
+        // the header doesn't say how long the song is, the only way to find out is to decode it
+        decodeAudio();
     }
     SPDLOG_DEBUG("Audio len: {} samples", audioLen);
+    // there's nothing to play or analyse, and mixAudio() needs at least one spectrum block to clamp to
+    if (audioLen == 0) {
+        SPDLOG_ERROR("FLAC file has no audio");
+        throw std::runtime_error("FLAC file has no audio");
+    }
+
+#if LIVE_ANALYSIS == 1
+    // bars will be computed on the fly from the audio, so no spectrum needed at all
+    SPDLOG_INFO("Using live analysis, skipping spectrum data");
+    decodeAudio();
+    live = std::make_unique<cosc::LiveAnalyser>(params, sampleRate);
+    return;
+#endif
+
+    // Chunked spectrums from the analyser have a cache key, and are paged in. Spectrums from process.py are
+    // one message with no cache key, so we have no way of telling if they're stale and trust them as-is.
+    if (bundle) {
+        // the pager shares the bundle's mapping, so the bundle itself doesn't need to stay open
+        pager = std::make_unique<cosc::SpectrumPager>(bundle->getMapping(), bundle->getSpectrum());
+        if (pager->getHeader().getCacheKey() != cacheKey) {
+            // bundles are read-only (and usually shared), so the new spectrum is only kept in memory
+            SPDLOG_WARN("Bundled spectrum was made with different analysis parameters, regenerating it");
+            pager.reset();
+            generateSpectrum({}, cacheKey, params);
+        }
+    } else {
+        auto fileKey = cosc::analysis::readCacheKey(spectrumFile);
+        if (fileKey != 0 && fileKey == cacheKey) {
+            pager = std::make_unique<cosc::SpectrumPager>(spectrumFile);
+        } else if (fileKey != 0 || !loadSpectrum(spectrumFile, cacheKey)) {
+            // missing or stale, so regenerate it from the audio
+            generateSpectrum(spectrumFile, cacheKey, params);
+        }
+    }
+
+    if (pager) {
+        spectrum = pager->getHeader();
+        events = pager->getEvents();
+        numBlocks = pager->getNumBlocks();
+        chunk = pager->get(0);
+    } else {
+        spectrum = message.getRoot<MusicVisBars>();
+        events = spectrum.getEvents();
+        chunk = decodeWholeSpectrum(spectrum);
+        numBlocks = chunk->count;
+    }
+    numBars = cosc::analysis::getNumBars(spectrum);
+    pyramid = SpectrumPyramid(spectrum, numBars);
+    // older spectrums don't overlap their blocks
+    hopSize = spectrum.getHopSize() != 0 ? spectrum.getHopSize() : spectrum.getBlockSize();
+    // mixAudio() divides by the hop size. Spectrums with no blocks have already been rejected above, by
+    // SpectrumPager or decodeWholeSpectrum().
+    if (hopSize == 0) {
+        SPDLOG_ERROR("Spectrum has a block size and hop size of 0");
+        throw std::runtime_error("Spectrum has no hop size");
+    }
+
+    SPDLOG_INFO("===== Decoded spectrum data =====");
+    SPDLOG_INFO(
+        "Num bars: {} ({} bytes each)", numBars, cosc::analysis::bytesPerBar(spectrum.getBarFormat()));
+    SPDLOG_INFO("Sample rate: {} Hz", spectrum.getSampleRate());
+    SPDLOG_INFO("Block size: {} samples", spectrum.getBlockSize());
+    SPDLOG_INFO("Hop size: {} samples", hopSize);
+    SPDLOG_INFO("Num blocks: {}", numBlocks);
+    SPDLOG_INFO("Num events: {}", events.getEvents().size());
+    SPDLOG_INFO("Tempo: {:.1f} BPM", events.getTempo());
+    SPDLOG_INFO("Pyramid levels: {}", spectrum.getPyramid().size());
+}
+
+void cosc::SongData::generateSpectrum(
+    const fs::path &spectrumFile, uint64_t cacheKey, const AnalysisParams &params) {
+    decodeAudio();
+    SPDLOG_INFO("Generating spectrum data");
+    auto begin = std::chrono::steady_clock::now();
+    if (!spectrumFile.empty()) {
+        // only I/O errors are caught, anything else is a bug in the analyser or the pager and shouldn't be
+        // hidden by quietly analysing the song again in memory
+        try {
+            cosc::analysis::writeChunkedSpectrum(spectrumFile, cacheKey,
+                cosc::analysis::memorySource(audio.data(), audioLen, channels), audioLen, channels,
+                sampleRate, params);
+            pager = std::make_unique<cosc::SpectrumPager>(spectrumFile);
+        } catch (const std::system_error &e) {
+            // e.g. read-only data dir, we can still carry on with the spectrum in memory
+            SPDLOG_WARN("Failed to cache spectrum data, keeping it in memory instead: {}", e.what());
+        }
+    }
+    if (!pager) {
+        auto bars = message.initRoot<MusicVisBars>();
+        cosc::analysis::analysePcm(audio.data(), audioLen, channels, sampleRate, params, bars);
+        bars.setCacheKey(cacheKey);
+    }
+    auto end = std::chrono::steady_clock::now();
+    SPDLOG_INFO("Generated spectrum data in {:.2f} ms",
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count() / NANO_TO_SEC * MS_TO_SEC);
+}
+
+bool cosc::SongData::loadSpectrum(const fs::path &spectrumFile, uint64_t cacheKey) {
+    if (!fs::exists(spectrumFile)) {
+        SPDLOG_WARN("Spectrum data does not exist, will generate it. Tried: {}", spectrumFile.string());
+        return false;
+    }
 
     // load spectrum data with capnp
     SPDLOG_DEBUG("Opening spectrum fd");
-    fd = open(spectrumFile.c_str(), O_RDONLY);
+    int fd = open(spectrumFile.c_str(), O_RDONLY);
     if (fd == -1) {
         SPDLOG_ERROR("Failed to open() spectrum data: {}", strerror(errno));
         throw std::exception();
     }
 
+    // Only single message spectrums get here, chunked ones are paged in by SpectrumPager instead.
+    // The whole spectrum gets copied into `message` below anyway, so we can let capnp traverse as much of
+    // the file as it likes here.
     SPDLOG_INFO("Decoding Cap'n Proto spectrum data");
-    // this is only a unique_ptr to keep it alive throughout the class, since capnp is a bit annoying and
-    // disabled copy&move.
-    // there's probably a better way to do this. too bad!
-    reader = std::make_unique<::capnp::PackedFdMessageReader>(fd);
-
-    // By default capnp implements a "traversal limit", which is a "security feature" designed to prevent DoS
-    // attacks caused by infinite traversal. Because we keep traversing the message in the mixAudio()
-    // callback, it gets mad at us and throws an exception.
-    // As noted in the documentation (https://capnproto.org/cxx.html#security-tips), we get around this by
-    // copying the message into a MallocMessageBuilder and then using that.
+    kj::FdInputStream rawInput((kj::AutoCloseFd(fd)));
+    kj::BufferedInputStreamWrapper input(rawInput);
+    ::capnp::ReaderOptions options;
+    options.traversalLimitInWords = std::numeric_limits<uint64_t>::max();
+    ::capnp::PackedMessageReader reader(input, options);
+    auto root = reader.getRoot<MusicVisBars>();
+
+    // spectrums written by process.py don't have a cache key, so we have no way of telling if they're stale.
+    // these are trusted as-is.
+    auto fileKey = root.getCacheKey();
+    if (fileKey == 0) {
+        SPDLOG_WARN("Spectrum data has no cache key, assuming it is up to date");
+    } else if (fileKey != cacheKey) {
+        SPDLOG_WARN("Spectrum data is stale (cache key {:016x}, expected {:016x}), will regenerate it",
+            fileKey, cacheKey);
+        return false;
+    }
+
+    // `reader` and the file stream it decodes from only live until we return, so the spectrum is copied into
+    // `message` to outlive them. The traversal limit (a "security feature" against DoS by infinite
+    // traversal, see https://capnproto.org/cxx.html#security-tips) doesn't come into it: it's already off for
+    // this reader, see above, and reads from a MallocMessageBuilder aren't limited at all.
     //
     // For something so "simple", according to capnp, this is EXTREMELY POORLY DOCUMENTED and took a full day
     // of research to understand!! I would NOT be using capnp again (really the only reason is that it has a
     // treesitter extension and flatbuffers doesn't...). Did you know capnp has NO API DOCS AT ALL? Yes,
     // actually, not even auto-generated API docs, there is literally ZERO documentation outside the linked
     // page. At least it's fast.
-    message.setRoot(reader->getRoot<MusicVisBars>());
-    spectrum = message.getRoot<MusicVisBars>();
+    message.setRoot(root);
+    return true;
+}
 
-    SPDLOG_INFO("===== Decoded spectrum data =====");
-    SPDLOG_INFO("Num bars: {}", spectrum.getNumBars());
-    SPDLOG_INFO("Sample rate: {} Hz", spectrum.getSampleRate());
-    SPDLOG_INFO("Block size: {} samples", spectrum.getBlockSize());
-    SPDLOG_INFO("Num blocks: {}", spectrum.getBlocks().size());
+void cosc::SongData::decodeAudio() {
+    if (!audio.empty()) {
+        return;
+    }
+    auto begin = std::chrono::steady_clock::now();
+    auto open = [&]() {
+        FlacPtr decoder(drflac_open_memory(flac.data(), flac.size(), nullptr));
+        if (decoder == nullptr) {
+            // Failed to open FLAC file.
+            throw std::runtime_error("Failed to decode FLAC file");
+        }
+        return decoder;
+    };
+
+    if (audioLen == 0) {
+        // the header doesn't say how long the song is, so we can't split it up and just have to read it all
+        SPDLOG_INFO("Decoding FLAC file");
+        auto decoder = open();
+        std::vector<drflac_int32> buffer(MIN_DECODE_FRAMES * channels);
+        drflac_uint64 read = 0;
+        while ((read = drflac_read_pcm_frames_s32(decoder.get(), MIN_DECODE_FRAMES, buffer.data())) != 0) {
+            audio.insert(
+                audio.end(), buffer.begin(), buffer.begin() + static_cast<ptrdiff_t>(read * channels));
+        }
+        audioLen = audio.size() / channels;
+    } else {
+        // FLAC frames decode independently, so split the song into one range per thread, each with its own
+        // decoder writing to its own part of `audio`. dr_flac finds where a range starts from the seek table
+        // if there is one, or by searching for the frame containing it if not.
+        auto numRanges = std::clamp<uint64_t>(audioLen / MIN_DECODE_FRAMES, 1,
+            std::max<uint64_t>(std::thread::hardware_concurrency(), 1));
+        SPDLOG_INFO("Decoding FLAC file in {} parts", numRanges);
+        audio.resize(audioLen * channels);
+        cosc::util::parallelFor(numRanges, [&](size_t beginRange, size_t endRange) {
+            for (auto range = beginRange; range < endRange; range++) {
+                auto first = audioLen * range / numRanges;
+                auto count = (audioLen * (range + 1) / numRanges) - first;
+                auto decoder = open();
+                if (!drflac_seek_to_pcm_frame(decoder.get(), first)
+                    || drflac_read_pcm_frames_s32(decoder.get(), count, audio.data() + (first * channels))
+                        != count) {
+                    throw std::runtime_error("Failed to decode FLAC file");
+                }
+            }
+        });
+    }
+    auto end = std::chrono::steady_clock::now();
+    SPDLOG_INFO("Decoded FLAC file in {:.2f} ms",
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count() / NANO_TO_SEC * MS_TO_SEC);
 }
 
-void cosc::SongData::setupAudio(SDL_AudioFormat wanted, SDL_AudioFormat obtained) {
-    audioStream = SDL_NewAudioStream(wanted, channels, sampleRate, obtained, channels, sampleRate);
-    // shove all the data through the stream
-    // seems as though we have to do x2 since there are two stereo channels? and audioLen is PCM frames?
-    SDL_AudioStreamPut(audioStream, audio, audioLen * sizeof(int32_t) * channels);
-    // ask it to resample for us while we're not under real-time
-    SDL_AudioStreamFlush(audioStream);
+/// Header of a PCM cache file, which is followed by the PCM itself. This is only ever read back on the
+/// machine that wrote it, so it's just written out in native byte order.
+struct PcmCacheHeader {
+    std::array<char, 8> magic;
+    /// hashBytes() of the FLAC file the PCM was decoded from
+    uint64_t audioHash;
+    /// Size of the PCM in bytes
+    uint64_t size;
+    uint32_t format;
+    uint32_t channels;
+    uint32_t sampleRate;
+    uint32_t reserved;
+};
+
+/// First 8 bytes of a PCM cache file
+constexpr std::string_view PCM_CACHE_MAGIC = "musicpcm";
+
+bool cosc::SongData::loadPcmCache(SDL_AudioFormat format) {
+    if (!fs::exists(pcmCacheFile)) {
+        return false;
+    }
+    try {
+        auto mapping = std::make_unique<cosc::util::MappedFile>(pcmCacheFile);
+        auto bytes = mapping->getBytes();
+        PcmCacheHeader header {};
+        if (bytes.size() < sizeof(header)) {
+            SPDLOG_WARN("PCM cache {} is truncated, will regenerate it", pcmCacheFile.string());
+            return false;
+        }
+        std::memcpy(&header, bytes.data(), sizeof(header));
+        if (std::string_view(header.magic.data(), header.magic.size()) != PCM_CACHE_MAGIC
+            || header.audioHash != audioHash || header.format != format || header.channels != channels
+            || header.sampleRate != sampleRate || header.size != bytes.size() - sizeof(header)
+            || header.size != audioLen * bytesPerFrame) {
+            // different song, or a different audio device
+            SPDLOG_INFO("PCM cache {} is stale, will regenerate it", pcmCacheFile.string());
+            return false;
+        }
+        pcmMapping = std::move(mapping);
+        pcm = bytes.subspan(sizeof(header));
+        SPDLOG_INFO("Using PCM cache {} ({} bytes)", pcmCacheFile.string(), pcm.size());
+        return true;
+    } catch (const std::exception &e) {
+        SPDLOG_WARN("Failed to map PCM cache {}: {}", pcmCacheFile.string(), e.what());
+        return false;
+    }
 }
 
-void cosc::SongData::mixAudio(uint8_t *stream, int len) {
-    // make sure 'len' isn't larger than the amount of data we can pull from the stream
-    auto maxInStream = SDL_AudioStreamAvailable(audioStream);
-    len = std::min(len, maxInStream);
+void cosc::SongData::writePcmCache(SDL_AudioFormat format) {
+    if (pcm.size() != audioLen * bytesPerFrame) {
+        // this would be cached for good, so rather decode it again next time
+        SPDLOG_WARN("Not writing PCM cache {}, it has {} bytes but should have {}", pcmCacheFile.string(),
+            pcm.size(), audioLen * bytesPerFrame);
+        return;
+    }
+    PcmCacheHeader header {};
+    std::copy(PCM_CACHE_MAGIC.begin(), PCM_CACHE_MAGIC.end(), header.magic.begin());
+    header.audioHash = audioHash;
+    header.size = pcm.size();
+    header.format = format;
+    header.channels = channels;
+    header.sampleRate = sampleRate;
+    try {
+        cosc::analysis::writeAtomically(
+            pcmCacheFile, [&](kj::BufferedOutputStreamWrapper &output, int /* fd */) {
+                output.write(&header, sizeof(header));
+                output.write(pcm.data(), pcm.size());
+            });
+    } catch (const std::exception &e) {
+        // e.g. read-only data dir, we'll just have to decode it again next time
+        SPDLOG_WARN("Failed to write PCM cache {}: {}", pcmCacheFile.string(), e.what());
+    }
+}
 
-    if (len == 0) {
-        // this should be OK as long as the song is actually finished - SDL requires us to fill the buffer
-        // even if the song is done
-        SPDLOG_TRACE("Writing zeroes to audio stream - song is probably finished?");
-        std::memset(stream, 0, len);
+void cosc::SongData::setupAudio(SDL_AudioFormat wanted, SDL_AudioFormat obtained) {
+    bytesPerFrame = (SDL_AUDIO_BITSIZE(obtained) / 8) * channels;
+#if PCM_CACHE == 1
+    if (loadPcmCache(obtained)) {
         return;
     }
+#endif
+
+    // convert the whole song to the device's format up front, while we're not under real-time, so that
+    // mixAudio() only has to copy
+    decodeAudio();
+    AudioStreamPtr stream(SDL_NewAudioStream(wanted, channels, sampleRate, obtained, channels, sampleRate));
+    if (stream == nullptr) {
+        SPDLOG_ERROR("Failed to create audio stream: {}", SDL_GetError());
+        throw std::runtime_error("Failed to create audio stream");
+    }
+    // the sample rate and channels stay the same, so every frame comes out as exactly one frame
+    auto expected = audioLen * bytesPerFrame;
+    pcmBuffer.clear();
+    pcmBuffer.reserve(expected);
+    // drain the stream after every slice, so that it never holds (or has to report) more than a slice either
+    auto drain = [&]() {
+        auto available = SDL_AudioStreamAvailable(stream.get());
+        auto offset = pcmBuffer.size();
+        pcmBuffer.resize(offset + available);
+        auto got = SDL_AudioStreamGet(stream.get(), pcmBuffer.data() + offset, available);
+        if (got < 0) {
+            SPDLOG_ERROR("Failed to get converted audio: {}", SDL_GetError());
+            throw std::runtime_error("Failed to get converted audio");
+        }
+        pcmBuffer.resize(offset + got);
+    };
+    for (size_t first = 0; first < audioLen; first += CONVERT_FRAMES) {
+        auto frames = std::min<size_t>(CONVERT_FRAMES, audioLen - first);
+        auto len = static_cast<int>(frames * channels * sizeof(int32_t));
+        if (SDL_AudioStreamPut(stream.get(), audio.data() + (first * channels), len) != 0) {
+            SPDLOG_ERROR("Failed to convert audio: {}", SDL_GetError());
+            throw std::runtime_error("Failed to convert audio");
+        }
+        drain();
+    }
+    if (SDL_AudioStreamFlush(stream.get()) != 0) {
+        SPDLOG_ERROR("Failed to flush audio stream: {}", SDL_GetError());
+        throw std::runtime_error("Failed to flush audio stream");
+    }
+    drain();
+    if (pcmBuffer.size() != expected) {
+        SPDLOG_ERROR("Converted audio is {} bytes, expected {}", pcmBuffer.size(), expected);
+        throw std::runtime_error("Converted audio is the wrong length");
+    }
+    pcm = pcmBuffer;
+
+#if PCM_CACHE == 1
+    writePcmCache(obtained);
+#endif
+#if LIVE_ANALYSIS == 0
+    // only the live analyser needs the source PCM from here on
+    audio = {};
+#endif
+}
+
+void cosc::SongData::mixAudio(uint8_t *stream, int len) {
+    // SDL requires us to fill the whole buffer, so once the song is finished, the rest is silence
+    auto available = pcm.size() - std::min(pcmPos, pcm.size());
+    auto bytes = std::min<size_t>(len, available);
 
     // send data to the sound driver - in mute we just copy zeroes
 #if MUTE == 0
-    SDL_AudioStreamGet(audioStream, stream, len);
+    std::memcpy(stream, pcm.data() + pcmPos, bytes);
+    std::memset(stream + bytes, 0, len - bytes);
 #else
     std::memset(stream, 0, len);
 #endif
+    pcmPos += bytes;
+
+    if (bytes == 0) {
+        SPDLOG_TRACE("Writing zeroes to audio stream - song is probably finished?");
+        return;
+    }
+    size_t frames = bytes / bytesPerFrame;
 
-    // we are given len in bytes, and since if we have sint16 samples, we just divide by the sizeof(sint16)
-    // this may also require a divide by channels?
-    audioPos += len / sizeof(int32_t) / channels;
-    // and the block position should then be that divided by the block size
-    blockPos = audioPos / spectrum.getBlockSize();
+#if LIVE_ANALYSIS == 1
+    // feed the live analyser the same audio we just sent to the driver. we take it from the decoded source
+    // PCM rather than `stream`, since that's in whatever format the driver asked for.
+    auto liveFrames = std::min<size_t>(frames, audioLen - std::min<size_t>(audioPos, audioLen));
+    live->push(audio.data() + (audioPos * channels), liveFrames, channels);
+    audioPos += frames;
+    SPDLOG_TRACE("Sample position: {}/{} ({:.2f}%)", audioPos, audioLen,
+        (static_cast<double>(audioPos) / static_cast<double>(audioLen)) * 100.f);
+#else
+    audioPos += frames;
+    // and the block position should then be that divided by the hop size. clamp it, since the last block can
+    // end before the audio does
+    auto block = std::min<size_t>(audioPos / hopSize, numBlocks - 1);
+    blockPos.store(block, std::memory_order_relaxed);
     SPDLOG_TRACE("Sample position: {}/{} ({:.2f}%), Block position: {}/{}", audioPos, audioLen,
-        (static_cast<double>(audioPos) / static_cast<double>(audioLen)) * 100.f, blockPos,
-        spectrum.getBlocks().size());
+        (static_cast<double>(audioPos) / static_cast<double>(audioLen)) * 100.f, block, numBlocks);
+#endif
 }
 
-cosc::SongData::~SongData() {
-    SPDLOG_DEBUG("Closing spectrum fd");
-    // manually delete the reader, so that when we close fd it won't get upset at us
-    reader.reset();
-    close(fd);
-    SDL_FreeAudioStream(audioStream);
-    drflac_free(audio, nullptr);
+size_t cosc::SongData::getNumBars() const {
+    if (live) {
+        return live->getParams().numBars;
+    }
+    return cosc::analysis::getNumBars(spectrum);
 }
+
+cosc::SongData::~SongData() = default;
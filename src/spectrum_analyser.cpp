@@ -0,0 +1,668 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#include "cosc/spectrum_analyser.hpp"
+#include "cosc/events.hpp"
+#include "cosc/lib/dr_flac.h"
+#include "cosc/pyramid.hpp"
+#include "cosc/util.hpp"
+#include "proto/MusicVis.capnp.h"
+#include <algorithm>
+#include <array>
+#include <capnp/message.h>
+#include <capnp/serialize-packed.h>
+#include <capnp/serialize.h>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <kj/exception.h>
+#include <kj/io.h>
+#include <limits>
+#include <memory>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+/// Divide to convert s32 PCM to a float in -1..1
+constexpr double S32_TO_FLOAT = 2147483648.0;
+
+/// Boundaries between the low, mid and high bands in Hz
+constexpr double LOW_MID_HZ = 250.0;
+constexpr double MID_HIGH_HZ = 4000.0;
+
+/// Modified Bessel function of the first kind, order zero, computed using its power series.
+/// Source: https://en.wikipedia.org/wiki/Bessel_function#Modified_Bessel_functions:_I%CE%B1,_K%CE%B1
+static double besselI0(double x) {
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 64; k++) {
+        term *= (x / (2.0 * k)) * (x / (2.0 * k));
+        sum += term;
+        if (term < sum * 1e-12) {
+            break;
+        }
+    }
+    return sum;
+}
+
+std::vector<float> cosc::analysis::kaiserWindow(size_t size, float beta) {
+    // same definition as numpy.kaiser
+    // Source: https://numpy.org/doc/stable/reference/generated/numpy.kaiser.html
+    std::vector<float> window(size);
+    auto denom = besselI0(beta);
+    for (size_t n = 0; n < size; n++) {
+        auto ratio = (2.0 * static_cast<double>(n) / static_cast<double>(size - 1)) - 1.0;
+        window[n] = static_cast<float>(besselI0(beta * std::sqrt(1.0 - ratio * ratio)) / denom);
+    }
+    return window;
+}
+
+cosc::SpectrumAnalyser::SpectrumAnalyser(const AnalysisParams &params, uint32_t sampleRate)
+    : params(params)
+    , fft(params.blockSize) {
+    if (params.numBars == 0) {
+        throw std::invalid_argument("Number of bars must be at least 1");
+    }
+
+    auto size = params.blockSize;
+    auto numBins = size / 2 + 1;
+
+    window = cosc::analysis::kaiserWindow(size, params.kaiserBeta);
+    fftBuf.resize(size);
+    psd.resize(numBins);
+    barPower.resize(params.numBars);
+    prevBarDb.resize(params.numBars);
+
+    binHz = static_cast<float>(sampleRate) / static_cast<float>(size);
+    midBin = std::min<size_t>(static_cast<size_t>(std::ceil(LOW_MID_HZ / binHz)), numBins);
+    highBin = std::min<size_t>(static_cast<size_t>(std::ceil(MID_HIGH_HZ / binHz)), numBins);
+
+    // Work out which FFT bins belong to each bar ahead of time. The old Python code did this by scanning
+    // every (frequency, dB) pair for every bar, on every block.
+    filterbank = Filterbank::get({ .scale = params.scale,
+        .sampleRate = sampleRate,
+        .fftSize = size,
+        .numBars = params.numBars,
+        .freqMin = params.freqMin,
+        .freqMax = params.freqMax });
+}
+
+cosc::BlockFeatures cosc::SpectrumAnalyser::processBlock(
+    std::span<const float> block, std::span<uint16_t> bars) {
+    auto size = params.blockSize;
+    auto len = std::min<size_t>(block.size(), size);
+    BlockFeatures features;
+
+    // apply window, zero pad any short block
+    double sumSquares = 0.0;
+    for (size_t i = 0; i < len; i++) {
+        fftBuf[i] = { block[i] * window[i], 0.f };
+        sumSquares += block[i] * block[i];
+    }
+    features.rms = len > 0 ? static_cast<float>(std::sqrt(sumSquares / static_cast<double>(len))) : 0.f;
+    std::fill(fftBuf.begin() + static_cast<ptrdiff_t>(len), fftBuf.end(), std::complex<float> { 0.f, 0.f });
+
+    fft.forward(fftBuf);
+
+    // compute one sided periodogram: |X|^2 / N, with every bin except DC and Nyquist doubled to account for
+    // the discarded negative frequencies
+    auto numBins = psd.size();
+    auto scale = 1.f / static_cast<float>(size);
+    float maxPsd = 0.f;
+    double sumPsd = 0.0;
+    double sumFreqPsd = 0.0;
+    for (size_t k = 0; k < numBins; k++) {
+        auto power = std::norm(fftBuf[k]) * scale;
+        if (k != 0 && k != numBins - 1) {
+            power *= 2.f;
+        }
+        psd[k] = power;
+        maxPsd = std::max(maxPsd, power);
+        sumPsd += power;
+        sumFreqPsd += static_cast<double>(k) * power;
+    }
+    features.centroid = sumPsd > 0.0 ? static_cast<float>(sumFreqPsd / sumPsd) * binHz : 0.f;
+
+    // band energies
+    auto sumRange = [&](size_t begin, size_t end) {
+        double sum = 0.0;
+        for (size_t k = begin; k < end; k++) {
+            sum += psd[k];
+        }
+        return static_cast<float>(sum);
+    };
+    features.lowEnergy = sumRange(0, midBin);
+    features.midEnergy = sumRange(midBin, highBin);
+    features.highEnergy = sumRange(highBin, numBins);
+
+    // bin into bars
+    filterbank->apply(psd, barPower);
+
+    // convert to dB, normalised to the loudest bin of the block (like process.py), and map MIN_VOL..MAX_VOL
+    // dB to 0..MAX_BAR_LEVEL. clamp so that silence maps to very quiet rather than -inf/NaN
+    auto ref = std::max(maxPsd, std::numeric_limits<float>::min());
+    for (size_t i = 0; i < barPower.size(); i++) {
+        auto db = 10.f * std::log10(std::max(barPower[i] / ref, 1e-20f));
+        auto val = cosc::util::mapRange(params.minVol, params.maxVol, 0.0, double { MAX_BAR_LEVEL }, db);
+        bars[i] = static_cast<uint16_t>(std::clamp(val, 0.0, double { MAX_BAR_LEVEL }));
+    }
+
+    // spectral flux, on absolute (not block normalised) bar power. floor it at minVol so that a bar coming
+    // out of digital silence doesn't count as a 200 dB jump
+    double flux = 0.0;
+    for (size_t i = 0; i < barPower.size(); i++) {
+        auto db = std::max(10.f * std::log10(std::max(barPower[i], 1e-20f)), params.minVol);
+        if (hasPrevious) {
+            flux += std::max(db - prevBarDb[i], 0.f);
+        }
+        prevBarDb[i] = db;
+    }
+    features.flux = static_cast<float>(flux / static_cast<double>(barPower.size()));
+    hasPrevious = true;
+
+    // spectral energy, same as process.py: sum(psd)^2
+    features.spectralEnergy = static_cast<float>(sumPsd * sumPsd);
+    return features;
+}
+
+cosc::analysis::PcmSource cosc::analysis::memorySource(
+    const int32_t *pcm, uint64_t frames, unsigned int channels) {
+    return [pcm, frames, channels, readPos = uint64_t { 0 }](int32_t *out, uint64_t want) mutable {
+        auto got = std::min(want, frames - readPos);
+        std::memcpy(out, pcm + (readPos * channels), got * channels * sizeof(int32_t));
+        readPos += got;
+        return got;
+    };
+}
+
+void cosc::analysis::mixToMono(
+    const int32_t *pcm, size_t frames, unsigned int channels, std::span<float> out) {
+    auto scale = 1.0 / (S32_TO_FLOAT * channels);
+    for (size_t i = 0; i < frames; i++) {
+        int64_t sum = 0;
+        for (unsigned int c = 0; c < channels; c++) {
+            sum += pcm[(i * channels) + c];
+        }
+        out[i] = static_cast<float>(static_cast<double>(sum) * scale);
+    }
+}
+
+uint64_t cosc::analysis::cacheKey(uint64_t flacHash, const AnalysisParams &params) {
+    auto hash = flacHash;
+    // hash each field individually, hashing the whole struct would also hash its padding
+    hash = cosc::util::hashValue(ANALYSIS_VERSION, hash);
+    hash = cosc::util::hashValue(params.blockSize, hash);
+    hash = cosc::util::hashValue(params.hopSize, hash);
+    hash = cosc::util::hashValue(params.numBars, hash);
+    hash = cosc::util::hashValue(params.freqMin, hash);
+    hash = cosc::util::hashValue(params.freqMax, hash);
+    hash = cosc::util::hashValue(params.scale, hash);
+    hash = cosc::util::hashValue(params.minVol, hash);
+    hash = cosc::util::hashValue(params.maxVol, hash);
+    hash = cosc::util::hashValue(params.kaiserBeta, hash);
+    hash = cosc::util::hashValue(params.barFormat, hash);
+    return hash;
+}
+
+bool cosc::analysis::parseAnalysisOption(int argc, char *argv[], int &i, AnalysisParams &params) {
+    std::string_view option = argv[i];
+    if (option != "--bars" && option != "--bar-format") {
+        return false;
+    }
+    if (i + 1 >= argc) {
+        throw std::invalid_argument(std::string(option) + " needs a value");
+    }
+    std::string_view value = argv[++i];
+
+    if (option == "--bars") {
+        uint32_t numBars = 0;
+        auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), numBars);
+        if (error != std::errc() || end != value.data() + value.size() || numBars == 0) {
+            throw std::invalid_argument("--bars must be a positive whole number");
+        }
+        params.numBars = numBars;
+    } else if (value == "u8") {
+        params.barFormat = MusicVisBarFormat::U8;
+    } else if (value == "u16") {
+        params.barFormat = MusicVisBarFormat::U16;
+    } else if (value == "f16") {
+        params.barFormat = MusicVisBarFormat::F16;
+    } else {
+        throw std::invalid_argument("--bar-format must be u8, u16 or f16");
+    }
+    return true;
+}
+
+void cosc::analysis::maxFeatures(BlockFeatures &max, const BlockFeatures &features) {
+    max.spectralEnergy = std::max(max.spectralEnergy, features.spectralEnergy);
+    max.rms = std::max(max.rms, features.rms);
+    max.centroid = std::max(max.centroid, features.centroid);
+    max.flux = std::max(max.flux, features.flux);
+    max.lowEnergy = std::max(max.lowEnergy, features.lowEnergy);
+    max.midEnergy = std::max(max.midEnergy, features.midEnergy);
+    max.highEnergy = std::max(max.highEnergy, features.highEnergy);
+}
+
+void cosc::analysis::writeFeatures(MusicVisFeatures::Builder builder, const BlockFeatures &features) {
+    builder.setRms(features.rms);
+    builder.setCentroid(features.centroid);
+    builder.setFlux(features.flux);
+    builder.setLowEnergy(features.lowEnergy);
+    builder.setMidEnergy(features.midEnergy);
+    builder.setHighEnergy(features.highEnergy);
+}
+
+cosc::BlockFeatures cosc::analysis::readFeatures(MusicVisFeatures::Reader reader, float spectralEnergy) {
+    return { .spectralEnergy = spectralEnergy,
+        .rms = reader.getRms(),
+        .centroid = reader.getCentroid(),
+        .flux = reader.getFlux(),
+        .lowEnergy = reader.getLowEnergy(),
+        .midEnergy = reader.getMidEnergy(),
+        .highEnergy = reader.getHighEnergy() };
+}
+
+void cosc::analysis::analyseStream(const PcmSource &source, uint64_t frames, unsigned int channels,
+    uint32_t sampleRate, const AnalysisParams &params, const ChunkSink &sink, bool parallel) {
+    auto blockSize = params.blockSize;
+    auto hopSize = params.hopSize;
+    auto numBars = params.numBars;
+    if (hopSize == 0 || hopSize > blockSize) {
+        throw std::invalid_argument("Hop size must be between 1 and the block size");
+    }
+    auto numBlocks = (frames + hopSize - 1) / hopSize;
+    SPDLOG_INFO("Analysing {} frames in {} blocks of {} samples with a hop of {}", frames, numBlocks,
+        blockSize, hopSize);
+
+    // mono holds the samples from monoStart onwards, just enough to cover the current chunk's blocks
+    std::vector<float> mono;
+    uint64_t monoStart = 0;
+    std::vector<int32_t> pcm;
+    auto chunkSize = chunkBlocks(params);
+    std::vector<uint16_t> chunkBars(static_cast<size_t>(chunkSize) * numBars);
+    std::vector<BlockFeatures> chunkFeatures(chunkSize);
+
+    for (uint64_t first = 0; first < numBlocks; first += chunkSize) {
+        auto count = std::min<uint64_t>(chunkSize, numBlocks - first);
+
+        // samples this chunk's blocks cover, plus the block before it (see below)
+        auto needStart = (first > 0 ? first - 1 : 0) * hopSize;
+        auto needEnd = std::min<uint64_t>(frames, ((first + count - 1) * hopSize) + blockSize);
+
+        // drop samples only the previous chunk needed (blocks overlap, so some of it carries over)
+        auto drop = std::min<uint64_t>(needStart - monoStart, mono.size());
+        mono.erase(mono.begin(), mono.begin() + static_cast<ptrdiff_t>(drop));
+        monoStart = needStart;
+
+        // read the rest
+        while (monoStart + mono.size() < needEnd) {
+            auto want = needEnd - (monoStart + mono.size());
+            pcm.resize(want * channels);
+            auto got = source(pcm.data(), want);
+            if (got == 0) {
+                SPDLOG_WARN(
+                    "Audio ended {} frames early, padding with silence", needEnd - monoStart - mono.size());
+                mono.resize(needEnd - monoStart, 0.f);
+                break;
+            }
+            auto old = mono.size();
+            mono.resize(old + got);
+            mixToMono(pcm.data(), got, channels, std::span(mono).subspan(old));
+        }
+
+        // Blocks are independent, so split them across threads. Each thread gets its own analyser (they have
+        // scratch buffers) and writes into disjoint parts of the chunk.
+        // The exception is spectral flux, which needs the previous block, so each thread first runs the block
+        // before its range through its analyser and throws the result away. This makes the output the same
+        // no matter how the blocks are split up.
+        auto analyseBlock = [&](SpectrumAnalyser &analyser, uint64_t index, std::span<uint16_t> blockBars) {
+            auto start = (index * hopSize) - monoStart;
+            auto len = std::min<uint64_t>(blockSize, mono.size() - start);
+            return analyser.processBlock(std::span(mono).subspan(start, len), blockBars);
+        };
+        auto analyseRange = [&](size_t begin, size_t end) {
+            SpectrumAnalyser analyser(params, sampleRate);
+            if (first + begin > 0) {
+                std::vector<uint16_t> discard(numBars);
+                analyseBlock(analyser, first + begin - 1, discard);
+            }
+            for (size_t i = begin; i < end; i++) {
+                auto blockBars = std::span(chunkBars).subspan(i * numBars, numBars);
+                chunkFeatures[i] = analyseBlock(analyser, first + i, blockBars);
+            }
+        };
+        if (parallel) {
+            cosc::util::parallelFor(count, analyseRange);
+        } else {
+            analyseRange(0, count);
+        }
+
+        sink(first, std::span(chunkBars).first(count * numBars), std::span(chunkFeatures).first(count));
+        SPDLOG_DEBUG("Analysed blocks {}/{}", first + count, numBlocks);
+    }
+}
+
+void cosc::analysis::analysePcm(const int32_t *pcm, uint64_t frames, unsigned int channels,
+    uint32_t sampleRate, const AnalysisParams &params, MusicVisBars::Builder bars) {
+    auto numBars = params.numBars;
+    auto numBlocks = (frames + params.hopSize - 1) / params.hopSize;
+
+    setBarCount(bars, params);
+    bars.setSampleRate(sampleRate);
+    bars.setBlockSize(params.blockSize);
+    bars.setHopSize(params.hopSize);
+    auto barBytes = bytesPerBar(params.barFormat);
+    auto matrix = bars.initBarMatrix(numBlocks * numBars * barBytes);
+    auto energies = bars.initSpectralEnergyBlocks(numBlocks);
+    auto features = bars.initFeatures(numBlocks);
+    BlockFeatures max;
+    std::vector<float> flux;
+    flux.reserve(numBlocks);
+    PyramidBuilder pyramid(numBlocks, numBars);
+    pyramid.init(bars, params.barFormat);
+
+    // the Cap'n Proto builder isn't thread safe, so it's filled in here rather than by the analysis threads
+    auto sink = [&](uint64_t first, std::span<const uint16_t> chunkBars,
+                    std::span<const BlockFeatures> chunkFeatures) {
+        encodeBars(chunkBars, numBars, params.barFormat, false,
+            std::span(matrix.begin() + (first * numBars * barBytes), chunkBars.size() * barBytes));
+        pyramid.add(chunkBars);
+        for (size_t i = 0; i < chunkFeatures.size(); i++) {
+            energies.set(first + i, chunkFeatures[i].spectralEnergy);
+            cosc::analysis::writeFeatures(features[first + i], chunkFeatures[i]);
+            cosc::analysis::maxFeatures(max, chunkFeatures[i]);
+            flux.push_back(chunkFeatures[i].flux);
+        }
+    };
+    analyseStream(memorySource(pcm, frames, channels), frames, channels, sampleRate, params, sink);
+
+    bars.setMaxSpectralEnergy(max.spectralEnergy);
+    cosc::analysis::writeFeatures(bars.initMaxFeatures(), max);
+    pyramid.write(bars, params.barFormat);
+    auto blocksPerSecond = static_cast<double>(sampleRate) / params.hopSize;
+    writeEvents(bars.initEvents(), detectEvents(flux, blocksPerSecond));
+}
+
+void cosc::analysis::writeAtomically(const fs::path &file,
+    const std::function<void(kj::BufferedOutputStreamWrapper &output, int fd)> &write) {
+    SPDLOG_INFO("Writing {}", file.string());
+    auto tmpFile = file;
+    tmpFile += ".tmp";
+
+    int fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        auto error = errno;
+        SPDLOG_ERROR("Failed to open() {} for writing: {}", tmpFile.string(), strerror(error));
+        throw std::system_error(error, std::generic_category(), "Failed to open file for writing");
+    }
+    try {
+        kj::FdOutputStream rawOutput(fd);
+        kj::BufferedOutputStreamWrapper output(rawOutput);
+        write(output, fd);
+        output.flush();
+    } catch (const kj::Exception &e) {
+        // kj reports failed writes (e.g. a full disk) with its own exceptions, make them a std::system_error
+        // like every other I/O failure here
+        close(fd);
+        fs::remove(tmpFile);
+        throw std::system_error(EIO, std::generic_category(), e.getDescription().cStr());
+    } catch (...) {
+        close(fd);
+        fs::remove(tmpFile);
+        throw;
+    }
+    close(fd);
+
+    fs::rename(tmpFile, file);
+}
+
+uint64_t cosc::analysis::readCacheKey(const fs::path &spectrumFile) {
+    int fd = open(spectrumFile.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    try {
+        // the header comes straight after the magic, and it's tiny, so this only reads the start of the file
+        kj::FdInputStream input((kj::AutoCloseFd(fd)));
+        std::array<char, SPECTRUM_MAGIC.size()> magic {};
+        if (input.tryRead(magic.data(), magic.size(), magic.size()) != magic.size()
+            || std::string_view(magic.data(), magic.size()) != SPECTRUM_MAGIC) {
+            // not chunked, so either from process.py or an older version of the analyser
+            return 0;
+        }
+        ::capnp::InputStreamMessageReader reader(input);
+        return reader.getRoot<MusicVisBars>().getCacheKey();
+    } catch (const std::exception &e) {
+        SPDLOG_WARN("Failed to read cache key from {}: {}", spectrumFile.string(), e.what());
+        return 0;
+    }
+}
+
+uint32_t cosc::analysis::chunkBlocks(const AnalysisParams &params) {
+    // always size for 16 bit bars, that's what they are in memory regardless of the format
+    auto blocks = MAX_CHUNK_BAR_BYTES / (std::max<size_t>(params.numBars, 1) * sizeof(uint16_t));
+    return static_cast<uint32_t>(std::clamp<size_t>(blocks, MIN_CHUNK_BLOCKS, CHUNK_BLOCKS));
+}
+
+size_t cosc::analysis::bytesPerBar(MusicVisBarFormat format) {
+    switch (format) {
+    case MusicVisBarFormat::U8:
+        return 1;
+    case MusicVisBarFormat::U16:
+    case MusicVisBarFormat::F16:
+        return 2;
+    }
+    throw std::runtime_error("Unknown bar format");
+}
+
+size_t cosc::analysis::getNumBars(MusicVisBars::Reader spectrum) {
+    return spectrum.getBarCount() != 0 ? spectrum.getBarCount() : spectrum.getNumBars();
+}
+
+/// Converts a level in 0..MAX_BAR_LEVEL to the code stored for it in `format`
+static uint16_t levelToCode(uint16_t level, MusicVisBarFormat format) {
+    switch (format) {
+    case MusicVisBarFormat::U8:
+        // the inverse of code * 257, rounding down so it's the same as the old 0..255 quantisation
+        return level / 257;
+    case MusicVisBarFormat::U16:
+        return level;
+    case MusicVisBarFormat::F16:
+        return cosc::util::floatToHalf(static_cast<float>(level) / cosc::MAX_BAR_LEVEL);
+    }
+    return 0;
+}
+
+/// Inverse of levelToCode()
+static uint16_t codeToLevel(uint16_t code, MusicVisBarFormat format) {
+    switch (format) {
+    case MusicVisBarFormat::U8:
+        return code * 257;
+    case MusicVisBarFormat::U16:
+        return code;
+    case MusicVisBarFormat::F16: {
+        auto value = std::clamp(cosc::util::halfToFloat(code), 0.f, 1.f);
+        return static_cast<uint16_t>(std::lround(value * cosc::MAX_BAR_LEVEL));
+    }
+    }
+    return 0;
+}
+
+void cosc::analysis::encodeBars(std::span<const uint16_t> bars, size_t numBars, MusicVisBarFormat format,
+    bool delta, std::span<uint8_t> out) {
+    auto barBytes = bytesPerBar(format);
+    // codes are delta coded rather than levels, so that decoding is exact. the first row has nothing before
+    // it, so it's stored as-is, and wraparound makes the rest reversible.
+    for (size_t i = 0; i < bars.size(); i++) {
+        auto code = levelToCode(bars[i], format);
+        uint16_t stored = code;
+        if (delta && i >= numBars) {
+            stored = code - levelToCode(bars[i - numBars], format);
+        }
+        // 16 bit codes are little endian, like everything else in Cap'n Proto
+        out[i * barBytes] = static_cast<uint8_t>(stored);
+        if (barBytes == 2) {
+            out[(i * barBytes) + 1] = static_cast<uint8_t>(stored >> 8);
+        }
+    }
+}
+
+void cosc::analysis::decodeBars(std::span<const uint8_t> in, size_t numBars, MusicVisBarFormat format,
+    bool delta, std::span<uint16_t> bars) {
+    auto barBytes = bytesPerBar(format);
+    auto count = in.size() / barBytes;
+    // decode the codes in place first, since deltas are between codes, then convert them to levels
+    for (size_t i = 0; i < count; i++) {
+        uint16_t code = in[i * barBytes];
+        if (barBytes == 2) {
+            code |= static_cast<uint16_t>(in[(i * barBytes) + 1] << 8);
+        }
+        if (delta && i >= numBars) {
+            code += bars[i - numBars];
+        }
+        bars[i] = barBytes == 1 ? static_cast<uint8_t>(code) : code;
+    }
+    for (size_t i = 0; i < count; i++) {
+        bars[i] = codeToLevel(bars[i], format);
+    }
+}
+
+void cosc::analysis::setBarCount(MusicVisBars::Builder bars, const AnalysisParams &params) {
+    // numBars is only a UInt8, so older readers see 0 bars rather than the wrong number of them
+    auto numBars = params.numBars;
+    bars.setNumBars(numBars <= std::numeric_limits<uint8_t>::max() ? static_cast<uint8_t>(numBars) : 0);
+    bars.setBarCount(numBars);
+    bars.setBarFormat(params.barFormat);
+}
+
+void cosc::analysis::writeChunkedSpectrum(const fs::path &spectrumFile, uint64_t cacheKey,
+    const PcmSource &source, uint64_t frames, unsigned int channels, uint32_t sampleRate,
+    const AnalysisParams &params, bool parallel) {
+    auto numBlocks = (frames + params.hopSize - 1) / params.hopSize;
+    auto chunkSize = chunkBlocks(params);
+    auto numChunks = (numBlocks + chunkSize - 1) / chunkSize;
+    auto barBytes = bytesPerBar(params.barFormat);
+
+    writeAtomically(spectrumFile, [&](kj::BufferedOutputStreamWrapper &output, int fd) {
+        // The header comes first, but its chunk offsets, maxes and pyramid aren't known until everything else
+        // has been written. So it's written unpacked, where the size doesn't depend on the values, and then
+        // rewritten in place at the end. Everything in it has to be allocated now for the size to stay the
+        // same.
+        ::capnp::MallocMessageBuilder header;
+        auto bars = header.initRoot<MusicVisBars>();
+        setBarCount(bars, params);
+        bars.setSampleRate(sampleRate);
+        bars.setBlockSize(params.blockSize);
+        bars.setHopSize(params.hopSize);
+        bars.setCacheKey(cacheKey);
+        bars.setChunkSize(chunkSize);
+        bars.setNumBlocks(numBlocks);
+        bars.initMaxFeatures();
+        auto offsets = bars.initChunkOffsets(numChunks + 1);
+        PyramidBuilder pyramid(numBlocks, params.numBars);
+        pyramid.init(bars, params.barFormat);
+        output.write(SPECTRUM_MAGIC.data(), SPECTRUM_MAGIC.size());
+        ::capnp::writeMessage(output, header);
+        uint64_t offset
+            = SPECTRUM_MAGIC.size() + (::capnp::computeSerializedSizeInWords(header) * sizeof(::capnp::word));
+
+        // followed by the chunks, written as soon as each is done. Event detection needs the flux of the
+        // whole song, so that's kept too (only 4 bytes per block)
+        std::vector<float> flux;
+        flux.reserve(numBlocks);
+        BlockFeatures max;
+        size_t chunkIndex = 0;
+        auto sink = [&](uint64_t first, std::span<const uint16_t> chunkBars,
+                        std::span<const BlockFeatures> chunkFeatures) {
+            ::capnp::MallocMessageBuilder message;
+            auto chunk = message.initRoot<MusicVisChunk>();
+            auto deltas = chunk.initBarDeltas(chunkBars.size() * barBytes);
+            encodeBars(chunkBars, params.numBars, params.barFormat, true,
+                std::span(deltas.begin(), deltas.size()));
+            pyramid.add(chunkBars);
+            auto energies = chunk.initSpectralEnergyBlocks(chunkFeatures.size());
+            auto features = chunk.initFeatures(chunkFeatures.size());
+            BlockFeatures chunkMax;
+            for (size_t i = 0; i < chunkFeatures.size(); i++) {
+                energies.set(i, chunkFeatures[i].spectralEnergy);
+                cosc::analysis::writeFeatures(features[i], chunkFeatures[i]);
+                cosc::analysis::maxFeatures(chunkMax, chunkFeatures[i]);
+                flux.push_back(chunkFeatures[i].flux);
+            }
+            chunk.setMaxSpectralEnergy(chunkMax.spectralEnergy);
+            cosc::analysis::writeFeatures(chunk.initMaxFeatures(), chunkMax);
+            cosc::analysis::maxFeatures(max, chunkMax);
+
+            // we can't know how big a packed message is until it's been packed, so pack it into memory first
+            kj::VectorOutputStream packed;
+            ::capnp::writePackedMessage(packed, message);
+            auto packedBytes = packed.getArray();
+            output.write(packedBytes.begin(), packedBytes.size());
+            offsets.set(chunkIndex++, offset);
+            offset += packedBytes.size();
+        };
+        analyseStream(source, frames, channels, sampleRate, params, sink, parallel);
+        offsets.set(numChunks, offset);
+
+        // then the events
+        ::capnp::MallocMessageBuilder message;
+        auto blocksPerSecond = static_cast<double>(sampleRate) / params.hopSize;
+        writeEvents(message.initRoot<MusicVisEvents>(), detectEvents(flux, blocksPerSecond));
+        ::capnp::writePackedMessage(output, message);
+
+        // and finally go back and fill in the header
+        bars.setMaxSpectralEnergy(max.spectralEnergy);
+        cosc::analysis::writeFeatures(bars.getMaxFeatures(), max);
+        pyramid.write(bars, params.barFormat);
+        output.flush();
+        auto headerWords = ::capnp::messageToFlatArray(header);
+        auto headerBytes = headerWords.asBytes();
+        auto written = pwrite(fd, headerBytes.begin(), headerBytes.size(), SPECTRUM_MAGIC.size());
+        if (written != static_cast<ssize_t>(headerBytes.size())) {
+            // a short write without an error means the disk is full
+            auto error = written == -1 ? errno : ENOSPC;
+            SPDLOG_ERROR("Failed to rewrite spectrum header: {}", strerror(error));
+            throw std::system_error(error, std::generic_category(), "Failed to rewrite spectrum header");
+        }
+        SPDLOG_DEBUG("Wrote {} chunks, {} bytes of spectrum", numChunks, offset);
+    });
+}
+
+bool cosc::analysis::analyseFile(const fs::path &flacFile, const fs::path &spectrumFile,
+    const AnalysisParams &params, bool parallel) {
+    if (!fs::exists(flacFile)) {
+        SPDLOG_ERROR("FLAC file does not exist! Tried: {}", flacFile.string());
+        throw std::runtime_error("FLAC file does not exist");
+    }
+
+    SPDLOG_INFO("Hashing FLAC file {}", flacFile.string());
+    auto key = cacheKey(cosc::util::hashFile(flacFile), params);
+    if (readCacheKey(spectrumFile) == key) {
+        SPDLOG_INFO("Spectrum {} is up to date", spectrumFile.string());
+        return false;
+    }
+
+    // decode incrementally rather than all at once, so that memory use doesn't grow with the song length
+    SPDLOG_INFO("Streaming FLAC file {}", flacFile.string());
+    std::unique_ptr<drflac, decltype([](drflac *flac) { drflac_close(flac); })> flac(
+        drflac_open_file(flacFile.c_str(), nullptr));
+    if (flac == nullptr) {
+        throw std::runtime_error("Failed to open FLAC file");
+    }
+    // we need to know how many blocks there are going to be up front, to size the header
+    auto frames = flac->totalPCMFrameCount;
+    if (frames == 0) {
+        throw std::runtime_error("FLAC file does not specify its length");
+    }
+    auto source = [&](int32_t *out, uint64_t want) {
+        return drflac_read_pcm_frames_s32(flac.get(), want, out);
+    };
+    writeChunkedSpectrum(
+        spectrumFile, key, source, frames, flac->channels, flac->sampleRate, params, parallel);
+    return true;
+}
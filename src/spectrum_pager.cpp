@@ -0,0 +1,178 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#include "cosc/spectrum_pager.hpp"
+#include "cosc/spectrum_analyser.hpp"
+#include "proto/MusicVis.capnp.h"
+#include <algorithm>
+#include <capnp/serialize-packed.h>
+#include <capnp/serialize.h>
+#include <kj/io.h>
+#include <limits>
+#include <optional>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <string_view>
+
+/// Number of chunks after the current one that the pager thread keeps decoded
+constexpr size_t CHUNKS_AHEAD = 2;
+
+/// Number of chunks before the current one that are kept around, so seeking back a little is free
+constexpr size_t CHUNKS_BEHIND = 1;
+
+cosc::SpectrumPager::SpectrumPager(const fs::path &spectrumFile)
+    : SpectrumPager(std::make_shared<const cosc::util::MappedFile>(spectrumFile)) {
+}
+
+cosc::SpectrumPager::SpectrumPager(
+    std::shared_ptr<const cosc::util::MappedFile> file, std::span<const uint8_t> spectrum)
+    : mapping(std::move(file))
+    , bytes(spectrum.empty() ? mapping->getBytes() : spectrum) {
+    if (reinterpret_cast<uintptr_t>(bytes.data()) % sizeof(::capnp::word) != 0) {
+        throw std::runtime_error("Spectrum is not word aligned");
+    }
+    auto magicSize = cosc::analysis::SPECTRUM_MAGIC.size();
+    if (bytes.size() < magicSize
+        || std::string_view(reinterpret_cast<const char *>(bytes.data()), magicSize)
+            != cosc::analysis::SPECTRUM_MAGIC) {
+        throw std::runtime_error("Not a chunked spectrum file");
+    }
+
+    // The header is unpacked, so it can be read in place. The spectrum is word aligned (mmap() returns page
+    // aligned memory, and bundles align their sections) and the magic is one word long, so the header is word
+    // aligned like FlatArrayMessageReader needs. We keep reading the header for the whole song, so turn off
+    // the traversal limit (see SongData::loadSpectrum()).
+    auto rest = bytes.subspan(magicSize);
+    kj::ArrayPtr<const ::capnp::word> words(
+        reinterpret_cast<const ::capnp::word *>(rest.data()), rest.size() / sizeof(::capnp::word));
+    ::capnp::ReaderOptions options;
+    options.traversalLimitInWords = std::numeric_limits<uint64_t>::max();
+    headerReader = std::make_unique<::capnp::FlatArrayMessageReader>(words, options);
+    header = headerReader->getRoot<MusicVisBars>();
+
+    numBlocks = header.getNumBlocks();
+    chunkSize = header.getChunkSize();
+    numBars = cosc::analysis::getNumBars(header);
+    barFormat = header.getBarFormat();
+    if (numBlocks == 0 || chunkSize == 0 || numBars == 0) {
+        throw std::runtime_error("Spectrum has no blocks");
+    }
+    numChunks = (numBlocks + chunkSize - 1) / chunkSize;
+
+    // check the index up front, so decode() can trust it
+    auto chunkOffsets = header.getChunkOffsets();
+    if (chunkOffsets.size() != numChunks + 1) {
+        throw std::runtime_error("Spectrum chunk index does not match the number of chunks");
+    }
+    for (auto offset : chunkOffsets) {
+        if (offset > bytes.size() || (!offsets.empty() && offset < offsets.back())) {
+            throw std::runtime_error("Spectrum chunk index is corrupt");
+        }
+        offsets.push_back(offset);
+    }
+
+    // the events are after the last chunk
+    auto eventBytes = bytes.subspan(offsets.back());
+    kj::ArrayInputStream eventInput(kj::ArrayPtr<const kj::byte>(eventBytes.data(), eventBytes.size()));
+    ::capnp::PackedMessageReader eventReader(eventInput);
+    eventsMessage.setRoot(eventReader.getRoot<MusicVisEvents>());
+    events = eventsMessage.getRoot<MusicVisEvents>().asReader();
+
+    SPDLOG_INFO("Paging {} blocks in {} chunks of {}", numBlocks, numChunks, chunkSize);
+    thread = std::thread(&SpectrumPager::run, this);
+}
+
+cosc::SpectrumPager::~SpectrumPager() {
+    {
+        std::scoped_lock lock(mutex);
+        stop = true;
+    }
+    wake.notify_one();
+    thread.join();
+}
+
+std::shared_ptr<const cosc::SpectrumChunk> cosc::SpectrumPager::get(uint64_t block) {
+    auto index = std::min(block, numBlocks - 1) / chunkSize;
+    {
+        std::scoped_lock lock(mutex);
+        if (wanted != index) {
+            wanted = index;
+            wake.notify_one();
+        }
+        auto it = resident.find(index);
+        if (it != resident.end()) {
+            return it->second;
+        }
+    }
+
+    // we've seeked outside the window, so there's nothing to do but decode it now. the pager thread is only
+    // woken up for the chunks after it, so this is the only chunk we wait for.
+    SPDLOG_DEBUG("Spectrum chunk {} is not resident, decoding it now", index);
+    auto chunk = decode(index);
+    std::scoped_lock lock(mutex);
+    return resident.try_emplace(index, std::move(chunk)).first->second;
+}
+
+std::shared_ptr<const cosc::SpectrumChunk> cosc::SpectrumPager::decode(size_t index) const {
+    auto begin = offsets[index];
+    auto end = offsets[index + 1];
+    kj::ArrayInputStream input(kj::ArrayPtr<const kj::byte>(bytes.data() + begin, end - begin));
+    ::capnp::PackedMessageReader reader(input);
+    auto chunk = reader.getRoot<MusicVisChunk>();
+
+    auto decoded = std::make_shared<SpectrumChunk>();
+    decoded->first = index * chunkSize;
+    decoded->count = std::min(chunkSize, numBlocks - decoded->first);
+    auto deltas = chunk.getBarDeltas();
+    auto energies = chunk.getSpectralEnergyBlocks();
+    auto features = chunk.getFeatures();
+    if (deltas.size() != decoded->count * numBars * cosc::analysis::bytesPerBar(barFormat)
+        || energies.size() != decoded->count
+        || features.size() != decoded->count) {
+        throw std::runtime_error("Spectrum chunk does not match the spectrum header");
+    }
+
+    decoded->bars.resize(decoded->count * numBars);
+    cosc::analysis::decodeBars(
+        std::span(deltas.begin(), deltas.size()), numBars, barFormat, true, decoded->bars);
+    decoded->features.resize(decoded->count);
+    for (unsigned int i = 0; i < decoded->count; i++) {
+        decoded->features[i] = cosc::analysis::readFeatures(features[i], energies[i]);
+    }
+    return decoded;
+}
+
+void cosc::SpectrumPager::run() {
+    std::unique_lock lock(mutex);
+    while (!stop) {
+        // drop everything outside the window, then decode the nearest chunk in it that's missing
+        auto first = wanted - std::min(wanted, CHUNKS_BEHIND);
+        auto last = std::min(wanted + CHUNKS_AHEAD, numChunks - 1);
+        std::erase_if(resident, [&](const auto &entry) { return entry.first < first || entry.first > last; });
+
+        std::optional<size_t> missing;
+        for (auto i = wanted; i <= last; i++) {
+            if (!resident.contains(i)) {
+                missing = i;
+                break;
+            }
+        }
+        if (!missing) {
+            wake.wait(lock);
+            continue;
+        }
+
+        // decode without holding the lock, so get() isn't blocked in the meantime
+        lock.unlock();
+        std::shared_ptr<const SpectrumChunk> chunk;
+        try {
+            chunk = decode(*missing);
+        } catch (const std::exception &e) {
+            // get() will throw the same error if the chunk is ever actually needed
+            SPDLOG_ERROR("Failed to prefetch spectrum chunk {}, giving up on prefetching: {}", *missing,
+                e.what());
+            return;
+        }
+        lock.lock();
+        resident.try_emplace(*missing, std::move(chunk));
+    }
+}
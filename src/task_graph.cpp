@@ -0,0 +1,148 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#include "cosc/task_graph.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <numeric>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+#include <thread>
+
+size_t cosc::TaskGraph::add(
+    std::string name, Thread thread, std::function<void()> func, const std::vector<size_t> &dependencies) {
+    auto id = tasks.size();
+    for (auto dependency : dependencies) {
+        if (dependency >= id) {
+            throw std::invalid_argument("Tasks can only depend on tasks added before them");
+        }
+        tasks[dependency].dependents.push_back(id);
+    }
+    tasks.push_back({ .name = std::move(name),
+        .thread = thread,
+        .func = std::move(func),
+        .dependents = {},
+        .waitingOn = dependencies.size(),
+        .begin = {},
+        .end = {} });
+    return id;
+}
+
+void cosc::TaskGraph::run() {
+    std::mutex mutex;
+    std::condition_variable finished;
+    /// Main thread tasks whose dependencies are done
+    std::deque<size_t> mainReady;
+    std::vector<std::thread> workers;
+    size_t running = 0;
+    std::exception_ptr error;
+
+    // both of these are only called with the mutex held
+    std::function<void(size_t)> start;
+    auto finish = [&](size_t id) {
+        tasks[id].end = std::chrono::steady_clock::now();
+        for (auto dependent : tasks[id].dependents) {
+            if (--tasks[dependent].waitingOn == 0) {
+                start(dependent);
+            }
+        }
+    };
+    start = [&](size_t id) {
+        if (error) {
+            return;
+        }
+        if (tasks[id].thread == Thread::MAIN) {
+            mainReady.push_back(id);
+            return;
+        }
+        running++;
+        tasks[id].begin = std::chrono::steady_clock::now();
+        workers.emplace_back([&, id]() {
+            // an exception escaping a std::thread calls std::terminate(), so it's handed back to run()
+            std::exception_ptr taskError;
+            try {
+                tasks[id].func();
+            } catch (...) {
+                taskError = std::current_exception();
+            }
+            std::lock_guard lock(mutex);
+            if (taskError) {
+                error = error ? error : taskError;
+            } else {
+                finish(id);
+            }
+            running--;
+            finished.notify_all();
+        });
+    };
+
+    runBegin = std::chrono::steady_clock::now();
+    std::unique_lock lock(mutex);
+    for (size_t id = 0; id < tasks.size(); id++) {
+        if (tasks[id].waitingOn == 0) {
+            start(id);
+        }
+    }
+    while (true) {
+        finished.wait(lock, [&]() { return !mainReady.empty() || running == 0; });
+        if (error) {
+            // don't start anything else, just wait for the running workers
+            mainReady.clear();
+            if (running == 0) {
+                break;
+            }
+            continue;
+        }
+        if (mainReady.empty()) {
+            // nothing is running or ready, so everything is done
+            break;
+        }
+
+        auto id = mainReady.front();
+        mainReady.pop_front();
+        tasks[id].begin = std::chrono::steady_clock::now();
+        lock.unlock();
+        std::exception_ptr taskError;
+        try {
+            tasks[id].func();
+        } catch (...) {
+            taskError = std::current_exception();
+        }
+        lock.lock();
+        if (taskError) {
+            error = error ? error : taskError;
+        } else {
+            finish(id);
+        }
+    }
+    lock.unlock();
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    runEnd = std::chrono::steady_clock::now();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void cosc::TaskGraph::logTimeline() const {
+    auto ms = [this](std::chrono::steady_clock::time_point time) {
+        return std::chrono::duration<double, std::milli>(time - runBegin).count();
+    };
+
+    std::vector<size_t> order(tasks.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(),
+        [this](size_t a, size_t b) { return tasks[a].begin < tasks[b].begin; });
+
+    SPDLOG_INFO("===== Startup timeline =====");
+    for (auto id : order) {
+        const auto &task = tasks[id];
+        SPDLOG_INFO("{:<16} {:>8.1f} ms -> {:>8.1f} ms ({:>7.1f} ms, {} thread)", task.name, ms(task.begin),
+            ms(task.end), ms(task.end) - ms(task.begin), task.thread == Thread::MAIN ? "main" : "worker");
+    }
+    SPDLOG_INFO("Startup took {:.1f} ms", ms(runEnd));
+}
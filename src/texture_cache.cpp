@@ -0,0 +1,330 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#include "cosc/texture_cache.hpp"
+#include "cosc/lib/stb_image.h"
+#include "cosc/spectrum_analyser.hpp"
+#include "glad/gl.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+
+/// Header of a texture cache file. Each level follows as a TextureCacheLevel, then all the levels' data in
+/// order. Like the mesh cache, it's native byte order, and only valid for the driver that compressed it (or
+/// one that supports the same format).
+struct TextureCacheHeader {
+    std::array<char, 8> magic;
+    /// hashBytes() of the image file, mixed with whether it was flipped
+    uint64_t sourceHash;
+    /// GL internal format of the levels: a compressed format, or GL_RGBA8
+    uint32_t format;
+    uint32_t compressed;
+    uint32_t numLevels;
+    uint32_t reserved;
+};
+
+struct TextureCacheLevel {
+    uint32_t width;
+    uint32_t height;
+    uint64_t size;
+};
+
+/// First 8 bytes of a texture cache file
+constexpr std::string_view TEXTURE_CACHE_MAGIC = "musictex";
+
+/// Bytes per pixel of decoded images, which are always RGBA8
+constexpr size_t TEXTURE_CHANNELS = 4;
+
+/// Halves an RGBA8 image with a box filter. Odd rows and columns are folded into the last pixel.
+static std::vector<uint8_t> downsample(std::span<const uint8_t> image, uint32_t width, uint32_t height) {
+    auto newWidth = std::max(width / 2, 1U);
+    auto newHeight = std::max(height / 2, 1U);
+    std::vector<uint8_t> out(static_cast<size_t>(newWidth) * newHeight * TEXTURE_CHANNELS);
+    for (uint32_t y = 0; y < newHeight; y++) {
+        auto y0 = std::min(y * 2, height - 1);
+        auto y1 = std::min((y * 2) + 1, height - 1);
+        for (uint32_t x = 0; x < newWidth; x++) {
+            auto x0 = std::min(x * 2, width - 1);
+            auto x1 = std::min((x * 2) + 1, width - 1);
+            for (size_t c = 0; c < TEXTURE_CHANNELS; c++) {
+                auto at = [&](uint32_t px, uint32_t py) {
+                    auto index = ((static_cast<size_t>(py) * width) + px) * TEXTURE_CHANNELS;
+                    return static_cast<uint32_t>(image[index + c]);
+                };
+                auto sum = at(x0, y0) + at(x1, y0) + at(x0, y1) + at(x1, y1);
+                out[(((static_cast<size_t>(y) * newWidth) + x) * TEXTURE_CHANNELS) + c]
+                    = static_cast<uint8_t>((sum + 2) / 4);
+            }
+        }
+    }
+    return out;
+}
+
+/// Returns true if the driver can upload textures in the compressed `format`. Only call it on the GL thread.
+static bool isFormatSupported(uint32_t format) {
+    // the list can't change for the life of the context, so only ask for it once
+    static const std::vector<GLint> formats = []() {
+        GLint count = 0;
+        glGetIntegerv(GL_NUM_COMPRESSED_TEXTURE_FORMATS, &count);
+        std::vector<GLint> list(std::max(count, 0));
+        if (!list.empty()) {
+            glGetIntegerv(GL_COMPRESSED_TEXTURE_FORMATS, list.data());
+        }
+        return list;
+    }();
+    return std::find(formats.begin(), formats.end(), static_cast<GLint>(format)) != formats.end();
+}
+
+cosc::TextureImage::TextureImage(const fs::path &path, bool flipVertically)
+    : path(path)
+    , flipVertically(flipVertically) {
+    // the image file is only hashed here, it's only decoded if the texture cache is missing or stale
+    auto source = cosc::vfs::read(path);
+    sourceHash = cosc::util::hashValue(flipVertically, cosc::util::hashBytes(source.getBytes()));
+    cacheFile = path;
+    cacheFile.replace_extension(TEXTURE_CACHE_EXTENSION);
+#if TEXTURE_CACHE == 1
+    if (loadCache()) {
+        return;
+    }
+#endif
+    decode(source.getBytes());
+}
+
+void cosc::TextureImage::ensureSupported() {
+    if (!compressed || isFormatSupported(format)) {
+        return;
+    }
+    // i.e. the cache was written on a different GPU or driver. there's no converting between compressed
+    // formats, so go back to the image, and let upload() compress it for this driver and rewrite the cache.
+    SPDLOG_WARN("Driver can't use format 0x{:x} from texture cache {}, decoding {} instead", format,
+        cacheFile.string(), path.string());
+    levels.clear();
+    cache.reset();
+    compressed = false;
+    cached = false;
+    format = 0;
+    auto source = cosc::vfs::read(path);
+    decode(source.getBytes());
+}
+
+void cosc::TextureImage::decode(std::span<const uint8_t> png) {
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    // always decode to RGBA, since that's what we tell GL the data is
+    auto *data = stbi_load_from_memory(png.data(), static_cast<int>(png.size()), &width, &height, &channels,
+        static_cast<int>(TEXTURE_CHANNELS));
+    if (data == nullptr) {
+        SPDLOG_ERROR("Failed to decode image {}: {}", path.string(), stbi_failure_reason());
+        throw std::runtime_error("Failed to decode image!");
+    }
+    SPDLOG_DEBUG("Decoded a {}x{} image with {} channels from {}", width, height, channels, path.string());
+    auto rowBytes = static_cast<size_t>(width) * TEXTURE_CHANNELS;
+    auto &base = decoded.emplace_back(data, data + (rowBytes * height));
+    stbi_image_free(data);
+    if (flipVertically) {
+        // done here rather than with stbi_set_flip_vertically_on_load(), which is global
+        for (int y = 0; y < height / 2; y++) {
+            std::swap_ranges(base.begin() + static_cast<ptrdiff_t>(y * rowBytes),
+                base.begin() + static_cast<ptrdiff_t>((y + 1) * rowBytes),
+                base.begin() + static_cast<ptrdiff_t>((height - 1 - y) * rowBytes));
+        }
+    }
+
+    // full mip chain, down to 1x1
+    auto levelWidth = static_cast<uint32_t>(width);
+    auto levelHeight = static_cast<uint32_t>(height);
+    while (levelWidth > 1 || levelHeight > 1) {
+        decoded.push_back(downsample(decoded.back(), levelWidth, levelHeight));
+        levelWidth = std::max(levelWidth / 2, 1U);
+        levelHeight = std::max(levelHeight / 2, 1U);
+    }
+    levelWidth = width;
+    levelHeight = height;
+    for (const auto &level : decoded) {
+        levels.push_back({ .width = levelWidth, .height = levelHeight, .data = level });
+        levelWidth = std::max(levelWidth / 2, 1U);
+        levelHeight = std::max(levelHeight / 2, 1U);
+    }
+}
+
+bool cosc::TextureImage::loadCache() {
+    try {
+        cache = cosc::vfs::map(cacheFile);
+    } catch (const std::exception &e) {
+        SPDLOG_DEBUG("No texture cache {}: {}", cacheFile.string(), e.what());
+        return false;
+    }
+    auto bytes = cache->getBytes();
+
+    TextureCacheHeader header {};
+    if (bytes.size() < sizeof(header)) {
+        SPDLOG_WARN("Texture cache {} is truncated, will regenerate it", cacheFile.string());
+        cache.reset();
+        return false;
+    }
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    if (std::string_view(header.magic.data(), header.magic.size()) != TEXTURE_CACHE_MAGIC
+        || header.sourceHash != sourceHash || header.numLevels == 0) {
+        SPDLOG_INFO("Texture cache {} is stale, will regenerate it", cacheFile.string());
+        cache.reset();
+        return false;
+    }
+
+    size_t tableEnd = sizeof(header) + (header.numLevels * sizeof(TextureCacheLevel));
+    if (bytes.size() < tableEnd) {
+        SPDLOG_WARN("Texture cache {} is truncated, will regenerate it", cacheFile.string());
+        cache.reset();
+        return false;
+    }
+    auto offset = tableEnd;
+    for (uint32_t i = 0; i < header.numLevels; i++) {
+        TextureCacheLevel level {};
+        std::memcpy(&level, bytes.data() + sizeof(header) + (i * sizeof(level)), sizeof(level));
+        if (level.size > bytes.size() - offset) {
+            SPDLOG_WARN("Texture cache {} is truncated, will regenerate it", cacheFile.string());
+            levels.clear();
+            cache.reset();
+            return false;
+        }
+        levels.push_back(
+            { .width = level.width, .height = level.height, .data = bytes.subspan(offset, level.size) });
+        offset += level.size;
+    }
+    format = header.format;
+    compressed = header.compressed != 0;
+    cached = true;
+    SPDLOG_DEBUG("Loaded {} levels from texture cache {}", levels.size(), cacheFile.string());
+    return true;
+}
+
+void cosc::TextureImage::upload(unsigned int target, std::optional<size_t> bufferOffset) {
+    if (!bufferOffset) {
+        // with a pixel buffer, the caller has already done this before copyTo()
+        ensureSupported();
+    }
+    auto offset = bufferOffset.value_or(0);
+    for (size_t i = 0; i < levels.size(); i++) {
+        const auto &level = levels[i];
+        auto width = static_cast<GLsizei>(level.width);
+        auto height = static_cast<GLsizei>(level.height);
+        // with a pixel unpack buffer bound, GL takes the "pointer" as an offset into it
+        const void *pixels = bufferOffset ? reinterpret_cast<const void *>(offset) : level.data.data();
+        offset += level.data.size();
+        if (compressed) {
+            glCompressedTexImage2D(target, static_cast<GLint>(i), format, width, height, 0,
+                static_cast<GLsizei>(level.data.size()), pixels);
+        } else {
+            // a decoded image is handed to the driver to compress, if it can. cached RGBA8 levels are from a
+            // driver that couldn't.
+#if TEXTURE_CACHE == 1
+            GLint internalFormat = cached ? GL_RGBA8 : GL_COMPRESSED_RGBA;
+#else
+            GLint internalFormat = GL_RGBA8;
+#endif
+            glTexImage2D(target, static_cast<GLint>(i), internalFormat, width, height, 0, GL_RGBA,
+                GL_UNSIGNED_BYTE, pixels);
+        }
+    }
+    // only the levels we have, in case the image is tiny
+    auto textureTarget = target == GL_TEXTURE_2D ? GL_TEXTURE_2D : GL_TEXTURE_CUBE_MAP;
+    glTexParameteri(textureTarget, GL_TEXTURE_MAX_LEVEL, static_cast<GLint>(levels.size() - 1));
+}
+
+void cosc::TextureImage::copyTo(std::span<uint8_t> dest) const {
+    if (dest.size() != getSize()) {
+        throw std::invalid_argument("Texture copy destination is the wrong size");
+    }
+    size_t offset = 0;
+    for (const auto &level : levels) {
+        std::memcpy(dest.data() + offset, level.data.data(), level.data.size());
+        offset += level.data.size();
+    }
+}
+
+size_t cosc::TextureImage::getSize() const {
+    size_t size = 0;
+    for (const auto &level : levels) {
+        size += level.data.size();
+    }
+    return size;
+}
+
+size_t cosc::TextureImage::prepareCache(unsigned int target) {
+    cacheSizes.clear();
+    GLint isCompressed = GL_FALSE;
+    glGetTexLevelParameteriv(target, 0, GL_TEXTURE_COMPRESSED, &isCompressed);
+    if (isCompressed != GL_TRUE) {
+        // the driver can't compress it, so the cache just saves decoding it and making its mips
+        SPDLOG_DEBUG("Driver did not compress {}, caching it as RGBA8", path.string());
+        cacheFormat = GL_RGBA8;
+        return 0;
+    }
+
+    GLint internalFormat = 0;
+    glGetTexLevelParameteriv(target, 0, GL_TEXTURE_INTERNAL_FORMAT, &internalFormat);
+    cacheFormat = static_cast<uint32_t>(internalFormat);
+    size_t total = 0;
+    for (size_t i = 0; i < levels.size(); i++) {
+        GLint size = 0;
+        glGetTexLevelParameteriv(target, static_cast<GLint>(i), GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+        cacheSizes.push_back(static_cast<size_t>(size));
+        total += static_cast<size_t>(size);
+    }
+    SPDLOG_DEBUG("Driver compressed {} to format 0x{:x}", path.string(), cacheFormat);
+    return total;
+}
+
+void cosc::TextureImage::readBack(unsigned int target, size_t bufferOffset) const {
+    for (size_t i = 0; i < cacheSizes.size(); i++) {
+        // with a pixel pack buffer bound, GL takes the "pointer" as an offset into it
+        glGetCompressedTexImage(target, static_cast<GLint>(i), reinterpret_cast<void *>(bufferOffset));
+        bufferOffset += cacheSizes[i];
+    }
+}
+
+void cosc::TextureImage::writeCache(std::span<const uint8_t> compressedLevels) const {
+    TextureCacheHeader header {};
+    std::copy(TEXTURE_CACHE_MAGIC.begin(), TEXTURE_CACHE_MAGIC.end(), header.magic.begin());
+    header.sourceHash = sourceHash;
+    header.format = cacheFormat;
+    header.compressed = cacheSizes.empty() ? 0 : 1;
+    header.numLevels = static_cast<uint32_t>(levels.size());
+
+    // the compressed levels replace the decoded ones, if the driver compressed them
+    std::vector<std::span<const uint8_t>> data;
+    size_t offset = 0;
+    for (size_t i = 0; i < levels.size(); i++) {
+        if (cacheSizes.empty()) {
+            data.push_back(levels[i].data);
+        } else if (offset + cacheSizes[i] <= compressedLevels.size()) {
+            data.push_back(compressedLevels.subspan(offset, cacheSizes[i]));
+            offset += cacheSizes[i];
+        }
+    }
+    if (data.size() != levels.size() || offset != compressedLevels.size()) {
+        SPDLOG_WARN("Read back {} bytes of {}, which doesn't match its levels, not caching it",
+            compressedLevels.size(), path.string());
+        return;
+    }
+    std::vector<TextureCacheLevel> table;
+    for (size_t i = 0; i < levels.size(); i++) {
+        table.push_back({ .width = levels[i].width, .height = levels[i].height, .size = data[i].size() });
+    }
+
+    try {
+        cosc::analysis::writeAtomically(
+            cacheFile, [&](kj::BufferedOutputStreamWrapper &output, int /* fd */) {
+                output.write(&header, sizeof(header));
+                output.write(table.data(), table.size() * sizeof(TextureCacheLevel));
+                for (const auto &level : data) {
+                    output.write(level.data(), level.size());
+                }
+            });
+    } catch (const std::exception &e) {
+        // e.g. read-only data dir, we'll just have to decode it again next time
+        SPDLOG_WARN("Failed to write texture cache {}: {}", cacheFile.string(), e.what());
+    }
+}
@@ -0,0 +1,215 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#include "cosc/texture_stream.hpp"
+#include "glad/gl.h"
+#include <array>
+#include <chrono>
+#include <spdlog/spdlog.h>
+#include <stdexcept>
+
+/// Number of faces in a cube map
+constexpr size_t CUBE_MAP_FACES = 6;
+
+/// Sets the parameters shared by the placeholder and the real texture
+static void setWrap(unsigned int target) {
+    if (target == GL_TEXTURE_CUBE_MAP) {
+        glTexParameteri(target, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(target, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(target, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    }
+}
+
+cosc::StreamedTexture::StreamedTexture(const std::vector<fs::path> &paths, bool flipVertically)
+    : target(paths.size() == CUBE_MAP_FACES ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D) {
+    if (paths.size() != 1 && paths.size() != CUBE_MAP_FACES) {
+        throw std::invalid_argument("A streamed texture needs one image, or six for a cube map");
+    }
+
+    // one thread per image, there's only ever a handful of them and they're all needed as soon as possible
+    for (const auto &path : paths) {
+        pending.push_back(std::async(std::launch::async, [path, flipVertically]() {
+            auto begin = std::chrono::steady_clock::now();
+            TextureImage image(path, flipVertically);
+            auto end = std::chrono::steady_clock::now();
+            SPDLOG_DEBUG("Loaded {} in {} ms", path.string(),
+                std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count());
+            return image;
+        }));
+    }
+
+    // the placeholder has no mips, so it needs a filter that doesn't use them to be complete
+    constexpr std::array<uint8_t, 4> black = { 0, 0, 0, 255 };
+    glGenTextures(1, &placeholderId);
+    glBindTexture(target, placeholderId);
+    if (target == GL_TEXTURE_CUBE_MAP) {
+        for (unsigned int i = 0; i < CUBE_MAP_FACES; i++) {
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                black.data());
+        }
+    } else {
+        glTexImage2D(target, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, black.data());
+    }
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    setWrap(target);
+}
+
+void cosc::StreamedTexture::update() {
+    if (state == State::LOADING) {
+        for (const auto &future : pending) {
+            if (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                return;
+            }
+        }
+        // every image is loaded. get() rethrows if one of them failed.
+        std::vector<TextureImage> images;
+        for (auto &future : pending) {
+            images.push_back(future.get());
+        }
+        pending.clear();
+        startUpload(std::move(images));
+    }
+
+    if (state == State::UPLOADING) {
+        auto status = glClientWaitSync(fence, 0, 0);
+        if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+            glDeleteSync(fence);
+            fence = nullptr;
+            // the texture has its own copy now
+            glDeleteBuffers(1, &pixelBuffer);
+            pixelBuffer = 0;
+            glDeleteTextures(1, &placeholderId);
+            placeholderId = 0;
+            state = State::RESIDENT;
+            SPDLOG_DEBUG("Texture {} is resident", textureId);
+            startReadBack();
+        }
+    }
+
+    if (readBackFence != nullptr) {
+        auto status = glClientWaitSync(readBackFence, 0, 0);
+        if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+            glDeleteSync(readBackFence);
+            readBackFence = nullptr;
+            finishReadBack();
+        }
+    }
+}
+
+unsigned int cosc::StreamedTexture::getImageTarget(size_t i) const {
+    if (target == GL_TEXTURE_CUBE_MAP) {
+        return GL_TEXTURE_CUBE_MAP_POSITIVE_X + static_cast<unsigned int>(i);
+    }
+    return target;
+}
+
+void cosc::StreamedTexture::startUpload(std::vector<TextureImage> loaded) {
+    images = std::move(loaded);
+    size_t size = 0;
+    for (auto &image : images) {
+        // this can only be checked on the GL thread, and may change the image's size
+        image.ensureSupported();
+        size += image.getSize();
+    }
+
+    // copy every image into one pixel buffer object, one after the other
+    glGenBuffers(1, &pixelBuffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, static_cast<GLsizeiptr>(size), nullptr, GL_STREAM_DRAW);
+    auto *mapped = static_cast<uint8_t *>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+        static_cast<GLsizeiptr>(size), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+    if (mapped == nullptr) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        throw std::runtime_error("Failed to map texture pixel buffer");
+    }
+    size_t offset = 0;
+    for (const auto &image : images) {
+        image.copyTo(std::span(mapped + offset, image.getSize()));
+        offset += image.getSize();
+    }
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    // then upload from it, which returns without waiting for the copy to the GPU
+    glGenTextures(1, &textureId);
+    glBindTexture(target, textureId);
+    offset = 0;
+    for (size_t i = 0; i < images.size(); i++) {
+        images[i].upload(getImageTarget(i), offset);
+        offset += images[i].getSize();
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    setWrap(target);
+
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    state = State::UPLOADING;
+    SPDLOG_DEBUG("Streaming {} bytes to texture {}", size, textureId);
+}
+
+void cosc::StreamedTexture::startReadBack() {
+    // the cached images are done with
+    std::erase_if(images, [](const TextureImage &image) { return !image.needsCache(); });
+    if (images.empty()) {
+        return;
+    }
+
+    // the upload has finished, so asking how the driver stored the images doesn't wait for it
+    glBindTexture(target, textureId);
+    size_t size = 0;
+    for (size_t i = 0; i < images.size(); i++) {
+        readBackSizes.push_back(images[i].prepareCache(getImageTarget(i)));
+        size += readBackSizes.back();
+    }
+
+    // reading the compressed levels back into a pixel buffer object returns straight away, unlike reading
+    // them into memory, which would wait for the GPU
+    if (size > 0) {
+        glGenBuffers(1, &readBackBuffer);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readBackBuffer);
+        glBufferData(GL_PIXEL_PACK_BUFFER, static_cast<GLsizeiptr>(size), nullptr, GL_STREAM_READ);
+        size_t offset = 0;
+        for (size_t i = 0; i < images.size(); i++) {
+            images[i].readBack(getImageTarget(i), offset);
+            offset += readBackSizes[i];
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+    readBackFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void cosc::StreamedTexture::finishReadBack() {
+    std::span<const uint8_t> data;
+    if (readBackBuffer != 0) {
+        size_t size = 0;
+        for (auto imageSize : readBackSizes) {
+            size += imageSize;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readBackBuffer);
+        const auto *mapped = static_cast<const uint8_t *>(
+            glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, static_cast<GLsizeiptr>(size), GL_MAP_READ_BIT));
+        if (mapped == nullptr) {
+            SPDLOG_WARN("Failed to map the read back of texture {}, not caching it", textureId);
+            images.clear();
+        } else {
+            data = std::span(mapped, size);
+        }
+    }
+
+    size_t offset = 0;
+    for (size_t i = 0; i < images.size(); i++) {
+        images[i].writeCache(data.subspan(offset, readBackSizes[i]));
+        offset += readBackSizes[i];
+    }
+
+    if (readBackBuffer != 0) {
+        if (!data.empty()) {
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glDeleteBuffers(1, &readBackBuffer);
+        readBackBuffer = 0;
+    }
+    images.clear();
+    readBackSizes.clear();
+}
@@ -1,22 +1,229 @@
 // Copyright 2024 Matt Young.
 // SPDX-License-Identifier: ISC
 #include "cosc/util.hpp"
+#include "cosc/assets.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
 #include <spdlog/spdlog.h>
-#include <sstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
 
 namespace fs = std::filesystem;
 
 std::string cosc::util::readPathToString(const fs::path &path) {
     SPDLOG_DEBUG("Read path {} to string", path.string());
+    // this is mostly used for shaders, which are assets
+    return std::string(cosc::vfs::read(path).getString());
+}
+
+std::vector<uint8_t> cosc::util::readPathToBytes(const fs::path &path) {
+    SPDLOG_DEBUG("Read path {} to bytes", path.string());
     std::ifstream file;
     file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-    file.open(path.string());
+    file.open(path.string(), std::ios::binary);
 
-    std::stringstream stream;
-    stream << file.rdbuf();
+    std::vector<uint8_t> bytes(fs::file_size(path));
+    file.read(reinterpret_cast<char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
     file.close();
 
-    return stream.str();
+    return bytes;
+}
+
+// XXH64 primes, source: https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+constexpr uint64_t XXH_PRIME_1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t XXH_PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t XXH_PRIME_3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t XXH_PRIME_4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t XXH_PRIME_5 = 0x27D4EB2F165667C5ULL;
+
+static uint64_t readWord(const uint8_t *data) {
+    uint64_t word = 0;
+    std::memcpy(&word, data, sizeof(word));
+    return word;
+}
+
+static uint64_t xxhRound(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME_2;
+    return std::rotl(acc, 31) * XXH_PRIME_1;
+}
+
+static uint64_t xxhMerge(uint64_t hash, uint64_t acc) {
+    hash ^= xxhRound(0, acc);
+    return (hash * XXH_PRIME_1) + XXH_PRIME_4;
+}
+
+uint64_t cosc::util::hashBytes(std::span<const uint8_t> bytes, uint64_t seed) {
+    const auto *data = bytes.data();
+    auto len = bytes.size();
+    size_t i = 0;
+    uint64_t hash = 0;
+
+    if (len >= 32) {
+        // four independent lanes over 32 byte stripes, which is most of a FLAC file
+        std::array<uint64_t, 4> acc = { seed + XXH_PRIME_1 + XXH_PRIME_2, seed + XXH_PRIME_2, seed,
+            seed - XXH_PRIME_1 };
+        for (; i + 32 <= len; i += 32) {
+            for (size_t lane = 0; lane < acc.size(); lane++) {
+                acc[lane] = xxhRound(acc[lane], readWord(data + i + (lane * sizeof(uint64_t))));
+            }
+        }
+        hash = std::rotl(acc[0], 1) + std::rotl(acc[1], 7) + std::rotl(acc[2], 12) + std::rotl(acc[3], 18);
+        for (auto lane : acc) {
+            hash = xxhMerge(hash, lane);
+        }
+    } else {
+        hash = seed + XXH_PRIME_5;
+    }
+    hash += len;
+
+    // remaining tail
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        hash ^= xxhRound(0, readWord(data + i));
+        hash = (std::rotl(hash, 27) * XXH_PRIME_1) + XXH_PRIME_4;
+    }
+    if (i + sizeof(uint32_t) <= len) {
+        uint32_t word = 0;
+        std::memcpy(&word, data + i, sizeof(word));
+        hash ^= word * XXH_PRIME_1;
+        hash = (std::rotl(hash, 23) * XXH_PRIME_2) + XXH_PRIME_3;
+        i += sizeof(uint32_t);
+    }
+    for (; i < len; i++) {
+        hash ^= data[i] * XXH_PRIME_5;
+        hash = std::rotl(hash, 11) * XXH_PRIME_1;
+    }
+
+    // avalanche, so that every input bit affects every output bit
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+uint64_t cosc::util::hashFile(const fs::path &path) {
+    MappedFile file(path);
+    // we only go through it once, front to back
+    file.advise(MADV_SEQUENTIAL);
+    return hashBytes(file.getBytes());
+}
+
+cosc::util::MappedFile::MappedFile(const fs::path &path) {
+    size = fs::file_size(path);
+    if (size == 0) {
+        // mmap() can't map nothing
+        return;
+    }
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        SPDLOG_ERROR("Failed to open() {}: {}", path.string(), strerror(errno));
+        throw std::runtime_error("Failed to open file for mapping");
+    }
+    data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping keeps the file alive, so we don't need the fd any more
+    close(fd);
+    if (data == MAP_FAILED) {
+        data = nullptr;
+        SPDLOG_ERROR("Failed to mmap() {}: {}", path.string(), strerror(errno));
+        throw std::runtime_error("Failed to mmap file");
+    }
+}
+
+cosc::util::MappedFile::~MappedFile() {
+    if (data != nullptr) {
+        munmap(data, size);
+    }
+}
+
+void cosc::util::MappedFile::advise(int advice) const {
+    if (data != nullptr) {
+        madvise(data, size, advice);
+    }
+}
+
+uint16_t cosc::util::floatToHalf(float value) {
+    // Source: https://en.wikipedia.org/wiki/Half-precision_floating-point_format
+    auto bits = std::bit_cast<uint32_t>(value);
+    auto sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+    auto floatExponent = static_cast<int32_t>((bits >> 23) & 0xff);
+    uint32_t mantissa = bits & 0x7fffff;
+    if (floatExponent == 0xff) {
+        // infinity stays infinity, NaN stays (a quiet) NaN
+        return sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0);
+    }
+
+    auto exponent = floatExponent - 127 + 15;
+    if (exponent >= 0x1f) {
+        return sign | 0x7c00;
+    }
+    // drop the mantissa bits that don't fit, rounding to nearest even. for subnormals, the implicit leading
+    // one becomes explicit and gets shifted down with the rest.
+    uint32_t shift = 13;
+    uint32_t half = (static_cast<uint32_t>(std::max(exponent, 0)) << 10);
+    if (exponent <= 0) {
+        if (exponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        shift = static_cast<uint32_t>(14 - exponent);
+    }
+    half += mantissa >> shift;
+    auto remainder = mantissa & ((1U << shift) - 1);
+    auto halfway = 1U << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (half & 1) != 0)) {
+        // this can carry into the exponent, which is still correct (up to infinity)
+        half++;
+    }
+    return static_cast<uint16_t>(sign | half);
+}
+
+float cosc::util::halfToFloat(uint16_t half) {
+    auto sign = static_cast<uint32_t>(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1f;
+    uint32_t mantissa = half & 0x3ff;
+    if (exponent == 0) {
+        // zero or subnormal, mantissa * 2^-24
+        auto magnitude = std::ldexp(static_cast<float>(mantissa), -24);
+        return sign != 0 ? -magnitude : magnitude;
+    }
+    auto floatExponent = exponent == 0x1f ? 0xffU : exponent - 15 + 127;
+    return std::bit_cast<float>(sign | (floatExponent << 23) | (mantissa << 13));
+}
+
+void cosc::util::parallelFor(size_t count, const std::function<void(size_t begin, size_t end)> &func) {
+    auto numThreads = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, std::max<size_t>(count, 1));
+    auto chunk = (count + numThreads - 1) / numThreads;
+
+    // an exception escaping a std::thread calls std::terminate(), so catch it and rethrow it on this thread
+    std::vector<std::exception_ptr> errors(numThreads);
+    std::vector<std::thread> threads;
+    for (size_t begin = 0, i = 0; begin < count; begin += chunk, i++) {
+        auto end = std::min(begin + chunk, count);
+        threads.emplace_back([&func, &error = errors[i], begin, end]() {
+            try {
+                func(begin, end);
+            } catch (...) {
+                error = std::current_exception();
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    for (const auto &error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
 }
@@ -0,0 +1,93 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+// Packs a small data directory into an asset archive, then reads it back through AssetArchive and the vfs,
+// including loose files that have changed since it was packed.
+#include "check.hpp"
+#include "cosc/assets.hpp"
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+static void writeFile(const fs::path &path, const std::string &contents) {
+    fs::create_directories(path.parent_path());
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << contents;
+}
+
+static std::string toString(std::span<const uint8_t> bytes) {
+    return { reinterpret_cast<const char *>(bytes.data()), bytes.size() };
+}
+
+int main() {
+    auto dataDir = fs::temp_directory_path() / ("musicvis-assets-test-" + std::to_string(getpid()));
+    fs::remove_all(dataDir);
+    const std::map<std::string, std::string> assets = {
+        { "bar.vert.glsl", "#version 430 core\nvoid main() {}\n" },
+        { "skybox/front.png", std::string("\x89PNG\r\n\x1a\n\0\0\0 not really", 24) },
+        { "empty.txt", "" },
+        { "a/b/c/deep.txt", "three directories down" },
+    };
+    for (const auto &[path, contents] : assets) {
+        writeFile(dataDir / path, contents);
+    }
+    // songs are left out, as are half written archives
+    writeFile(dataDir / "songs" / "Band_Song" / "audio.flac", "fLaC");
+    writeFile(dataDir / "assets.pak.tmp", "leftovers");
+
+    cosc::analysis::writeAssetArchive(dataDir);
+    {
+        cosc::AssetArchive archive(dataDir / cosc::ASSET_ARCHIVE_NAME);
+        CHECK(archive.size() == assets.size());
+        for (const auto &[path, contents] : assets) {
+            auto asset = archive.find(path);
+            CHECK(asset.has_value());
+            CHECK(toString(asset->bytes) == contents);
+            // aligned from the start of the file, which is page aligned in memory
+            CHECK(contents.empty()
+                || reinterpret_cast<uintptr_t>(asset->bytes.data()) % cosc::ASSET_ALIGNMENT == 0);
+            CHECK(asset->modified == fs::last_write_time(dataDir / path).time_since_epoch().count());
+        }
+        CHECK(!archive.find("songs/Band_Song/audio.flac").has_value());
+        CHECK(!archive.find("assets.pak.tmp").has_value());
+        CHECK(!archive.find("missing.txt").has_value());
+    }
+
+    cosc::vfs::mount(dataDir);
+    for (const auto &[path, contents] : assets) {
+        CHECK(cosc::vfs::read(dataDir / path).getString() == contents);
+        if (!contents.empty()) {
+            // an empty loose file can't be mapped
+            CHECK(cosc::vfs::map(dataDir / path).getString() == contents);
+        }
+    }
+
+    // a loose file that's been edited is read from disk, not from the archive
+    auto edited = dataDir / "bar.vert.glsl";
+    writeFile(edited, "#version 430 core\n// edited\nvoid main() {}\n");
+    CHECK(cosc::vfs::read(edited).getString() == "#version 430 core\n// edited\nvoid main() {}\n");
+
+#if ASSET_ARCHIVE == 1
+    // one with the same size and time is taken to be unchanged, so it comes from the archive
+    auto deep = dataDir / "a/b/c/deep.txt";
+    auto modified = fs::last_write_time(deep);
+    writeFile(deep, "THREE DIRECTORIES DOWN");
+    fs::last_write_time(deep, modified);
+    CHECK(cosc::vfs::read(deep).getString() == "three directories down");
+
+    // and with no loose file at all, the archive is all there is
+    fs::remove(dataDir / "skybox" / "front.png");
+    CHECK(cosc::vfs::read(dataDir / "skybox" / "front.png").getString() == assets.at("skybox/front.png"));
+#endif
+
+    // files outside the data directory, or not in the archive, are read as usual
+    writeFile(dataDir / "new.txt", "added after packing");
+    CHECK(cosc::vfs::read(dataDir / "new.txt").getString() == "added after packing");
+    CHECK_THROWS(cosc::vfs::read(dataDir / "missing.txt"), std::exception);
+
+    // anything that isn't an archive is refused
+    writeFile(dataDir / "not.pak", "not an asset archive, just some text that is long enough");
+    CHECK_THROWS(cosc::AssetArchive(dataDir / "not.pak"), std::runtime_error);
+    fs::remove_all(dataDir);
+    return 0;
+}
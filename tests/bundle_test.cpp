@@ -0,0 +1,106 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+// Packs a song directory into a bundle with writeBundle(), then reads it back with SongBundle and pages the
+// spectrum out of it in place.
+#include "check.hpp"
+#include "cosc/bundle.hpp"
+#include "cosc/spectrum_analyser.hpp"
+#include "cosc/spectrum_pager.hpp"
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <unistd.h>
+#include <vector>
+
+constexpr uint32_t SAMPLE_RATE = 44100;
+constexpr unsigned int CHANNELS = 2;
+
+static void writeFile(const fs::path &path, std::span<const uint8_t> bytes) {
+    std::ofstream(path, std::ios::binary | std::ios::trunc)
+        .write(reinterpret_cast<const char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+}
+
+static bool sameBytes(std::span<const uint8_t> a, std::span<const uint8_t> b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end());
+}
+
+int main() {
+    auto songDir = fs::temp_directory_path() / ("musicvis-bundle-test-" + std::to_string(getpid()));
+    auto bundleFile = fs::path(songDir).concat(cosc::BUNDLE_EXTENSION);
+    fs::remove_all(songDir);
+    fs::create_directories(songDir);
+
+    // the bundle doesn't look inside the audio, so it can be anything. an odd size checks the padding.
+    std::mt19937 rng(3000);
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::vector<uint8_t> audio(10'001);
+    for (auto &b : audio) {
+        b = static_cast<uint8_t>(byte(rng));
+    }
+    writeFile(songDir / "audio.flac", audio);
+
+    std::uniform_int_distribution<int32_t> noise(-(1 << 28), 1 << 28);
+    std::vector<int32_t> pcm(static_cast<size_t>(SAMPLE_RATE) * 3 * CHANNELS);
+    for (auto &sample : pcm) {
+        sample = noise(rng);
+    }
+    auto frames = pcm.size() / CHANNELS;
+    cosc::AnalysisParams params;
+    params.numBars = 256;
+    auto spectrumFile = songDir / "spectrum.bin";
+    cosc::analysis::writeChunkedSpectrum(spectrumFile, 1,
+        cosc::analysis::memorySource(pcm.data(), frames, CHANNELS), frames, CHANNELS, SAMPLE_RATE, params);
+
+    CHECK(cosc::analysis::writeBundle(songDir, bundleFile));
+    {
+        cosc::SongBundle bundle(bundleFile);
+        CHECK(bundle.getName() == songDir.filename().string());
+        CHECK(bundle.getAudioHash() == cosc::util::hashBytes(audio));
+        CHECK(sameBytes(bundle.getAudio(), audio));
+        cosc::util::MappedFile spectrum(spectrumFile);
+        CHECK(sameBytes(bundle.getSpectrum(), spectrum.getBytes()));
+        // the mapping is page aligned, so the sections are too
+        CHECK(reinterpret_cast<uintptr_t>(bundle.getAudio().data()) % cosc::BUNDLE_ALIGNMENT == 0);
+        CHECK(reinterpret_cast<uintptr_t>(bundle.getSpectrum().data()) % cosc::BUNDLE_ALIGNMENT == 0);
+
+        // the spectrum pages out of the bundle the same as out of its own file
+        cosc::SpectrumPager fromBundle(bundle.getMapping(), bundle.getSpectrum());
+        cosc::SpectrumPager fromFile(spectrumFile);
+        CHECK(fromBundle.getNumBlocks() == fromFile.getNumBlocks());
+        for (uint64_t block = 0; block < fromFile.getNumBlocks(); block += 37) {
+            auto a = fromBundle.get(block);
+            auto b = fromFile.get(block);
+            CHECK(a->first == b->first && a->count == b->count);
+            CHECK(a->bars == b->bars);
+        }
+    }
+
+    // nothing has changed, so the bundle is left alone
+    CHECK(!cosc::analysis::writeBundle(songDir, bundleFile));
+
+    // new audio, or a new spectrum, and it's rewritten
+    audio[0] ^= 0xff;
+    writeFile(songDir / "audio.flac", audio);
+    CHECK(cosc::analysis::writeBundle(songDir, bundleFile));
+    CHECK(cosc::SongBundle(bundleFile).getAudioHash() == cosc::util::hashBytes(audio));
+    cosc::analysis::writeChunkedSpectrum(spectrumFile, 2,
+        cosc::analysis::memorySource(pcm.data(), frames, CHANNELS), frames, CHANNELS, SAMPLE_RATE, params);
+    CHECK(cosc::analysis::writeBundle(songDir, bundleFile));
+    CHECK(!cosc::analysis::writeBundle(songDir, bundleFile));
+
+    // a bundle that's been overwritten with garbage is refused, and rewritten
+    std::vector<uint8_t> garbage(64, 'x');
+    writeFile(bundleFile, garbage);
+    CHECK_THROWS(cosc::SongBundle { bundleFile }, std::runtime_error);
+    CHECK(cosc::analysis::writeBundle(songDir, bundleFile));
+    CHECK(sameBytes(cosc::SongBundle(bundleFile).getAudio(), audio));
+
+    // only chunked spectrums can be bundled
+    writeFile(spectrumFile, garbage);
+    CHECK_THROWS(cosc::analysis::writeBundle(songDir, bundleFile), std::runtime_error);
+
+    fs::remove_all(songDir);
+    fs::remove(bundleFile);
+    return 0;
+}
@@ -0,0 +1,31 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+
+// Tests are plain executables run by CTest: exit code 0 passes, 77 skips, anything else fails.
+
+/// Exit code CTest treats as a skip, see SKIP_RETURN_CODE in CMakeLists.txt
+constexpr int TEST_SKIPPED = 77;
+
+/// Fails the test if `cond` is false
+#define CHECK(cond)                                                                                          \
+    do {                                                                                                     \
+        if (!(cond)) {                                                                                       \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                  \
+            std::exit(EXIT_FAILURE);                                                                         \
+        }                                                                                                    \
+    } while (0)
+
+/// Fails the test unless `expr` throws a `type`
+#define CHECK_THROWS(expr, type)                                                                             \
+    do {                                                                                                     \
+        bool threw = false;                                                                                  \
+        try {                                                                                                \
+            (void) (expr);                                                                                   \
+        } catch (const type &) {                                                                             \
+            threw = true;                                                                                    \
+        }                                                                                                    \
+        CHECK(threw);                                                                                        \
+    } while (0)
@@ -0,0 +1,94 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+// Runs detectEvents() on a synthetic 120 BPM flux, and walks its events with EventCursor.
+#include "check.hpp"
+#include "cosc/events.hpp"
+#include <algorithm>
+#include <capnp/message.h>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+/// Blocks per second with the default analysis parameters, 44.1 kHz and a hop size of 256
+constexpr double BLOCKS_PER_SECOND = 44100.0 / 256.0;
+constexpr double BPM = 120.0;
+constexpr double PERIOD = 60.0 * BLOCKS_PER_SECOND / BPM;
+
+int main() {
+    // 30 seconds of low noise, with a hit on every beat
+    std::vector<float> flux(static_cast<size_t>(30.0 * BLOCKS_PER_SECOND));
+    std::mt19937 rng(3000);
+    std::uniform_real_distribution<float> noise(0.f, 0.02f);
+    for (auto &value : flux) {
+        value = noise(rng);
+    }
+    std::vector<uint64_t> hits;
+    for (auto time = 10.0; time < static_cast<double>(flux.size()); time += PERIOD) {
+        hits.push_back(static_cast<uint64_t>(std::lround(time)));
+        flux[hits.back()] = 1.f;
+    }
+
+    auto track = cosc::analysis::detectEvents(flux, BLOCKS_PER_SECOND);
+    CHECK(std::abs(track.tempo - BPM) < 1.0);
+    CHECK(std::is_sorted(track.events.begin(), track.events.end(),
+        [](const cosc::Event &a, const cosc::Event &b) { return a.block < b.block; }));
+
+    // every hit is an onset, and nothing else is. beats land on the hits, give or take a block.
+    std::vector<uint64_t> onsets;
+    size_t numBeats = 0;
+    for (const auto &event : track.events) {
+        CHECK(event.strength >= 0.f && event.strength <= 1.f);
+        if (event.type == MusicVisEventType::ONSET) {
+            onsets.push_back(event.block);
+            CHECK(event.strength == 1.f);
+            continue;
+        }
+        numBeats++;
+        auto nearest = std::min_element(hits.begin(), hits.end(), [&](uint64_t a, uint64_t b) {
+            return std::llabs(static_cast<long long>(a - event.block))
+                < std::llabs(static_cast<long long>(b - event.block));
+        });
+        CHECK(std::llabs(static_cast<long long>(*nearest - event.block)) <= 1);
+    }
+    CHECK(onsets == hits);
+    CHECK(numBeats + 2 >= hits.size() && numBeats <= hits.size());
+
+    // nothing to find in silence, or a flux that never changes
+    CHECK(cosc::analysis::detectEvents({}, BLOCKS_PER_SECOND).events.empty());
+    std::vector<float> flat(flux.size(), 0.5f);
+    auto flatTrack = cosc::analysis::detectEvents(flat, BLOCKS_PER_SECOND);
+    CHECK(flatTrack.events.empty() && flatTrack.tempo == 0.f);
+
+    ::capnp::MallocMessageBuilder message;
+    auto builder = message.initRoot<MusicVisEvents>();
+    cosc::analysis::writeEvents(builder, track);
+    auto events = builder.asReader().getEvents();
+    CHECK(events.size() == track.events.size());
+
+    // playing through a frame at a time returns every event once, in order, in the frame it happens in
+    cosc::EventCursor cursor(events);
+    constexpr uint64_t blocksPerFrame = 3;
+    size_t returned = 0;
+    MusicVisEvent::Reader event;
+    for (uint64_t block = 0; block < flux.size() + blocksPerFrame; block += blocksPerFrame) {
+        while (cursor.next(block, event)) {
+            CHECK(event.getBlock() == track.events[returned].block);
+            CHECK(event.getType() == track.events[returned].type);
+            CHECK(event.getBlock() <= block && event.getBlock() + blocksPerFrame > block);
+            returned++;
+        }
+    }
+    CHECK(returned == track.events.size());
+    CHECK(!cursor.hasUpcoming());
+
+    // seeking back skips everything up to the new position, and picks up from the first event after it
+    auto seekTo = hits[hits.size() / 2];
+    CHECK(!cursor.next(seekTo, event));
+    CHECK(cursor.hasUpcoming());
+    CHECK(cursor.upcoming().getBlock() > seekTo);
+    auto firstAfter = std::upper_bound(track.events.begin(), track.events.end(), seekTo,
+        [](uint64_t block, const cosc::Event &e) { return block < e.block; });
+    CHECK(cursor.upcoming().getBlock() == firstAfter->block);
+    return 0;
+}
@@ -0,0 +1,76 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+// Checks FFT against a direct DFT, computed in double precision.
+#include "check.hpp"
+#include "cosc/fft.hpp"
+#include <cmath>
+#include <complex>
+#include <numbers>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+/// The textbook O(n^2) DFT
+static std::vector<std::complex<double>> dft(const std::vector<std::complex<float>> &input) {
+    auto size = input.size();
+    std::vector<std::complex<double>> output(size);
+    for (size_t k = 0; k < size; k++) {
+        for (size_t n = 0; n < size; n++) {
+            auto phase = static_cast<double>((k * n) % size) / static_cast<double>(size);
+            output[k] += std::complex<double>(input[n]) * std::polar(1.0, -2.0 * std::numbers::pi * phase);
+        }
+    }
+    return output;
+}
+
+/// Largest error of `size` random samples through FFT, relative to the largest DFT output
+static double maxError(size_t size, std::mt19937 &rng) {
+    std::uniform_real_distribution<float> sample(-1.f, 1.f);
+    std::vector<std::complex<float>> data(size);
+    for (auto &x : data) {
+        x = { sample(rng), sample(rng) };
+    }
+    auto expected = dft(data);
+    cosc::FFT(size).forward(data);
+
+    double peak = 0.0;
+    double error = 0.0;
+    for (size_t k = 0; k < size; k++) {
+        peak = std::max(peak, std::abs(expected[k]));
+        error = std::max(error, std::abs(std::complex<double>(data[k]) - expected[k]));
+    }
+    return error / peak;
+}
+
+int main() {
+    std::mt19937 rng(3000);
+    for (size_t size = 2; size <= 4096; size *= 2) {
+        CHECK(maxError(size, rng) < 1e-5);
+    }
+
+    // an impulse has a flat spectrum, and a cosine on bin 3 only shows up on bins 3 and size - 3
+    constexpr size_t size = 64;
+    cosc::FFT fft(size);
+    std::vector<std::complex<float>> data(size);
+    data[0] = 1.f;
+    fft.forward(data);
+    for (const auto &x : data) {
+        CHECK(std::abs(x - std::complex<float>(1.f)) < 1e-6f);
+    }
+    for (size_t n = 0; n < size; n++) {
+        data[n] = static_cast<float>(std::cos(2.0 * std::numbers::pi * 3.0 * static_cast<double>(n) / size));
+    }
+    fft.forward(data);
+    for (size_t k = 0; k < size; k++) {
+        auto expected = (k == 3 || k == size - 3) ? size / 2.f : 0.f;
+        CHECK(std::abs(data[k] - std::complex<float>(expected)) < 1e-4f);
+    }
+
+    // sizes it can't do, and input that doesn't match
+    for (size_t bad : { 0, 1, 3, 1000 }) {
+        CHECK_THROWS(cosc::FFT(bad), std::invalid_argument);
+    }
+    std::vector<std::complex<float>> wrongSize(size / 2);
+    CHECK_THROWS(fft.forward(wrongSize), std::invalid_argument);
+    return 0;
+}
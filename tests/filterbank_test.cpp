@@ -0,0 +1,90 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+// Checks the shape of Filterbank's weights on every scale, and what apply() does with simple spectra.
+#include "check.hpp"
+#include "cosc/filterbank.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+constexpr uint32_t SAMPLE_RATE = 44100;
+constexpr uint32_t FFT_SIZE = 1024;
+constexpr uint32_t NUM_BINS = (FFT_SIZE / 2) + 1;
+
+static void checkFilterbank(cosc::FilterbankScale scale, uint32_t numBars) {
+    cosc::Filterbank filterbank(
+        { .scale = scale, .sampleRate = SAMPLE_RATE, .fftSize = FFT_SIZE, .numBars = numBars, .freqMin = 20.f,
+            .freqMax = 20'000.f });
+    auto bands = filterbank.getBands();
+    auto weights = filterbank.getWeights();
+    CHECK(bands.size() == numBars);
+
+    // every band is in range, packed after the last, and a weighted mean, and bars go up in frequency
+    uint32_t offset = 0;
+    uint32_t lastFirstBin = 0;
+    for (const auto &band : bands) {
+        CHECK(band.numBins > 0);
+        CHECK(band.firstBin + band.numBins <= NUM_BINS);
+        CHECK(band.weightOffset == offset);
+        CHECK(band.firstBin >= lastFirstBin);
+        float sum = 0.f;
+        for (uint32_t i = 0; i < band.numBins; i++) {
+            CHECK(weights[offset + i] >= 0.f);
+            sum += weights[offset + i];
+        }
+        CHECK(std::abs(sum - 1.f) < 1e-5f);
+        offset += band.numBins;
+        lastFirstBin = band.firstBin;
+    }
+    CHECK(offset == weights.size());
+
+    // so a flat spectrum gives flat bars
+    std::vector<float> power(NUM_BINS, 3.f);
+    std::vector<float> bars(numBars);
+    filterbank.apply(power, bars);
+    for (auto bar : bars) {
+        CHECK(std::abs(bar - 3.f) < 1e-4f);
+    }
+
+    // and a single bin only lights up the bars that cover it, most of all the one centred nearest it
+    constexpr uint32_t toneBin = 100;
+    std::fill(power.begin(), power.end(), 0.f);
+    power[toneBin] = 1.f;
+    filterbank.apply(power, bars);
+    for (size_t i = 0; i < numBars; i++) {
+        auto covers = bands[i].firstBin <= toneBin && toneBin < bands[i].firstBin + bands[i].numBins;
+        CHECK(covers || bars[i] == 0.f);
+    }
+    auto loudest = std::max_element(bars.begin(), bars.end()) - bars.begin();
+    CHECK(bars[loudest] > 0.f);
+    CHECK(bands[loudest].firstBin <= toneBin && toneBin < bands[loudest].firstBin + bands[loudest].numBins);
+}
+
+int main() {
+    for (auto scale : { cosc::FilterbankScale::LINEAR, cosc::FilterbankScale::LOG, cosc::FilterbankScale::MEL,
+             cosc::FilterbankScale::CONSTANT_Q }) {
+        // more bars than bins, so the low bands are all narrower than a bin and get interpolated
+        for (uint32_t numBars : { 1, 8, 32, 1000 }) {
+            checkFilterbank(scale, numBars);
+        }
+    }
+
+    // get() shares filterbanks between identical configs only
+    cosc::FilterbankConfig config { .scale = cosc::FilterbankScale::LOG, .sampleRate = SAMPLE_RATE,
+        .fftSize = FFT_SIZE, .numBars = 32, .freqMin = 20.f, .freqMax = 20'000.f };
+    auto shared = cosc::Filterbank::get(config);
+    CHECK(cosc::Filterbank::get(config) == shared);
+    config.numBars = 64;
+    CHECK(cosc::Filterbank::get(config) != shared);
+
+    config.numBars = 0;
+    CHECK_THROWS(cosc::Filterbank(config), std::invalid_argument);
+    config.numBars = 32;
+    config.freqMin = 0.f;
+    CHECK_THROWS(cosc::Filterbank(config), std::invalid_argument);
+    config.freqMin = 20'000.f;
+    config.freqMax = 20.f;
+    CHECK_THROWS(cosc::Filterbank(config), std::invalid_argument);
+    return 0;
+}
@@ -0,0 +1,117 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+// Smoke test for GpuAnalyser: analyses the same audio on the CPU and the GPU and checks they agree. Needs an
+// OpenGL 4.3 context, which it makes with a hidden SDL window (Mesa llvmpipe is fine), and skips without one.
+// Usage: musicvis-test-gpu_analyser <data dir>
+#include "check.hpp"
+#include "cosc/gpu_analyser.hpp"
+#include "cosc/spectrum_analyser.hpp"
+#include "glad/gl.h"
+#include <SDL2/SDL.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+#include <random>
+#include <spdlog/spdlog.h>
+#include <vector>
+
+/// Bars may differ by this many levels, about 0.1 dB with the default volume range. The GPU does the FFT in
+/// single precision, which is a little off in the quietest bins.
+constexpr int BAR_TOLERANCE = 82;
+
+/// Relative error allowed in the spectral energy
+constexpr float ENERGY_TOLERANCE = 1e-3f;
+
+/// Makes a hidden window with a GL 4.3 core context current, or returns false if there's no way to
+static bool createContext(SDL_Window *&window, SDL_GLContext &context) {
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        SPDLOG_WARN("No video: {}", SDL_GetError());
+        return false;
+    }
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+    window = SDL_CreateWindow("musicvis-gpu-test", 0, 0, 16, 16, SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+    if (window == nullptr) {
+        SPDLOG_WARN("Failed to create window: {}", SDL_GetError());
+        return false;
+    }
+    context = SDL_GL_CreateContext(window);
+    if (context == nullptr) {
+        SPDLOG_WARN("Failed to create GL 4.3 context: {}", SDL_GetError());
+        return false;
+    }
+    return gladLoadGL((GLADloadfunc) SDL_GL_GetProcAddress) != 0;
+}
+
+int main(int argc, char *argv[]) {
+    CHECK(argc == 2);
+    fs::path dataDir = argv[1];
+
+    SDL_Window *window = nullptr;
+    SDL_GLContext context = nullptr;
+    if (!createContext(window, context)) {
+        SPDLOG_WARN("Skipping, no OpenGL 4.3 context");
+        return TEST_SKIPPED;
+    }
+
+    constexpr uint32_t sampleRate = 44100;
+    constexpr size_t numBlocks = 64;
+    cosc::AnalysisParams params;
+
+    // a few tones and some noise, long enough that no block needs padding
+    std::vector<float> mono(((numBlocks - 1) * params.hopSize) + params.blockSize);
+    std::mt19937 rng(3000);
+    std::uniform_real_distribution<float> noise(-0.05f, 0.05f);
+    for (size_t i = 0; i < mono.size(); i++) {
+        auto t = static_cast<double>(i) / sampleRate;
+        mono[i] = static_cast<float>((0.4 * std::sin(2.0 * std::numbers::pi * 110.0 * t))
+                      + (0.2 * std::sin(2.0 * std::numbers::pi * 1234.5 * t))
+                      + (0.1 * std::sin(2.0 * std::numbers::pi * 9000.0 * t)))
+            + noise(rng);
+    }
+
+    std::vector<uint16_t> cpuBars(numBlocks * params.numBars);
+    std::vector<float> cpuEnergies(numBlocks);
+    cosc::SpectrumAnalyser cpu(params, sampleRate);
+    for (size_t i = 0; i < numBlocks; i++) {
+        auto block = std::span<const float>(mono).subspan(i * params.hopSize, params.blockSize);
+        auto bars = std::span(cpuBars).subspan(i * params.numBars, params.numBars);
+        cpuEnergies[i] = cpu.processBlock(block, bars).spectralEnergy;
+    }
+
+    std::vector<uint16_t> gpuBars(numBlocks * params.numBars);
+    std::vector<float> gpuEnergies(numBlocks);
+    {
+        cosc::GpuAnalyser gpu(params, sampleRate, dataDir / "analyse.comp.glsl", numBlocks);
+        gpu.dispatch(mono, numBlocks);
+        gpu.read(gpuBars, gpuEnergies);
+
+        // the energy readback only ever hands over finished copies, so just poll until it turns up
+        gpu.requestEnergy();
+        float energy = -1.f;
+        while (!gpu.pollEnergy(energy)) {
+            glFlush();
+        }
+        CHECK(energy == gpuEnergies[0]);
+    }
+    CHECK(glGetError() == GL_NO_ERROR);
+
+    for (size_t i = 0; i < cpuBars.size(); i++) {
+        auto diff = std::abs(static_cast<int>(cpuBars[i]) - static_cast<int>(gpuBars[i]));
+        if (diff > BAR_TOLERANCE) {
+            SPDLOG_ERROR("Bar {} of block {}: CPU {}, GPU {}", i % params.numBars, i / params.numBars,
+                cpuBars[i], gpuBars[i]);
+        }
+        CHECK(diff <= BAR_TOLERANCE);
+    }
+    for (size_t i = 0; i < numBlocks; i++) {
+        CHECK(std::abs(cpuEnergies[i] - gpuEnergies[i]) <= ENERGY_TOLERANCE * cpuEnergies[i]);
+    }
+
+    SDL_GL_DeleteContext(context);
+    SDL_DestroyWindow(window);
+    SDL_Quit();
+    return 0;
+}
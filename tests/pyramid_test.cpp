@@ -0,0 +1,109 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+// Builds a time pyramid with PyramidBuilder, reads it back with SpectrumPyramid, and checks every row of
+// every level against the max and mean of its blocks worked out directly.
+#include "check.hpp"
+#include "cosc/pyramid.hpp"
+#include "cosc/spectrum_analyser.hpp"
+#include <algorithm>
+#include <capnp/message.h>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+/// Not a power of two, so the last row of most levels is short
+constexpr uint64_t NUM_BLOCKS = 1000;
+constexpr size_t NUM_BARS = 3;
+
+/// What a level stored in `format` gives back for `level`
+static uint16_t quantise(uint16_t level, MusicVisBarFormat format) {
+    return format == MusicVisBarFormat::U8 ? (level / 257) * 257 : level;
+}
+
+static void checkPyramid(MusicVisBarFormat format) {
+    std::vector<uint16_t> bars(NUM_BLOCKS * NUM_BARS);
+    std::mt19937 rng(3000);
+    std::uniform_int_distribution<uint16_t> level(0, cosc::MAX_BAR_LEVEL);
+    for (auto &bar : bars) {
+        bar = level(rng);
+    }
+
+    // blocks come in chunks that don't line up with the rows
+    ::capnp::MallocMessageBuilder message;
+    auto spectrum = message.initRoot<MusicVisBars>();
+    spectrum.setBarFormat(format);
+    cosc::analysis::PyramidBuilder builder(NUM_BLOCKS, NUM_BARS);
+    builder.init(spectrum, format);
+    constexpr size_t batch = 7 * NUM_BARS;
+    for (size_t i = 0; i < bars.size(); i += batch) {
+        builder.add(std::span(bars).subspan(i, std::min(batch, bars.size() - i)));
+    }
+    builder.write(spectrum, format);
+
+    // 2, 4, ... 1024 blocks per row, the last being the whole song in one row
+    cosc::SpectrumPyramid pyramid(spectrum.asReader(), NUM_BARS);
+    CHECK(!pyramid.empty());
+    CHECK(spectrum.getPyramid().size() == 10);
+    for (size_t i = 0; i < spectrum.getPyramid().size(); i++) {
+        auto blocksPerRow = pyramid.getBlocksPerRow(i);
+        CHECK(blocksPerRow == uint64_t { 2 } << i);
+        auto rows = pyramid.getRows(i);
+        CHECK(rows == (NUM_BLOCKS + blocksPerRow - 1) / blocksPerRow);
+
+        std::vector<uint16_t> max(rows * NUM_BARS);
+        std::vector<uint16_t> mean(rows * NUM_BARS);
+        pyramid.read(i, 0, rows, max, mean);
+        for (size_t row = 0; row < rows; row++) {
+            auto begin = row * blocksPerRow;
+            auto end = std::min(begin + blocksPerRow, NUM_BLOCKS);
+            for (size_t bar = 0; bar < NUM_BARS; bar++) {
+                uint16_t expectedMax = 0;
+                uint64_t sum = 0;
+                for (auto block = begin; block < end; block++) {
+                    expectedMax = std::max(expectedMax, bars[(block * NUM_BARS) + bar]);
+                    sum += bars[(block * NUM_BARS) + bar];
+                }
+                auto count = end - begin;
+                auto expectedMean = static_cast<uint16_t>((sum + (count / 2)) / count);
+                CHECK(max[(row * NUM_BARS) + bar] == quantise(expectedMax, format));
+                CHECK(mean[(row * NUM_BARS) + bar] == quantise(expectedMean, format));
+            }
+        }
+
+        // reading past the last row only reads what's there
+        std::vector<uint16_t> tailMax(5 * NUM_BARS);
+        std::vector<uint16_t> tailMean(5 * NUM_BARS);
+        pyramid.read(i, rows - 1, 5, tailMax, tailMean);
+        CHECK(std::equal(max.end() - NUM_BARS, max.end(), tailMax.begin()));
+    }
+
+    // the coarsest level with at least one row per column
+    CHECK(pyramid.levelFor(NUM_BLOCKS, 100) == 2);
+    CHECK(pyramid.levelFor(NUM_BLOCKS, 1) == 8);
+    CHECK(!pyramid.levelFor(NUM_BLOCKS, NUM_BLOCKS).has_value());
+    CHECK(!pyramid.levelFor(NUM_BLOCKS, 0).has_value());
+}
+
+int main() {
+    checkPyramid(MusicVisBarFormat::U8);
+    checkPyramid(MusicVisBarFormat::U16);
+
+    // the pyramid can't be written until it has every block
+    ::capnp::MallocMessageBuilder message;
+    auto spectrum = message.initRoot<MusicVisBars>();
+    cosc::analysis::PyramidBuilder partial(NUM_BLOCKS, NUM_BARS);
+    partial.init(spectrum, MusicVisBarFormat::U8);
+    std::vector<uint16_t> some(10 * NUM_BARS);
+    partial.add(some);
+    CHECK_THROWS(partial.write(spectrum, MusicVisBarFormat::U8), std::logic_error);
+
+    // long songs skip the finest levels, so the pyramid stays a fraction of the spectrum's size
+    cosc::analysis::PyramidBuilder huge(uint64_t { 1 } << 24, 1);
+    huge.init(spectrum, MusicVisBarFormat::U8);
+    auto finest = spectrum.getPyramid()[0];
+    CHECK(finest.getBlocksPerRow() == 16);
+    CHECK(finest.getMaxBars().size() <= cosc::MAX_PYRAMID_BARS);
+
+    CHECK(cosc::SpectrumPyramid().empty());
+    return 0;
+}
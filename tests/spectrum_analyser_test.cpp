@@ -0,0 +1,88 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+// Checks how bars are stored: encodeBars() and decodeBars() in every format, with and without delta coding,
+// and bar counts too big for the old numBars field.
+#include "check.hpp"
+#include "cosc/spectrum_analyser.hpp"
+#include <capnp/message.h>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+/// Encodes and decodes `bars`
+static std::vector<uint16_t> roundTrip(
+    const std::vector<uint16_t> &bars, size_t numBars, MusicVisBarFormat format, bool delta) {
+    std::vector<uint8_t> encoded(bars.size() * cosc::analysis::bytesPerBar(format));
+    cosc::analysis::encodeBars(bars, numBars, format, delta, encoded);
+    std::vector<uint16_t> decoded(bars.size());
+    cosc::analysis::decodeBars(encoded, numBars, format, delta, decoded);
+    return decoded;
+}
+
+static void checkBars(MusicVisBarFormat format) {
+    // random levels, with a row of silence and a row at full scale, which deltas wrap around between
+    constexpr size_t numBars = 5;
+    constexpr size_t numBlocks = 40;
+    std::vector<uint16_t> bars(numBars * numBlocks);
+    std::mt19937 rng(3000);
+    std::uniform_int_distribution<uint16_t> level(0, cosc::MAX_BAR_LEVEL);
+    for (auto &bar : bars) {
+        bar = level(rng);
+    }
+    std::fill_n(bars.begin() + (10 * numBars), numBars, 0);
+    std::fill_n(bars.begin() + (11 * numBars), numBars, cosc::MAX_BAR_LEVEL);
+    std::fill_n(bars.begin() + (12 * numBars), numBars, 0);
+
+    auto plain = roundTrip(bars, numBars, format, false);
+    for (size_t i = 0; i < bars.size(); i++) {
+        auto expected = static_cast<int>(bars[i]);
+        auto actual = static_cast<int>(plain[i]);
+        switch (format) {
+        case MusicVisBarFormat::U8:
+            CHECK(actual == (expected / 257) * 257);
+            break;
+        case MusicVisBarFormat::U16:
+            CHECK(actual == expected);
+            break;
+        case MusicVisBarFormat::F16:
+            // 11 significant bits
+            CHECK(std::abs(actual - expected) <= (expected >> 11) + 1);
+            break;
+        }
+    }
+    for (size_t i = 10 * numBars; i < 13 * numBars; i++) {
+        CHECK(plain[i] == bars[i]);
+    }
+
+    // delta coding is lossless on top of the format, and decoded levels survive another round trip
+    CHECK(roundTrip(bars, numBars, format, true) == plain);
+    CHECK(roundTrip(plain, numBars, format, false) == plain);
+    CHECK(roundTrip(plain, numBars, format, true) == plain);
+}
+
+int main() {
+    CHECK(cosc::analysis::bytesPerBar(MusicVisBarFormat::U8) == 1);
+    CHECK(cosc::analysis::bytesPerBar(MusicVisBarFormat::U16) == 2);
+    CHECK(cosc::analysis::bytesPerBar(MusicVisBarFormat::F16) == 2);
+    for (auto format : { MusicVisBarFormat::U8, MusicVisBarFormat::U16, MusicVisBarFormat::F16 }) {
+        checkBars(format);
+    }
+
+    // numBars is only a UInt8, so bigger counts only go in barCount, and old files only have numBars
+    ::capnp::MallocMessageBuilder message;
+    auto header = message.initRoot<MusicVisBars>();
+    cosc::AnalysisParams params;
+    params.numBars = 4000;
+    params.barFormat = MusicVisBarFormat::U16;
+    cosc::analysis::setBarCount(header, params);
+    CHECK(header.getNumBars() == 0);
+    CHECK(cosc::analysis::getNumBars(header.asReader()) == 4000);
+    CHECK(header.getBarFormat() == MusicVisBarFormat::U16);
+    params.numBars = 32;
+    cosc::analysis::setBarCount(header, params);
+    CHECK(header.getNumBars() == 32);
+    CHECK(cosc::analysis::getNumBars(header.asReader()) == 32);
+    header.setBarCount(0);
+    CHECK(cosc::analysis::getNumBars(header.asReader()) == 32);
+    return 0;
+}
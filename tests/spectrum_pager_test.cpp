@@ -0,0 +1,111 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+// Writes a chunked spectrum with writeChunkedSpectrum() and reads it back with SpectrumPager, comparing every
+// block with the analyser's own output.
+#include "check.hpp"
+#include "cosc/spectrum_analyser.hpp"
+#include "cosc/spectrum_pager.hpp"
+#include <cmath>
+#include <fstream>
+#include <numbers>
+#include <random>
+#include <stdexcept>
+#include <unistd.h>
+#include <vector>
+
+constexpr uint32_t SAMPLE_RATE = 44100;
+constexpr unsigned int CHANNELS = 2;
+constexpr uint64_t CACHE_KEY = 0x1234'5678'9abc'def0;
+
+/// A sweep in the left channel, and noise in the right
+static std::vector<int32_t> makeAudio(uint64_t frames) {
+    std::vector<int32_t> pcm(frames * CHANNELS);
+    std::mt19937 rng(3000);
+    std::uniform_int_distribution<int32_t> noise(-(1 << 28), 1 << 28);
+    double phase = 0.0;
+    for (uint64_t i = 0; i < frames; i++) {
+        auto freq = 50.0 + (10'000.0 * static_cast<double>(i) / static_cast<double>(frames));
+        phase += 2.0 * std::numbers::pi * freq / SAMPLE_RATE;
+        pcm[i * CHANNELS] = static_cast<int32_t>(std::sin(phase) * (1 << 30));
+        pcm[(i * CHANNELS) + 1] = noise(rng);
+    }
+    return pcm;
+}
+
+static void checkRoundTrip(const std::vector<int32_t> &pcm, MusicVisBarFormat format, const fs::path &file) {
+    cosc::AnalysisParams params;
+    // lots of bars makes for small chunks, so a few seconds of audio spans several of them
+    params.numBars = 1024;
+    params.barFormat = format;
+    auto frames = pcm.size() / CHANNELS;
+    auto numBlocks = (frames + params.hopSize - 1) / params.hopSize;
+    CHECK(numBlocks > 3 * cosc::analysis::chunkBlocks(params));
+
+    // what the pager should give back: the analyser's bars at the precision of the format
+    std::vector<uint16_t> expectedBars;
+    std::vector<cosc::BlockFeatures> expectedFeatures;
+    cosc::analysis::analyseStream(
+        cosc::analysis::memorySource(pcm.data(), frames, CHANNELS), frames, CHANNELS, SAMPLE_RATE, params,
+        [&](uint64_t /* firstBlock */, std::span<const uint16_t> bars,
+            std::span<const cosc::BlockFeatures> features) {
+            expectedBars.insert(expectedBars.end(), bars.begin(), bars.end());
+            expectedFeatures.insert(expectedFeatures.end(), features.begin(), features.end());
+        },
+        false);
+    std::vector<uint8_t> encoded(expectedBars.size() * cosc::analysis::bytesPerBar(format));
+    cosc::analysis::encodeBars(expectedBars, params.numBars, format, false, encoded);
+    cosc::analysis::decodeBars(encoded, params.numBars, format, false, expectedBars);
+
+    cosc::analysis::writeChunkedSpectrum(file, CACHE_KEY,
+        cosc::analysis::memorySource(pcm.data(), frames, CHANNELS), frames, CHANNELS, SAMPLE_RATE, params);
+    CHECK(cosc::analysis::readCacheKey(file) == CACHE_KEY);
+
+    cosc::SpectrumPager pager(file);
+    CHECK(pager.getNumBlocks() == numBlocks);
+    CHECK(cosc::analysis::getNumBars(pager.getHeader()) == params.numBars);
+
+    // play through, then seek back to the start and the middle of a chunk
+    std::vector<uint64_t> order;
+    for (uint64_t block = 0; block < numBlocks; block++) {
+        order.push_back(block);
+    }
+    order.push_back(0);
+    order.push_back(cosc::analysis::chunkBlocks(params) + 7);
+    for (auto block : order) {
+        auto chunk = pager.get(block);
+        CHECK(chunk->first <= block && block < chunk->first + chunk->count);
+        auto i = block - chunk->first;
+        for (size_t bar = 0; bar < params.numBars; bar++) {
+            CHECK(chunk->bars[(i * params.numBars) + bar] == expectedBars[(block * params.numBars) + bar]);
+        }
+        const auto &features = chunk->features[i];
+        const auto &expected = expectedFeatures[block];
+        CHECK(features.spectralEnergy == expected.spectralEnergy);
+        CHECK(features.rms == expected.rms);
+        CHECK(features.centroid == expected.centroid);
+        CHECK(features.flux == expected.flux);
+        CHECK(features.lowEnergy == expected.lowEnergy);
+        CHECK(features.midEnergy == expected.midEnergy);
+        CHECK(features.highEnergy == expected.highEnergy);
+    }
+
+    // past the end is clamped to the last block
+    auto last = pager.get(numBlocks + 100);
+    CHECK(last->first + last->count == numBlocks);
+}
+
+int main() {
+    auto file = fs::temp_directory_path() / ("musicvis-pager-test-" + std::to_string(getpid()) + ".bin");
+    auto pcm = makeAudio(SAMPLE_RATE * 10);
+    for (auto format : { MusicVisBarFormat::U8, MusicVisBarFormat::U16, MusicVisBarFormat::F16 }) {
+        checkRoundTrip(pcm, format, file);
+    }
+
+    // anything that isn't a chunked spectrum is refused
+    std::ofstream(file, std::ios::binary | std::ios::trunc) << "definitely not a spectrum, just some text";
+    CHECK_THROWS(cosc::SpectrumPager { file }, std::runtime_error);
+    CHECK(cosc::analysis::readCacheKey(file) == 0);
+    fs::remove(file);
+    CHECK(cosc::analysis::readCacheKey(file) == 0);
+    return 0;
+}
@@ -0,0 +1,104 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+// Checks that TaskGraph runs tasks after their dependencies, on the right threads, overlapping where it can,
+// and that it stops and rethrows when a task throws.
+#include "check.hpp"
+#include "cosc/task_graph.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using Thread = cosc::TaskGraph::Thread;
+
+/// Waits for `flag` to be set by another task, failing the test if it takes too long, i.e. if the two tasks
+/// weren't run at the same time
+static void waitFor(const std::atomic<bool> &flag) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!flag.load()) {
+        CHECK(std::chrono::steady_clock::now() < deadline);
+        std::this_thread::yield();
+    }
+}
+
+int main() {
+    auto mainThread = std::this_thread::get_id();
+
+    // a diamond of worker and main thread tasks, like startup
+    {
+        cosc::TaskGraph graph;
+        std::mutex mutex;
+        std::vector<size_t> order;
+        auto task = [&](size_t id, Thread thread) {
+            return [&, id, thread]() {
+                CHECK((std::this_thread::get_id() == mainThread) == (thread == Thread::MAIN));
+                std::scoped_lock lock(mutex);
+                order.push_back(id);
+            };
+        };
+        auto a = graph.add("a", Thread::WORKER, task(0, Thread::WORKER));
+        auto b = graph.add("b", Thread::MAIN, task(1, Thread::MAIN));
+        auto c = graph.add("c", Thread::WORKER, task(2, Thread::WORKER), { a, b });
+        auto d = graph.add("d", Thread::MAIN, task(3, Thread::MAIN), { a });
+        graph.add("e", Thread::MAIN, task(4, Thread::MAIN), { c, d });
+        graph.run();
+        graph.logTimeline();
+
+        CHECK(order.size() == 5);
+        auto position = [&](size_t id) { return std::find(order.begin(), order.end(), id) - order.begin(); };
+        CHECK(position(0) < position(2) && position(1) < position(2));
+        CHECK(position(0) < position(3));
+        CHECK(position(2) < position(4) && position(3) < position(4));
+    }
+
+    // independent tasks overlap: two workers, and a worker with the main thread, each wait on the other
+    {
+        cosc::TaskGraph graph;
+        std::atomic<bool> first = false;
+        std::atomic<bool> second = false;
+        std::atomic<bool> fromMain = false;
+        std::atomic<bool> fromWorker = false;
+        graph.add("first", Thread::WORKER, [&]() {
+            first = true;
+            waitFor(second);
+        });
+        graph.add("second", Thread::WORKER, [&]() {
+            second = true;
+            waitFor(first);
+        });
+        graph.add("main", Thread::MAIN, [&]() {
+            fromMain = true;
+            waitFor(fromWorker);
+        });
+        graph.add("worker", Thread::WORKER, [&]() {
+            fromWorker = true;
+            waitFor(fromMain);
+        });
+        graph.run();
+    }
+
+    // a failed task stops its dependents, and run() rethrows once everything already running is done
+    for (auto thread : { Thread::WORKER, Thread::MAIN }) {
+        cosc::TaskGraph graph;
+        std::atomic<bool> slowFinished = false;
+        std::atomic<bool> dependentRan = false;
+        graph.add("slow", Thread::WORKER, [&]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            slowFinished = true;
+        });
+        auto failing = graph.add("failing", thread, []() { throw std::runtime_error("task failed"); });
+        graph.add("dependent", Thread::WORKER, [&]() { dependentRan = true; }, { failing });
+        CHECK_THROWS(graph.run(), std::runtime_error);
+        CHECK(slowFinished);
+        CHECK(!dependentRan);
+    }
+
+    // the graph can't have cycles, since tasks only depend on earlier ones
+    cosc::TaskGraph graph;
+    auto only = graph.add("only", Thread::MAIN, []() {});
+    CHECK_THROWS(graph.add("later", Thread::MAIN, []() {}, { only + 1 }), std::invalid_argument);
+    return 0;
+}
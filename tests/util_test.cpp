@@ -0,0 +1,115 @@
+// Copyright 2024 Matt Young.
+// SPDX-License-Identifier: ISC
+// Checks hashBytes() against reference XXH64 hashes, hashFile() against hashBytes(), and the half precision
+// float conversions.
+#include "check.hpp"
+#include "cosc/util.hpp"
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <span>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+/// An input and its XXH64 hash with seeds 0 and 12345, from the reference implementation
+struct HashVector {
+    std::string_view input;
+    uint64_t hash;
+    uint64_t seededHash;
+};
+
+// one of each path through hashBytes(): no stripes, only a tail, and 32 byte stripes with a tail
+constexpr std::array HASH_VECTORS = {
+    HashVector { "", 0xef46db3751d8e999, 0x95584af7701f808d },
+    HashVector { "a", 0xd24ec4f1a98c6e5b, 0x747b860523d69ab6 },
+    HashVector { "abc", 0x44bc2cf5ad770999, 0x01700e64f6f23509 },
+    HashVector { "Nobody inspects the spammish repetition", 0xfbcea83c8a378bf1, 0x081a876428a9313b },
+    HashVector { "The quick brown fox jumps over the lazy dog, twice: "
+                 "the quick brown fox jumps over the lazy dog",
+        0xa0a857380552a8e5, 0xf7fe31114d33019b },
+};
+
+static std::span<const uint8_t> bytesOf(std::string_view string) {
+    return { reinterpret_cast<const uint8_t *>(string.data()), string.size() };
+}
+
+/// A float and the half it rounds to
+struct HalfVector {
+    float value;
+    uint16_t half;
+};
+
+constexpr std::array HALF_VECTORS = {
+    HalfVector { 0.f, 0x0000 },
+    HalfVector { -0.f, 0x8000 },
+    HalfVector { 1.f, 0x3c00 },
+    HalfVector { -2.f, 0xc000 },
+    HalfVector { 1.f / 3.f, 0x3555 },
+    // largest half, then halfway to the next power of two, which rounds (to even) to infinity
+    HalfVector { 65504.f, 0x7bff },
+    HalfVector { 65520.f, 0x7c00 },
+    HalfVector { 1e10f, 0x7c00 },
+    HalfVector { -INFINITY, 0xfc00 },
+    // smallest normal, smallest subnormal, and ties either side of it
+    HalfVector { 0x1p-14f, 0x0400 },
+    HalfVector { 0x1p-24f, 0x0001 },
+    HalfVector { 0x1p-25f, 0x0000 },
+    HalfVector { 0x1.8p-24f, 0x0002 },
+    HalfVector { 0x1p-30f, 0x0000 },
+    // ties between normals round to even
+    HalfVector { 1.f + 0x1p-11f, 0x3c00 },
+    HalfVector { 1.f + 0x3p-11f, 0x3c02 },
+};
+
+static void checkHalves() {
+    for (const auto &vector : HALF_VECTORS) {
+        CHECK(cosc::util::floatToHalf(vector.value) == vector.half);
+    }
+    auto nan = cosc::util::floatToHalf(NAN);
+    CHECK((nan & 0x7c00) == 0x7c00 && (nan & 0x3ff) != 0);
+    CHECK(std::isnan(cosc::util::halfToFloat(nan)));
+
+    // every half is exactly a float, so the round trip is exact, and halves are in order
+    float last = -INFINITY;
+    for (uint32_t bits = 0; bits <= 0xffff; bits++) {
+        auto half = static_cast<uint16_t>(bits);
+        auto value = cosc::util::halfToFloat(half);
+        if (std::isnan(value)) {
+            CHECK((half & 0x7c00) == 0x7c00 && (half & 0x3ff) != 0);
+            continue;
+        }
+        CHECK(cosc::util::floatToHalf(value) == half);
+        if (half < 0x8000) {
+            CHECK(half == 0 || value > last);
+            last = value;
+        }
+    }
+}
+
+int main() {
+    for (const auto &vector : HASH_VECTORS) {
+        CHECK(cosc::util::hashBytes(bytesOf(vector.input)) == vector.hash);
+        CHECK(cosc::util::hashBytes(bytesOf(vector.input), 12345) == vector.seededHash);
+    }
+
+    // 103 bytes: three stripes, then a word, a half word and three bytes of tail
+    std::vector<uint8_t> sequence(103);
+    for (size_t i = 0; i < sequence.size(); i++) {
+        sequence[i] = static_cast<uint8_t>((i * 7) + 1);
+    }
+    CHECK(cosc::util::hashBytes(sequence) == 0xe954c7841d1305f7);
+
+    // hashFile() maps the file rather than reading it, but must agree, including on an empty file
+    auto file = fs::temp_directory_path() / ("musicvis-util-test-" + std::to_string(getpid()));
+    for (size_t size : { 103, 0 }) {
+        std::ofstream(file, std::ios::binary | std::ios::trunc)
+            .write(reinterpret_cast<const char *>(sequence.data()), static_cast<std::streamsize>(size));
+        CHECK(cosc::util::hashFile(file) == cosc::util::hashBytes(std::span(sequence).first(size)));
+    }
+    fs::remove(file);
+
+    checkHalves();
+    return 0;
+}